@@ -0,0 +1,307 @@
+//
+// mondo/RawBlobs.cpp
+//
+// Distributed under the Apache License, Version 2.0.
+// See the accompanying file LICENSE or
+// http://www.apache.org/licenses/LICENSE-2.0.html
+//
+
+#include "RawBlobs.h"
+
+#include <algorithm>
+
+using namespace mondo;
+
+namespace {
+
+// protobuf wire types
+constexpr uint32_t WIRE_VARINT = 0;
+constexpr uint32_t WIRE_FIXED64 = 1;
+constexpr uint32_t WIRE_LEN = 2;
+constexpr uint32_t WIRE_FIXED32 = 5;
+
+// field numbers from mondo.proto
+constexpr uint32_t INPUT_SECRET = 1;
+constexpr uint32_t INPUT_BLOBS = 2;
+constexpr uint32_t OUTPUT_SUCCESS = 1;
+constexpr uint32_t OUTPUT_BLOBS = 2;
+constexpr uint32_t BLOB_TYPE = 1;
+constexpr uint32_t BLOB_MSG = 2;
+
+constexpr size_t MAX_VARINT_SIZE = 10;
+
+// SliceReader walks the wire format across slice boundaries
+class SliceReader {
+public:
+    SliceReader(const std::vector<grpc::Slice>& slices, size_t begin, size_t end)
+        : _slices(slices), _remaining(end)
+    {
+        // Note: advance() also reduces _remaining to (end - begin)
+        advance(begin);
+    }
+
+    bool isDone() const { return _remaining == 0; }
+    size_t getRemaining() const { return _remaining; }
+    size_t getPosition() const { return _position; }
+
+    bool readByte(uint8_t& byte) {
+        if (_remaining == 0) {
+            return false;
+        }
+        byte = _slices[_sliceIndex].begin()[_offset];
+        advance(1);
+        return true;
+    }
+
+    bool readVarint(uint64_t& value) {
+        value = 0;
+        for (uint32_t shift = 0; shift < 64; shift += 7) {
+            uint8_t byte;
+            if (!readByte(byte)) {
+                return false;
+            }
+            value |= (uint64_t)(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool skip(size_t num_bytes) {
+        if (num_bytes > _remaining) {
+            return false;
+        }
+        advance(num_bytes);
+        return true;
+    }
+
+    // appends refcounted sub-slices of the next num_bytes
+    bool take(size_t num_bytes, std::vector<grpc::Slice>& slices) {
+        if (num_bytes > _remaining) {
+            return false;
+        }
+        while (num_bytes > 0) {
+            const grpc::Slice& slice = _slices[_sliceIndex];
+            size_t n = std::min(num_bytes, slice.size() - _offset);
+            slices.push_back(slice.sub(_offset, _offset + n));
+            advance(n);
+            num_bytes -= n;
+        }
+        return true;
+    }
+
+    bool skipField(uint32_t wire_type) {
+        uint64_t value;
+        switch (wire_type) {
+            case WIRE_VARINT:
+                return readVarint(value);
+            case WIRE_FIXED64:
+                return skip(8);
+            case WIRE_LEN:
+                return readVarint(value) && skip(value);
+            case WIRE_FIXED32:
+                return skip(4);
+            default:
+                // groups are deprecated and not expected
+                return false;
+        }
+    }
+
+private:
+    void advance(size_t num_bytes) {
+        _remaining -= std::min(num_bytes, _remaining);
+        _position += num_bytes;
+        _offset += num_bytes;
+        while (_sliceIndex < _slices.size() && _offset >= _slices[_sliceIndex].size()) {
+            _offset -= _slices[_sliceIndex].size();
+            ++_sliceIndex;
+        }
+    }
+
+private:
+    const std::vector<grpc::Slice>& _slices;
+    size_t _sliceIndex { 0 };
+    size_t _offset { 0 };
+    size_t _position { 0 };
+    size_t _remaining { 0 };
+};
+
+size_t encode_varint(uint64_t value, uint8_t* buffer) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        buffer[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    buffer[n++] = (uint8_t)value;
+    return n;
+}
+
+size_t varint_size(uint64_t value) {
+    size_t n = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        ++n;
+    }
+    return n;
+}
+
+uint8_t make_tag(uint32_t field, uint32_t wire_type) {
+    // Note: all our field numbers are small enough for single byte tags
+    return (uint8_t)((field << 3) | wire_type);
+}
+
+bool parse_blob(
+        SliceReader& reader,
+        const std::vector<grpc::Slice>& slices,
+        size_t size,
+        uint32_t& type,
+        std::vector<grpc::Slice>& msg_slices,
+        size_t& msg_size)
+{
+    SliceReader blob_reader(slices, reader.getPosition(), reader.getPosition() + size);
+    while (!blob_reader.isDone()) {
+        uint64_t tag;
+        if (!blob_reader.readVarint(tag)) {
+            return false;
+        }
+        uint32_t field = (uint32_t)(tag >> 3);
+        uint32_t wire_type = (uint32_t)(tag & 0x7);
+        if (field == BLOB_TYPE && wire_type == WIRE_VARINT) {
+            uint64_t value;
+            if (!blob_reader.readVarint(value)) {
+                return false;
+            }
+            type = (uint32_t)value;
+        } else if (field == BLOB_MSG && wire_type == WIRE_LEN) {
+            uint64_t length;
+            if (!blob_reader.readVarint(length)) {
+                return false;
+            }
+            // last one wins, as per protobuf rules
+            msg_slices.clear();
+            if (!blob_reader.take(length, msg_slices)) {
+                return false;
+            }
+            msg_size = length;
+        } else if (!blob_reader.skipField(wire_type)) {
+            return false;
+        }
+    }
+    return reader.skip(size);
+}
+
+} // anonymous namespace
+
+const uint8_t* BlobView::data() const {
+    if (_slices.empty()) {
+        static const uint8_t empty = 0;
+        return &empty;
+    }
+    return isContiguous() ? _slices[0].begin() : nullptr;
+}
+
+void BlobView::copyTo(std::string& msg) const {
+    msg.clear();
+    msg.reserve(_size);
+    for (const auto& slice : _slices) {
+        msg.append((const char*)slice.begin(), slice.size());
+    }
+}
+
+bool RawInput::parse(const grpc::ByteBuffer& buffer) {
+    clear();
+    std::vector<grpc::Slice> slices;
+    if (!buffer.Dump(&slices).ok()) {
+        return false;
+    }
+    size_t total = 0;
+    for (const auto& slice : slices) {
+        total += slice.size();
+    }
+
+    SliceReader reader(slices, 0, total);
+    while (!reader.isDone()) {
+        uint64_t tag;
+        if (!reader.readVarint(tag)) {
+            return false;
+        }
+        uint32_t field = (uint32_t)(tag >> 3);
+        uint32_t wire_type = (uint32_t)(tag & 0x7);
+        if (field == INPUT_SECRET && wire_type == WIRE_VARINT) {
+            if (!reader.readVarint(_secret)) {
+                return false;
+            }
+        } else if (field == INPUT_BLOBS && wire_type == WIRE_LEN) {
+            uint64_t length;
+            if (!reader.readVarint(length) || length > reader.getRemaining()) {
+                return false;
+            }
+            BlobView blob;
+            if (!parse_blob(reader, slices, length, blob._type, blob._slices, blob._size)) {
+                return false;
+            }
+            _blobs.push_back(std::move(blob));
+        } else if (!reader.skipField(wire_type)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void RawInput::clear() {
+    _blobs.clear();
+    _secret = 0;
+}
+
+void RawOutput::addBlob(uint32_t type, const grpc::Slice& msg) {
+    Entry entry;
+    entry.type = type;
+    entry.size = msg.size();
+    entry.slices.push_back(msg);
+    _entries.push_back(std::move(entry));
+}
+
+void RawOutput::addBlob(const BlobView& blob) {
+    Entry entry;
+    entry.type = blob.getType();
+    entry.size = blob.getSize();
+    entry.slices = blob.getSlices();
+    _entries.push_back(std::move(entry));
+}
+
+void RawOutput::serialize(grpc::ByteBuffer* buffer) const {
+    std::vector<grpc::Slice> slices;
+    slices.reserve(1 + 2 * _entries.size());
+    if (_success) {
+        const uint8_t success[] = { make_tag(OUTPUT_SUCCESS, WIRE_VARINT), 1 };
+        slices.emplace_back(success, sizeof(success));
+    }
+    for (const Entry& entry : _entries) {
+        // Blob = [type tag][type varint][msg tag][msg length varint][msg]
+        size_t blob_size = 1 + varint_size(entry.type) + 1 + varint_size(entry.size) + entry.size;
+
+        // Output.blobs header + Blob header go into one small slice
+        uint8_t header[3 + 3 * MAX_VARINT_SIZE];
+        size_t n = 0;
+        header[n++] = make_tag(OUTPUT_BLOBS, WIRE_LEN);
+        n += encode_varint(blob_size, header + n);
+        header[n++] = make_tag(BLOB_TYPE, WIRE_VARINT);
+        n += encode_varint(entry.type, header + n);
+        header[n++] = make_tag(BLOB_MSG, WIRE_LEN);
+        n += encode_varint(entry.size, header + n);
+        slices.emplace_back(header, n);
+
+        // msg slices are referenced, not copied
+        for (const auto& slice : entry.slices) {
+            slices.push_back(slice);
+        }
+    }
+    grpc::ByteBuffer output(slices.data(), slices.size());
+    buffer->Swap(&output);
+}
+
+void RawOutput::clear() {
+    _entries.clear();
+    _success = false;
+}
@@ -0,0 +1,110 @@
+//
+// mondo/RawBlobs.h
+//
+// Distributed under the Apache License, Version 2.0.
+// See the accompanying file LICENSE or
+// http://www.apache.org/licenses/LICENSE-2.0.html
+//
+# pragma once
+
+#include <string>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+namespace mondo {
+
+// This is a raw-serialization path for DataService.
+//
+// The normal path parses Input into a protobuf whose Blob.msg is a std::string
+// (copy #1) which the app then decodes (copy #2).  The raw path receives the
+// grpc::ByteBuffer as is (e.g. via the generated WithRawCallbackMethod_PollInOut)
+// and parses the Input wire format in place: each BlobView.msg references
+// the received slices without copying them.
+//
+// Slices are refcounted so a BlobView stays valid as long as it (or a copy)
+// lives, but the expected pattern is to tie its lifetime to the call.
+//
+// To use it mark PollInOut as raw on the service, for example:
+//
+//   class RawService : public DataService::WithRawCallbackMethod_PollInOut<DataService::CallbackService> {
+//       grpc::ServerUnaryReactor* PollInOut(
+//               grpc::CallbackServerContext* context,
+//               const grpc::ByteBuffer* request,
+//               grpc::ByteBuffer* reply) override;
+//   };
+//
+// and when using GrpcUtil::RpcMetrics: tell it about the raw method
+//
+//   metrics.addRawMethod("/mondo.DataService/PollInOut");
+
+// BlobView is a Blob whose msg is a list of slices of a received ByteBuffer.
+// Typically msg is a single slice, but large messages can arrive split
+// across several.
+class BlobView {
+public:
+    uint32_t getType() const { return _type; }
+    size_t getSize() const { return _size; }
+
+    const std::vector<grpc::Slice>& getSlices() const { return _slices; }
+
+    // when true data() can be used without copying
+    bool isContiguous() const { return _slices.size() < 2; }
+
+    // returns pointer to msg bytes, or nullptr when not contiguous
+    const uint8_t* data() const;
+
+    // copies msg bytes into 'msg' (use only when !isContiguous())
+    void copyTo(std::string& msg) const;
+
+private:
+    friend class RawInput;
+    std::vector<grpc::Slice> _slices;
+    size_t _size { 0 };
+    uint32_t _type { 0 };
+};
+
+// RawInput parses a serialized mondo::Input in place
+class RawInput {
+public:
+    // returns false when buffer is malformed
+    bool parse(const grpc::ByteBuffer& buffer);
+
+    uint64_t getSecret() const { return _secret; }
+    const std::vector<BlobView>& getBlobs() const { return _blobs; }
+
+    void clear();
+
+private:
+    std::vector<BlobView> _blobs;
+    uint64_t _secret { 0 };
+};
+
+// RawOutput serializes a mondo::Output whose Blob msgs
+// are referenced rather than copied into the ByteBuffer
+class RawOutput {
+public:
+    void setSuccess(bool success) { _success = success; }
+
+    // msg is referenced (refcount) not copied
+    void addBlob(uint32_t type, const grpc::Slice& msg);
+
+    // forward a received blob without copying
+    void addBlob(const BlobView& blob);
+
+    // builds ByteBuffer out of small header slices and the msg slices
+    void serialize(grpc::ByteBuffer* buffer) const;
+
+    void clear();
+
+private:
+    struct Entry {
+        std::vector<grpc::Slice> slices;
+        size_t size { 0 };
+        uint32_t type { 0 };
+    };
+    std::vector<Entry> _entries;
+    bool _success { false };
+};
+
+} // namespace mondo
@@ -0,0 +1,250 @@
+//
+// test_RawBlobs.cpp
+//
+//  Distributed under the Apache License, Version 2.0.
+//  See the accompanying file LICENSE or
+//  http://www.apache.org/licenses/LICENSE-2.0.html
+//
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "mondo.pb.h"
+#include <RawBlobs.h>
+
+// helpers
+
+// splits bytes into slices at the given offsets
+grpc::ByteBuffer make_buffer(const std::string& bytes, const std::vector<size_t>& splits) {
+    std::vector<grpc::Slice> slices;
+    size_t begin = 0;
+    for (size_t split : splits) {
+        slices.emplace_back(bytes.data() + begin, split - begin);
+        begin = split;
+    }
+    slices.emplace_back(bytes.data() + begin, bytes.size() - begin);
+    return grpc::ByteBuffer(slices.data(), slices.size());
+}
+
+// splits bytes into slices of slice_size bytes
+grpc::ByteBuffer make_buffer(const std::string& bytes, size_t slice_size) {
+    std::vector<size_t> splits;
+    for (size_t split = slice_size; split < bytes.size(); split += slice_size) {
+        splits.push_back(split);
+    }
+    return make_buffer(bytes, splits);
+}
+
+std::string to_string(const grpc::ByteBuffer& buffer) {
+    std::vector<grpc::Slice> slices;
+    std::string bytes;
+    EXPECT_TRUE(buffer.Dump(&slices).ok());
+    for (const grpc::Slice& slice : slices) {
+        bytes.append((const char*)slice.begin(), slice.size());
+    }
+    return bytes;
+}
+
+std::string to_string(const mondo::BlobView& blob) {
+    std::string msg;
+    blob.copyTo(msg);
+    return msg;
+}
+
+mondo::Input make_input() {
+    mondo::Input input;
+    input.set_secret(123456789012ULL);
+    // types and sizes chosen so varints have one, two and three bytes
+    const uint32_t types[] = { 0, 1, 300, 70000 };
+    const size_t sizes[] = { 0, 5, 200, 20000 };
+    for (size_t i = 0; i < 4; ++i) {
+        mondo::Blob* blob = input.add_blobs();
+        blob->set_type(types[i]);
+        std::string msg(sizes[i], 'a');
+        for (size_t j = 0; j < msg.size(); ++j) {
+            msg[j] = (char)('a' + (i + j) % 26);
+        }
+        blob->set_msg(msg);
+    }
+    return input;
+}
+
+void expect_equal(const mondo::Input& input, const mondo::RawInput& raw) {
+    EXPECT_EQ(input.secret(), raw.getSecret());
+    ASSERT_EQ(input.blobs_size(), raw.getBlobs().size());
+    for (int32_t i = 0; i < input.blobs_size(); ++i) {
+        const mondo::BlobView& blob = raw.getBlobs()[i];
+        EXPECT_EQ(input.blobs(i).type(), blob.getType());
+        EXPECT_EQ(input.blobs(i).msg().size(), blob.getSize());
+        EXPECT_EQ(input.blobs(i).msg(), to_string(blob));
+        if (blob.isContiguous()) {
+            EXPECT_EQ(0, input.blobs(i).msg().compare(0, blob.getSize(), (const char*)blob.data(), blob.getSize()));
+        }
+    }
+}
+
+TEST(RawBlobs_test, round_trip) {
+    mondo::Input input = make_input();
+    std::string bytes;
+    ASSERT_TRUE(input.SerializeToString(&bytes));
+
+    // parse protoc output, in one slice and in many
+    for (size_t slice_size : { bytes.size(), (size_t)4096, (size_t)7 }) {
+        mondo::RawInput raw;
+        ASSERT_TRUE(raw.parse(make_buffer(bytes, slice_size)));
+        expect_equal(input, raw);
+
+        // forward the blobs and parse the result with protoc code
+        mondo::RawOutput output;
+        output.setSuccess(true);
+        for (const mondo::BlobView& blob : raw.getBlobs()) {
+            output.addBlob(blob);
+        }
+        output.addBlob(42, grpc::Slice(std::string("extra")));
+        grpc::ByteBuffer buffer;
+        output.serialize(&buffer);
+
+        mondo::Output parsed;
+        ASSERT_TRUE(parsed.ParseFromString(to_string(buffer)));
+        EXPECT_TRUE(parsed.success());
+        ASSERT_EQ(input.blobs_size() + 1, parsed.blobs_size());
+        for (int32_t i = 0; i < input.blobs_size(); ++i) {
+            EXPECT_EQ(input.blobs(i).type(), parsed.blobs(i).type());
+            EXPECT_EQ(input.blobs(i).msg(), parsed.blobs(i).msg());
+        }
+        EXPECT_EQ(42, parsed.blobs(input.blobs_size()).type());
+        EXPECT_EQ("extra", parsed.blobs(input.blobs_size()).msg());
+    }
+
+    // empty Input and empty Output
+    mondo::RawInput raw;
+    EXPECT_TRUE(raw.parse(make_buffer(std::string(), 1)));
+    EXPECT_EQ(0, raw.getSecret());
+    EXPECT_TRUE(raw.getBlobs().empty());
+    mondo::RawOutput output;
+    grpc::ByteBuffer buffer;
+    output.serialize(&buffer);
+    mondo::Output parsed;
+    EXPECT_TRUE(parsed.ParseFromString(to_string(buffer)));
+    EXPECT_FALSE(parsed.success());
+}
+
+TEST(RawBlobs_test, fields_split_across_slices) {
+    // small enough to try every split point: the secret's varint, the
+    // length prefixes and the msgs all get cut somewhere
+    mondo::Input input;
+    input.set_secret(0xfedcba9876ULL);
+    for (uint32_t i = 0; i < 3; ++i) {
+        mondo::Blob* blob = input.add_blobs();
+        blob->set_type(200 + i);
+        blob->set_msg(std::string(130 + i, (char)('x' + i)));
+    }
+    std::string bytes;
+    ASSERT_TRUE(input.SerializeToString(&bytes));
+
+    for (size_t split = 1; split < bytes.size(); ++split) {
+        mondo::RawInput raw;
+        ASSERT_TRUE(raw.parse(make_buffer(bytes, std::vector<size_t>{ split }))) << "split=" << split;
+        expect_equal(input, raw);
+    }
+    for (size_t split = 1; split + 1 < bytes.size(); ++split) {
+        mondo::RawInput raw;
+        ASSERT_TRUE(raw.parse(make_buffer(bytes, std::vector<size_t>{ split, split + 1 }))) << "split=" << split;
+        expect_equal(input, raw);
+    }
+
+    // one byte per slice
+    mondo::RawInput raw;
+    ASSERT_TRUE(raw.parse(make_buffer(bytes, 1)));
+    expect_equal(input, raw);
+    EXPECT_FALSE(raw.getBlobs()[0].isContiguous());
+    EXPECT_EQ(nullptr, raw.getBlobs()[0].data());
+}
+
+TEST(RawBlobs_test, unknown_fields_are_skipped) {
+    // Input { secret=5, <unknown fields>, blobs { type=7, <unknown>, msg="hi" } }
+    std::string bytes;
+    bytes += "\x08\x05"; // secret = 5
+    bytes += "\x38\x96\x01"; // field 7 varint = 150
+    bytes += std::string("\x41" "12345678", 9); // field 8 fixed64
+    bytes += "\x4a\x03" "abc"; // field 9 length-delimited
+    bytes += std::string("\x55" "1234", 5); // field 10 fixed32
+    std::string blob;
+    blob += "\x08\x07"; // type = 7
+    blob += "\x18\x01"; // field 3 varint
+    blob += "\x12\x02" "hi"; // msg = "hi"
+    blob += std::string("\x22\x00", 2); // field 4 length-delimited, empty
+    bytes += "\x12";
+    bytes += (char)blob.size();
+    bytes += blob;
+
+    // protoc agrees that this is a valid Input
+    mondo::Input input;
+    ASSERT_TRUE(input.ParseFromString(bytes));
+
+    for (size_t slice_size : { bytes.size(), (size_t)3, (size_t)1 }) {
+        mondo::RawInput raw;
+        ASSERT_TRUE(raw.parse(make_buffer(bytes, slice_size)));
+        expect_equal(input, raw);
+        EXPECT_EQ(5, raw.getSecret());
+        ASSERT_EQ(1, raw.getBlobs().size());
+        EXPECT_EQ(7, raw.getBlobs()[0].getType());
+        EXPECT_EQ("hi", to_string(raw.getBlobs()[0]));
+    }
+}
+
+TEST(RawBlobs_test, malformed_input_is_rejected) {
+    mondo::Input input = make_input();
+    std::string bytes;
+    ASSERT_TRUE(input.SerializeToString(&bytes));
+
+    // truncated anywhere inside the last blob
+    size_t last_blob_size = input.blobs(input.blobs_size() - 1).ByteSizeLong();
+    size_t last_blob_start = bytes.size() - last_blob_size;
+    for (size_t size = last_blob_start - 1; size < bytes.size(); size += 97) {
+        mondo::RawInput raw;
+        EXPECT_FALSE(raw.parse(make_buffer(bytes.substr(0, size), 7))) << "size=" << size;
+    }
+    {
+        // truncated inside the secret varint
+        mondo::RawInput raw;
+        EXPECT_FALSE(raw.parse(make_buffer(bytes.substr(0, 3), 1)));
+    }
+    {
+        // overlong varint: more than ten bytes
+        std::string overlong = "\x08" + std::string(10, '\xff') + "\x01";
+        mondo::RawInput raw;
+        EXPECT_FALSE(raw.parse(make_buffer(overlong, 4)));
+    }
+    {
+        // blob length prefix larger than what remains
+        std::string too_long = "\x08\x05" "\x12\x64" "\x08\x01";
+        mondo::RawInput raw;
+        EXPECT_FALSE(raw.parse(make_buffer(too_long, 1)));
+    }
+    {
+        // msg length prefix larger than its blob
+        std::string too_long = "\x12\x06" "\x08\x01" "\x12\x05" "ab";
+        mondo::RawInput raw;
+        EXPECT_FALSE(raw.parse(make_buffer(too_long, 2)));
+    }
+    {
+        // unknown field with a length beyond the end
+        std::string too_long = "\x4a\x10" "abc";
+        mondo::RawInput raw;
+        EXPECT_FALSE(raw.parse(make_buffer(too_long, 1)));
+    }
+    {
+        // groups (wire types 3 and 4) are not supported
+        std::string group = "\x0b\x0c";
+        mondo::RawInput raw;
+        EXPECT_FALSE(raw.parse(make_buffer(group, 1)));
+    }
+}
+
+int main(int32_t argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
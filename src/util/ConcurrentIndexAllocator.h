@@ -0,0 +1,159 @@
+//
+// ConcurrentIndexAllocator.h
+//
+// Distributed under the Apache License, Version 2.0.
+// See the accompanying file LICENSE or
+// http://www.apache.org/licenses/LICENSE-2.0.html
+//
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// ConcurrentIndexAllocator is an IndexAllocator which many threads may use
+// at once, e.g. to spawn entities from ThreadPool tasks.
+//
+// New indices come from a lock-free bump counter.  Freed indices go into a
+// small cache picked by the calling thread (one of NUM_SHARDS, so threads
+// rarely share one and its lock is uncontended) and overflow to a shared
+// pool in batches of BATCH_SIZE, from which an empty cache refills in
+// batches.  So the shared lock is taken at most once per BATCH_SIZE frees
+// or allocations.  When the bump counter hits the max, allocate() scavenges
+// the other threads' caches before it gives up.
+//
+// Differences from IndexAllocator:
+//   * recycling is not lowest-index-first: a thread gets back what it
+//     (or its batch) freed most recently, which keeps caches warm
+//   * getNumLive() and getNumFree() are approximate while other threads
+//     are allocating or freeing
+//   * double-free is NOT detected and would hand the index out twice
+//   * clear() must not race with anything
+//
+// NOTE: Index_t can be: int32_t or int16_t
+
+template <typename Index_t>
+class ConcurrentIndexAllocator {
+public:
+    static constexpr Index_t INVALID_INDEX{-1};
+    static constexpr size_t BATCH_SIZE = 64;
+    static constexpr size_t NUM_SHARDS = 32;
+
+    explicit ConcurrentIndexAllocator(Index_t max_num_elements, Index_t preallocated_num_elements = 0) :
+        _shards(new Shard[NUM_SHARDS]),
+        _maxNumElements(max_num_elements),
+        _nextNewIndex(preallocated_num_elements)
+    {
+    }
+
+    bool check(Index_t idx) const {
+        return ((idx >= 0) && (idx < _nextNewIndex.load(std::memory_order_acquire)));
+    }
+    Index_t getNumLive() const {
+        return getNumAllocated() - getNumFree();
+    }
+    Index_t getNumFree() const {
+        return _numFree.load(std::memory_order_relaxed);
+    }
+    Index_t getNumAllocated() const {
+        return _nextNewIndex.load(std::memory_order_relaxed);
+    }
+
+    Index_t allocate() {
+        Shard& shard = getShard();
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            if (!shard.indices.empty() || refill(shard)) {
+                return popFree(shard);
+            }
+        }
+
+        // bump
+        Index_t idx = _nextNewIndex.load(std::memory_order_relaxed);
+        while (idx < _maxNumElements) {
+            if (_nextNewIndex.compare_exchange_weak(idx, idx + 1, std::memory_order_acq_rel)) {
+                return idx;
+            }
+        }
+
+        // full: maybe other threads are sitting on free indices
+        for (size_t i = 0; i < NUM_SHARDS && getNumFree() > 0; ++i) {
+            Shard& other = _shards[i];
+            std::lock_guard<std::mutex> lock(other.mutex);
+            if (!other.indices.empty() || refill(other)) {
+                return popFree(other);
+            }
+        }
+        return INVALID_INDEX;
+    }
+
+    void free(Index_t idx) {
+        if (!check(idx)) {
+            return;
+        }
+        Shard& shard = getShard();
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.indices.push_back(idx);
+        _numFree.fetch_add(1, std::memory_order_relaxed);
+        if (shard.indices.size() >= 2 * BATCH_SIZE) {
+            // spill the oldest batch: keep the recently freed ones local
+            std::lock_guard<std::mutex> pool_lock(_poolMutex);
+            _pool.insert(_pool.end(), shard.indices.begin(), shard.indices.begin() + BATCH_SIZE);
+            shard.indices.erase(shard.indices.begin(), shard.indices.begin() + BATCH_SIZE);
+        }
+    }
+
+    // Note: not thread-safe
+    void clear() {
+        for (size_t i = 0; i < NUM_SHARDS; ++i) {
+            _shards[i].indices.clear();
+        }
+        _pool.clear();
+        _numFree.store(0, std::memory_order_relaxed);
+        _nextNewIndex.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::vector<Index_t> indices;
+    };
+
+    Shard& getShard() {
+        static std::atomic<uint32_t> num_threads { 0 };
+        static thread_local uint32_t thread_id = num_threads.fetch_add(1, std::memory_order_relaxed);
+        return _shards[thread_id % NUM_SHARDS];
+    }
+
+    // moves a batch from the pool to shard, returns false if the pool is empty
+    // Note: call this with shard.mutex held
+    bool refill(Shard& shard) {
+        std::lock_guard<std::mutex> pool_lock(_poolMutex);
+        if (_pool.empty()) {
+            return false;
+        }
+        size_t num_indices = std::min(_pool.size(), BATCH_SIZE);
+        shard.indices.insert(shard.indices.end(), _pool.end() - num_indices, _pool.end());
+        _pool.resize(_pool.size() - num_indices);
+        return true;
+    }
+
+    // Note: call this with shard.mutex held and shard.indices not empty
+    Index_t popFree(Shard& shard) {
+        Index_t idx = shard.indices.back();
+        shard.indices.pop_back();
+        _numFree.fetch_sub(1, std::memory_order_relaxed);
+        return idx;
+    }
+
+private:
+    std::unique_ptr<Shard[]> _shards;
+    std::mutex _poolMutex;
+    std::vector<Index_t> _pool; // guarded by _poolMutex
+    Index_t _maxNumElements;
+    std::atomic<Index_t> _nextNewIndex{0};
+    std::atomic<Index_t> _numFree{0};
+};
@@ -0,0 +1,128 @@
+//
+// ConcurrentRecentHistory.h
+//
+// Distributed under the Apache License, Version 2.0.
+// See the accompanying file LICENSE or
+// http://www.apache.org/licenses/LICENSE-2.0.html
+//
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+
+#include "RingUtil.h"
+
+// ConcurrentRecentHistory is a RecentHistory with one producer thread and any
+// number of consumer threads, e.g. ThreadPool tasks which serialize deltas
+// for different sessions in parallel while the simulation keeps pushing.
+//
+// Like RecentHistory the event which advanced the history from version v to
+// v+1 lives in slot (v & mask) of a power-of-two ring.  Each slot also holds
+// the version of its event, which acts as a seqlock: the producer marks the
+// slot as being written, writes the event, then publishes the slot version
+// and finally the history version with release stores.  A consumer loads the
+// history version with acquire, then for each slot checks the slot version,
+// copies the event out and checks the slot version again: if either check
+// fails the producer lapped the consumer and the event is lost.  Consumers
+// never block the producer and never see a torn event.
+//
+// NOTE: Event must be trivially copyable since consumers copy it while the
+// producer may be overwriting it (the copy is discarded when that happens).
+// Only the producer thread may call push() or clearAndSetVersion(), and the
+// latter must not race with consumers.
+
+template < typename Event >
+class ConcurrentRecentHistory {
+public:
+    static_assert(std::is_trivially_copyable<Event>::value, "Event must be trivially copyable");
+    static constexpr uint32_t MAX_RING_CAPACITY = RingUtil::MAX_RING_CAPACITY;
+
+    class Consumer {
+    public:
+        uint64_t getVersion() const { return _version; }
+        void setVersion(uint64_t version) { _version = version; }
+        virtual void consumeEvent(const Event& event) = 0;
+    private:
+        uint64_t _version {0};
+    };
+
+    ConcurrentRecentHistory(uint32_t ring_capacity) {
+        _ringCapacity = RingUtil::roundUpCapacity(ring_capacity);
+        _mask = _ringCapacity - 1;
+        _slots.reset(new Slot[_ringCapacity]);
+    }
+
+    uint32_t getCapacity() const { return _ringCapacity; }
+
+    uint64_t getVersion() const { return _version.load(std::memory_order_acquire); }
+
+    // Note: producer thread only, and not while consumers are advancing
+    void clearAndSetVersion(uint64_t version) {
+        for (uint32_t i = 0; i < _ringCapacity; ++i) {
+            _slots[i].version.store(WRITING, std::memory_order_relaxed);
+        }
+        _version.store(version, std::memory_order_release);
+    }
+
+    // Note: producer thread only
+    void push(const Event& event) {
+        uint64_t version = _version.load(std::memory_order_relaxed);
+        Slot& slot = _slots[version & _mask];
+        slot.version.store(WRITING, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.event = event;
+        slot.version.store(version, std::memory_order_release);
+        _version.store(version + 1, std::memory_order_release);
+    }
+
+    // Delivers the events since consumer's version and returns true, else
+    // returns false when consumer wants a future version or one lost to
+    // history.  If the producer laps the consumer midway the events already
+    // delivered are kept: consumer's version is advanced past them.
+    template<typename Consumer_t>
+    bool advanceConsumer(Consumer_t& consumer) const {
+        uint64_t version = consumer.getVersion();
+        uint64_t head = _version.load(std::memory_order_acquire);
+        if (version > head) {
+            // wants a future version --> fail
+            return false;
+        }
+        bool success = true;
+        while (version != head) {
+            const Slot& slot = _slots[version & _mask];
+            if (slot.version.load(std::memory_order_acquire) != version) {
+                // overwritten (or being overwritten) --> lost to history
+                success = false;
+                break;
+            }
+            Event event = slot.event;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.version.load(std::memory_order_relaxed) != version) {
+                // overwritten while we copied it --> discard the copy
+                success = false;
+                break;
+            }
+            consumer.consumeEvent(event);
+            ++version;
+        }
+        consumer.setVersion(version);
+        return success;
+    }
+
+private:
+    static constexpr uint64_t WRITING = UINT64_MAX;
+
+    struct Slot {
+        std::atomic<uint64_t> version { WRITING };
+        Event event;
+    };
+
+private:
+    // the producer bumps _version on every push: keep it off the slots' cache lines
+    alignas(64) std::atomic<uint64_t> _version {0};
+    alignas(64) std::unique_ptr<Slot[]> _slots;
+    uint32_t _ringCapacity {0};
+    uint32_t _mask {0};
+};
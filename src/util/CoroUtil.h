@@ -0,0 +1,257 @@
+//
+// CoroUtil.h
+//
+// Distributed under the Apache License, Version 2.0.
+// See the accompanying file LICENSE or
+// http://www.apache.org/licenses/LICENSE-2.0.html
+//
+#pragma once
+
+#if !defined(__cpp_impl_coroutine)
+#error "CoroUtil.h requires C++20 coroutines: configure with -DSFERAMONDO_COROUTINES=ON"
+#endif
+
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "ThreadPool.h"
+
+// C++20 coroutines on a ThreadPool (opt-in: build with SFERAMONDO_COROUTINES)
+//
+// CoroUtil::Task<T> is a lazy coroutine: it does nothing until it is
+// co_await'ed, and when it finishes it resumes its awaiter directly
+// (symmetric transfer) so a chain of Tasks runs without bouncing through
+// a queue or blocking a thread on a future.
+//
+// co_await resumeOn(pool) moves the rest of the coroutine onto a pool worker.
+// The pool task only captures the coroutine handle, so it sits inline in the
+// ThreadPool::Task: the only allocation is the coroutine frame itself.
+//
+// For gRPC see GrpcUtil::AwaitableCall, which resumes the awaiting coroutine
+// when the Client is done with the Call.
+//
+// Example:
+//
+//     CoroUtil::Task<int32_t> fetchScore(ThreadPool& pool, FubarClient& client) {
+//         auto call = std::make_unique<BarCall>();
+//         bool ok = co_await GrpcUtil::asyncCall(client, *call, &pool);
+//         // now on a pool worker
+//         co_return ok ? call->getReply().bazz() : 0;
+//     }
+//
+//     CoroUtil::Task<> update(ThreadPool& pool, FubarClient& client) {
+//         co_await CoroUtil::resumeOn(pool);
+//         int32_t score = co_await fetchScore(pool, client);
+//         ...
+//     }
+//
+//     CoroUtil::detach(update(pool, client)); // fire and forget
+//     CoroUtil::syncWait(update(pool, client)); // or block until done
+//
+namespace CoroUtil {
+
+template<typename T = void>
+class Task;
+
+namespace detail {
+
+struct PromiseBase {
+    // resumes whoever awaited us, or nobody
+    struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+        template<typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            std::coroutine_handle<> continuation = handle.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+        void await_resume() const noexcept { }
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    FinalAwaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() { exception = std::current_exception(); }
+
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+};
+
+template<typename T>
+struct Promise : PromiseBase {
+    Task<T> get_return_object();
+
+    template<typename U>
+    void return_value(U&& value) { result.emplace(std::forward<U>(value)); }
+
+    T getResult() {
+        if (exception) {
+            std::rethrow_exception(exception);
+        }
+        return std::move(*result);
+    }
+
+    std::optional<T> result;
+};
+
+template<>
+struct Promise<void> : PromiseBase {
+    Task<void> get_return_object();
+    void return_void() { }
+    void getResult() {
+        if (exception) {
+            std::rethrow_exception(exception);
+        }
+    }
+};
+
+// Detached runs eagerly and destroys itself when done
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() const noexcept { return {}; }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() const noexcept { }
+        // like an exception escaping a std::thread
+        void unhandled_exception() const noexcept { std::terminate(); }
+    };
+};
+
+} // namespace detail
+
+template<typename T>
+class Task {
+public:
+    using promise_type = detail::Promise<T>;
+    using Handle = std::coroutine_handle<promise_type>;
+
+    Task() = default;
+    explicit Task(Handle handle) : _handle(handle) { }
+
+    Task(Task&& other) noexcept : _handle(std::exchange(other._handle, nullptr)) { }
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            reset();
+            _handle = std::exchange(other._handle, nullptr);
+        }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() { reset(); }
+
+    bool isValid() const { return bool(_handle); }
+
+    // awaitable: starts the coroutine and resumes the awaiter when it is done
+    // Note: awaiting a Task rethrows its exception
+    bool await_ready() const noexcept { return !_handle || _handle.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+        _handle.promise().continuation = awaiter;
+        return _handle;
+    }
+    T await_resume() { return _handle.promise().getResult(); }
+
+private:
+    void reset() {
+        if (_handle) {
+            _handle.destroy();
+            _handle = nullptr;
+        }
+    }
+
+private:
+    Handle _handle;
+};
+
+template<typename T>
+Task<T> detail::Promise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> detail::Promise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+// co_await resumeOn(pool) continues the coroutine on a pool worker
+class PoolAwaiter {
+public:
+    PoolAwaiter(ThreadPool& pool, ThreadPool::Priority priority) : _pool(pool), _priority(priority) { }
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) {
+        _pool.post(_priority, [handle] { handle.resume(); });
+    }
+    void await_resume() const noexcept { }
+
+private:
+    ThreadPool& _pool;
+    ThreadPool::Priority _priority;
+};
+
+inline PoolAwaiter resumeOn(ThreadPool& pool, ThreadPool::Priority priority = ThreadPool::Priority::NORMAL) {
+    return PoolAwaiter(pool, priority);
+}
+
+namespace detail {
+
+template<typename T>
+struct SyncState {
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::conditional_t<std::is_void_v<T>, bool, std::optional<T>> result {};
+    std::exception_ptr exception;
+    bool done { false };
+};
+
+template<typename T>
+Detached runSync(Task<T>& task, SyncState<T>& state) {
+    try {
+        if constexpr (std::is_void_v<T>) {
+            co_await task;
+        } else {
+            state.result.emplace(co_await task);
+        }
+    } catch (...) {
+        state.exception = std::current_exception();
+    }
+    // notify under the lock: syncWait() may return (and destroy state)
+    // as soon as we release it
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.done = true;
+    state.condition.notify_one();
+}
+
+inline Detached runDetached(Task<void> task) {
+    co_await task;
+}
+
+} // namespace detail
+
+// runs task and blocks the calling thread until it is done
+// Note: don't call this on a pool worker which the task needs
+template<typename T>
+T syncWait(Task<T> task) {
+    detail::SyncState<T> state;
+    detail::runSync(task, state);
+    std::unique_lock<std::mutex> lock(state.mutex);
+    state.condition.wait(lock, [&state] { return state.done; });
+    if (state.exception) {
+        std::rethrow_exception(state.exception);
+    }
+    if constexpr (!std::is_void_v<T>) {
+        return std::move(*state.result);
+    }
+}
+
+// starts task on the calling thread and lets it run to completion on its own
+// Note: an exception escaping a detached task calls std::terminate()
+inline void detach(Task<void> task) {
+    detail::runDetached(std::move(task));
+}
+
+} // namespace CoroUtil
@@ -0,0 +1,111 @@
+//
+// GenerationalIndexAllocator.h
+//
+// Distributed under the Apache License, Version 2.0.
+// See the accompanying file LICENSE or
+// http://www.apache.org/licenses/LICENSE-2.0.html
+//
+#pragma once
+
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+#include "IndexAllocator.h"
+
+// GenerationalIndexAllocator hands out Handles which pack an index (low bits)
+// with the generation of its slot (high bits), so a handle which outlives
+// its entity can be told apart from the handle of whoever reuses the index.
+//
+// Each slot's generation is bumped on allocate and again on free, so it is
+// odd while the slot is live and even while it is free: isValid() is one
+// load and compare from a dense generation array, and a stale handle can't
+// be freed twice.
+//
+// NOTE: Index_t can be: int32_t (64-bit Handle, 32-bit generation) or
+// int16_t (32-bit Handle, 16-bit generation).  Generations wrap, so after
+// 2^31 (or 2^15) reuses of one index an ancient handle could match again.
+
+template <typename Index_t>
+class GenerationalIndexAllocator {
+public:
+    using Handle = std::conditional_t<sizeof(Index_t) <= 2, uint32_t, uint64_t>;
+    using Generation = std::conditional_t<sizeof(Index_t) <= 2, uint16_t, uint32_t>;
+
+    static constexpr Handle INVALID_HANDLE{ Handle(-1) };
+    static constexpr uint32_t INDEX_BITS = 8 * sizeof(Index_t);
+
+    explicit GenerationalIndexAllocator(Index_t max_num_elements) :
+        _indices(max_num_elements)
+    {
+    }
+
+    static Handle makeHandle(Index_t idx, Generation generation) {
+        return (Handle(generation) << INDEX_BITS) | Handle(std::make_unsigned_t<Index_t>(idx));
+    }
+    static Index_t getIndex(Handle handle) {
+        return (Index_t)std::make_unsigned_t<Index_t>(handle);
+    }
+    static Generation getGeneration(Handle handle) {
+        return (Generation)(handle >> INDEX_BITS);
+    }
+
+    // true when handle names a live slot: an even generation never does,
+    // even if it matches a free slot
+    bool isValid(Handle handle) const {
+        Index_t idx = getIndex(handle);
+        Generation generation = getGeneration(handle);
+        return (generation & 1) && idx >= 0 && (size_t)idx < _generations.size()
+            && _generations[idx] == generation;
+    }
+
+    // returns the handle of a live index, else INVALID_HANDLE
+    Handle getHandle(Index_t idx) const {
+        if (idx < 0 || (size_t)idx >= _generations.size() || !(_generations[idx] & 1)) {
+            return INVALID_HANDLE;
+        }
+        return makeHandle(idx, _generations[idx]);
+    }
+
+    Index_t getNumLive() const { return _indices.getNumLive(); }
+    Index_t getNumFree() const { return _indices.getNumFree(); }
+    Index_t getNumAllocated() const { return _indices.getNumAllocated(); }
+
+    // returns INVALID_HANDLE when full
+    Handle allocate() {
+        Index_t idx = _indices.allocate();
+        if (idx == IndexAllocator<Index_t>::INVALID_INDEX) {
+            return INVALID_HANDLE;
+        }
+        if ((size_t)idx >= _generations.size()) {
+            _generations.resize(idx + 1, 0);
+        }
+        Generation generation = ++_generations[idx];
+        return makeHandle(idx, generation);
+    }
+
+    // returns false (and does nothing) if handle is stale or invalid
+    bool free(Handle handle) {
+        if (!isValid(handle)) {
+            return false;
+        }
+        Index_t idx = getIndex(handle);
+        ++_generations[idx];
+        _indices.free(idx);
+        return true;
+    }
+
+    // frees everything: all outstanding handles become stale
+    void clear() {
+        for (Generation& generation : _generations) {
+            if (generation & 1) {
+                ++generation;
+            }
+        }
+        _indices.clear();
+    }
+
+private:
+    IndexAllocator<Index_t> _indices;
+    std::vector<Generation> _generations; // by index: odd while live
+};
@@ -0,0 +1,210 @@
+//
+// GrpcMetrics.cpp
+//
+// Distributed under the Apache License, Version 2.0.
+// See the accompanying file LICENSE or
+// http://www.apache.org/licenses/LICENSE-2.0.html
+//
+
+#include "GrpcMetrics.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include <google/protobuf/message_lite.h>
+
+#include "TraceUtil.h"
+
+using namespace GrpcUtil;
+using HookPoint = grpc::experimental::InterceptionHookPoints;
+
+namespace {
+
+uint64_t now_usec() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t send_message_size(grpc::experimental::InterceptorBatchMethods* methods) {
+    // Note: the serialized buffer is reused by gRPC for the actual send
+    // so this doesn't serialize twice
+    grpc::ByteBuffer* buffer = methods->GetSerializedSendMessage();
+    return buffer ? buffer->Length() : 0;
+}
+
+uint64_t recv_message_size(grpc::experimental::InterceptorBatchMethods* methods, bool is_raw) {
+    const void* message = methods->GetRecvMessage();
+    if (!message) {
+        return 0;
+    }
+    if (is_raw) {
+        return static_cast<const grpc::ByteBuffer*>(message)->Length();
+    }
+    return static_cast<const google::protobuf::MessageLite*>(message)->ByteSizeLong();
+}
+
+class ClientMetricsInterceptor : public grpc::experimental::Interceptor {
+public:
+    ClientMetricsInterceptor(grpc::experimental::ClientRpcInfo* info, RpcMetrics* metrics)
+        : _method(info->method()), _metrics(metrics), _isRaw(metrics->isRawMethod(_method))
+    {
+    }
+
+    void Intercept(grpc::experimental::InterceptorBatchMethods* methods) override {
+        if (methods->QueryInterceptionHookPoint(HookPoint::PRE_SEND_INITIAL_METADATA)) {
+            _startTime = now_usec();
+        }
+        if (methods->QueryInterceptionHookPoint(HookPoint::PRE_SEND_MESSAGE)) {
+            _sample.bytesOut += send_message_size(methods);
+        }
+        if (methods->QueryInterceptionHookPoint(HookPoint::POST_RECV_MESSAGE)) {
+            _sample.bytesIn += recv_message_size(methods, _isRaw);
+        }
+        if (methods->QueryInterceptionHookPoint(HookPoint::POST_RECV_STATUS)) {
+            _sample.latency = now_usec() - _startTime;
+            grpc::Status* status = methods->GetRecvStatus();
+            _sample.ok = status && status->ok();
+            _metrics->record(_method, _sample);
+        }
+        methods->Proceed();
+    }
+
+private:
+    std::string _method;
+    RpcMetrics::Sample _sample;
+    RpcMetrics* _metrics;
+    uint64_t _startTime { 0 };
+    bool _isRaw { false };
+};
+
+class ServerMetricsInterceptor : public grpc::experimental::Interceptor {
+public:
+    ServerMetricsInterceptor(grpc::experimental::ServerRpcInfo* info, RpcMetrics* metrics)
+        : _method(info->method()), _metrics(metrics), _isRaw(metrics->isRawMethod(_method))
+    {
+    }
+
+    void Intercept(grpc::experimental::InterceptorBatchMethods* methods) override {
+        if (methods->QueryInterceptionHookPoint(HookPoint::POST_RECV_INITIAL_METADATA)) {
+            _arrivalTime = now_usec();
+        }
+        if (methods->QueryInterceptionHookPoint(HookPoint::POST_RECV_MESSAGE)) {
+            _sample.bytesIn += recv_message_size(methods, _isRaw);
+            if (_messageTime == 0) {
+                _messageTime = now_usec();
+                _sample.recvMessage = _messageTime - _arrivalTime;
+            }
+        }
+        if (methods->QueryInterceptionHookPoint(HookPoint::PRE_SEND_MESSAGE)) {
+            _sample.bytesOut += send_message_size(methods);
+        }
+        if (methods->QueryInterceptionHookPoint(HookPoint::PRE_SEND_STATUS)) {
+            uint64_t start = (_messageTime == 0) ? _arrivalTime : _messageTime;
+            _sample.latency = now_usec() - start;
+            _sample.ok = methods->GetSendStatus().ok();
+            _metrics->record(_method, _sample);
+        }
+        methods->Proceed();
+    }
+
+private:
+    std::string _method;
+    RpcMetrics::Sample _sample;
+    RpcMetrics* _metrics;
+    uint64_t _arrivalTime { 0 };
+    uint64_t _messageTime { 0 };
+    bool _isRaw { false };
+};
+
+class ClientMetricsInterceptorFactory
+        : public grpc::experimental::ClientInterceptorFactoryInterface {
+public:
+    explicit ClientMetricsInterceptorFactory(RpcMetrics* metrics) : _metrics(metrics) { }
+
+    grpc::experimental::Interceptor* CreateClientInterceptor(
+            grpc::experimental::ClientRpcInfo* info) override {
+        return new ClientMetricsInterceptor(info, _metrics);
+    }
+
+private:
+    RpcMetrics* _metrics;
+};
+
+class ServerMetricsInterceptorFactory
+        : public grpc::experimental::ServerInterceptorFactoryInterface {
+public:
+    explicit ServerMetricsInterceptorFactory(RpcMetrics* metrics) : _metrics(metrics) { }
+
+    grpc::experimental::Interceptor* CreateServerInterceptor(
+            grpc::experimental::ServerRpcInfo* info) override {
+        return new ServerMetricsInterceptor(info, _metrics);
+    }
+
+private:
+    RpcMetrics* _metrics;
+};
+
+} // anonymous namespace
+
+void RpcMetrics::record(const std::string& method, const Sample& sample) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        MethodMetrics& metrics = _methods[method];
+        ++metrics.numCalls;
+        if (!sample.ok) {
+            ++metrics.numErrors;
+        }
+        metrics.bytesIn += sample.bytesIn;
+        metrics.bytesOut += sample.bytesOut;
+        metrics.recvMessage.add(sample.recvMessage);
+        metrics.latency.add(sample.latency);
+    }
+
+    TraceUtil::Tracer& tracer = TraceUtil::Tracer::instance();
+    if (tracer.isEnabled()) {
+        tracer.setCounter(method + ":recv_message_usec", _cat, sample.recvMessage);
+        tracer.setCounter(method + ":latency_usec", _cat, sample.latency);
+        tracer.setCounter(method + ":bytes_in", _cat, sample.bytesIn);
+        tracer.setCounter(method + ":bytes_out", _cat, sample.bytesOut);
+    }
+}
+
+void RpcMetrics::addRawMethod(const std::string& method) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (std::find(_rawMethods.begin(), _rawMethods.end(), method) == _rawMethods.end()) {
+        _rawMethods.push_back(method);
+    }
+}
+
+bool RpcMetrics::isRawMethod(const std::string& method) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return std::find(_rawMethods.begin(), _rawMethods.end(), method) != _rawMethods.end();
+}
+
+std::map<std::string, RpcMetrics::MethodMetrics> RpcMetrics::getMethodMetrics() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _methods;
+}
+
+void RpcMetrics::clear() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _methods.clear();
+}
+
+std::vector<std::unique_ptr<grpc::experimental::ClientInterceptorFactoryInterface> >
+GrpcUtil::createClientMetricsInterceptors(RpcMetrics* metrics) {
+    std::vector<std::unique_ptr<grpc::experimental::ClientInterceptorFactoryInterface> > factories;
+    if (metrics) {
+        factories.push_back(std::make_unique<ClientMetricsInterceptorFactory>(metrics));
+    }
+    return factories;
+}
+
+std::vector<std::unique_ptr<grpc::experimental::ServerInterceptorFactoryInterface> >
+GrpcUtil::createServerMetricsInterceptors(RpcMetrics* metrics) {
+    std::vector<std::unique_ptr<grpc::experimental::ServerInterceptorFactoryInterface> > factories;
+    if (metrics) {
+        factories.push_back(std::make_unique<ServerMetricsInterceptorFactory>(metrics));
+    }
+    return factories;
+}
@@ -0,0 +1,89 @@
+//
+// GrpcMetrics.h
+//
+// Distributed under the Apache License, Version 2.0.
+// See the accompanying file LICENSE or
+// http://www.apache.org/licenses/LICENSE-2.0.html
+//
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+#include <grpcpp/support/client_interceptor.h>
+#include <grpcpp/support/server_interceptor.h>
+
+#include "LatencyHistogram.h"
+
+namespace GrpcUtil {
+
+// RpcMetrics collects per-method RPC stats from the metrics interceptors.
+// Every sample is added to in-memory histograms and, when tracing is enabled,
+// emitted as TraceUtil Counter events named "<method>:<stat>".
+//
+// The interceptors measure:
+//   recv_message = server only: initial metadata received --> first request
+//                  message received (does not include handler dispatch)
+//   latency = client: call sent --> status received
+//             server: first request message received --> status sent
+//   bytes_in/bytes_out = serialized message sizes
+//
+// Note: bytes_in is computed from the received message which is assumed
+// to be a protobuf unless its method was registered with addRawMethod()
+// (raw methods receive a grpc::ByteBuffer instead).
+//
+class RpcMetrics {
+public:
+    struct MethodMetrics {
+        LatencyHistogram recvMessage; // usec
+        LatencyHistogram latency; // usec
+        uint64_t numCalls { 0 };
+        uint64_t numErrors { 0 };
+        uint64_t bytesIn { 0 };
+        uint64_t bytesOut { 0 };
+    };
+
+    struct Sample {
+        uint64_t recvMessage { 0 }; // usec
+        uint64_t latency { 0 }; // usec
+        uint64_t bytesIn { 0 };
+        uint64_t bytesOut { 0 };
+        bool ok { true };
+    };
+
+    // cat = TraceUtil category for Counter events (e.g. "rpc_client")
+    explicit RpcMetrics(const std::string& cat) : _cat(cat) { }
+
+    void record(const std::string& method, const Sample& sample);
+
+    // method = full name, e.g. "/mondo.DataService/PollInOut"
+    // Note: call this before any RPCs are made
+    void addRawMethod(const std::string& method);
+    bool isRawMethod(const std::string& method) const;
+
+    // returns a copy of the per-method metrics
+    std::map<std::string, MethodMetrics> getMethodMetrics() const;
+
+    void clear();
+
+private:
+    mutable std::mutex _mutex;
+    std::map<std::string, MethodMetrics> _methods;
+    std::vector<std::string> _rawMethods;
+    std::string _cat;
+};
+
+// use these to create the factory vectors expected by
+// grpc::experimental::CreateCustomChannelWithInterceptors() and
+// grpc::ServerBuilder::experimental().SetInterceptorCreators()
+std::vector<std::unique_ptr<grpc::experimental::ClientInterceptorFactoryInterface> >
+    createClientMetricsInterceptors(RpcMetrics* metrics);
+
+std::vector<std::unique_ptr<grpc::experimental::ServerInterceptorFactoryInterface> >
+    createServerMetricsInterceptors(RpcMetrics* metrics);
+
+} // namespace GrpcUtil
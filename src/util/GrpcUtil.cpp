@@ -8,25 +8,237 @@
 
 #include "GrpcUtil.h"
 
+#include <algorithm>
 #include <thread>
 
+#include <fmt/format.h>
+#include <grpcpp/alarm.h>
+
+#include "GrpcMetrics.h"
+#include "TimeUtil.h"
 #include "TraceMacros.h"
 
 using namespace GrpcUtil;
 
-Client::Client(const std::string& uri)
+namespace GrpcUtil {
+
+// HedgeGroup tracks the original Call and its hedged duplicates
+class HedgeGroup {
+public:
+    std::mutex mutex;
+    std::vector<Call*> calls; // outstanding
+    const Call* original { nullptr }; // for comparison only: may be deleted
+    HedgeTimer* timer { nullptr };
+    uint32_t numHedges { 0 };
+    uint32_t maxHedges { 0 }; // copy of Client policy when the group was created
+    bool done { false };
+};
+
+// HedgeTimer is a pseudo-Call whose tag is put on the completion queue
+// by a grpc::Alarm when it is time to send the next hedge
+class HedgeTimer : public Call {
+public:
+    HedgeTimer(Client* client, const std::shared_ptr<HedgeGroup>& group, uint64_t delay)
+        : _group(group), _client(client), _delay(delay)
+    {
+    }
+
+    void start(grpc::CompletionQueue* queue, void* stub) override {
+        // Note: only called under HedgeGroup lock
+        _armed = true;
+        _alarm.Set(queue, std::chrono::system_clock::now() + std::chrono::microseconds(_delay), this);
+    }
+
+    // Note: only called under HedgeGroup lock
+    void disarm() { _alarm.Cancel(); }
+
+    void processReply(bool reply_is_ok) override {
+        // reply_is_ok is false when alarm was cancelled
+        _armed = false;
+        if (reply_is_ok) {
+            _client->launchHedge(_group);
+        }
+        std::lock_guard<std::mutex> lock(_group->mutex);
+        // rearm for next hedge unless the Client is stopping
+        bool rearmed = !_group->done
+                && _group->numHedges < _group->maxHedges
+                && !_group->calls.empty()
+                && _client->armHedgeTimer(this);
+        if (!rearmed) {
+            _group->timer = nullptr;
+        }
+    }
+
+    bool keepAlive() const override { return _armed; }
+
+private:
+    grpc::Alarm _alarm;
+    std::shared_ptr<HedgeGroup> _group;
+    Client* _client { nullptr };
+    uint64_t _delay { 0 }; // usec
+    bool _armed { false };
+};
+
+// ChannelWatcher is a pseudo-Call whose tag is put on the completion queue
+// by grpc::Channel::NotifyOnStateChange().  It is owned by its Client.
+class ChannelWatcher : public Call {
+public:
+    ChannelWatcher(Client* client, size_t channel_index)
+        : _client(client), _index(channel_index)
+    {
+    }
+
+    void start(grpc::CompletionQueue* queue, void* stub) override {
+        // Note: only called under Client::_watchMutex
+        // We watch for a change from the last reported state (rather than the
+        // current one) so a change that happens before we arm is not missed:
+        // the watch then fires at once.
+        std::chrono::system_clock::time_point deadline = std::chrono::system_clock::now()
+            + std::chrono::milliseconds(Client::CHANNEL_WATCH_PERIOD);
+        _client->_channels[_index]->NotifyOnStateChange(_state, deadline, queue, this);
+    }
+
+    void processReply(bool reply_is_ok) override {
+        // reply_is_ok is false when the watch deadline expired without change
+        if (reply_is_ok) {
+            _state = _client->_channels[_index]->GetState(false);
+            _client->onChannelStateChange(_index, _state);
+        }
+        _client->watchChannel(this);
+    }
+
+    // the Client owns the watcher so the queue never destroys it
+    bool keepAlive() const override { return true; }
+    void destroy() override { }
+
+private:
+    Client* _client;
+    size_t _index;
+    grpc_connectivity_state _state { GRPC_CHANNEL_IDLE };
+};
+
+} // namespace GrpcUtil
+
+Client::Client(
+        const std::string& uri,
+        size_t num_channels,
+        ChannelPolicy policy,
+        RpcMetrics* metrics)
     :   _queue(std::make_unique<grpc::CompletionQueue>()),
-        _channel(grpc::CreateChannel(uri, grpc::InsecureChannelCredentials())),
-        _uri(uri)
+        _uri(uri),
+        _channelPolicy(policy)
 {
+    if (num_channels == 0) {
+        num_channels = 1;
+    }
+    if (num_channels == 1 && !metrics) {
+        _channels.push_back(grpc::CreateChannel(uri, grpc::InsecureChannelCredentials()));
+    } else {
+        for (size_t i = 0; i < num_channels; ++i) {
+            grpc::ChannelArguments args;
+            if (num_channels > 1) {
+                // gRPC will share subchannels (and hence the HTTP/2 connection)
+                // between channels with identical args, so we make each channel
+                // distinct and tell it to use a local subchannel pool
+                args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+                args.SetInt("sferamondo.channel_index", (int)i);
+            }
+            _channels.push_back(grpc::experimental::CreateCustomChannelWithInterceptors(
+                    uri, grpc::InsecureChannelCredentials(), args,
+                    createClientMetricsInterceptors(metrics)));
+        }
+    }
+    _channel = _channels[0];
+    _stubs.resize(num_channels, nullptr);
+    _numCallsInFlight = std::make_unique<std::atomic<uint32_t>[]>(num_channels);
+    for (size_t i = 0; i < num_channels; ++i) {
+        _numCallsInFlight[i] = 0;
+    }
 }
 
 Client::~Client() {
 }
 
 void Client::addCall(GrpcUtil::Call* call) {
+    if (call->_adaptiveTimeout) {
+        call->_timeout = computeAdaptiveTimeout(call->_method);
+    }
+    if (!call->_hedged) {
+        startCall(call);
+        return;
+    }
+
+    // accrue hedge budget
+    uint32_t max_hedges = 0;
+    {
+        std::lock_guard<std::mutex> lock(_statsMutex);
+        _hedgeTokens = std::min(_hedgeTokens + _hedgeBudget, MAX_HEDGE_TOKENS);
+        max_hedges = _maxHedges;
+    }
+    uint64_t delay = computeHedgeDelay(call->_method);
+    if (delay == 0 || max_hedges == 0) {
+        startCall(call);
+        return;
+    }
+    std::shared_ptr<HedgeGroup> group = std::make_shared<HedgeGroup>();
+    group->calls.push_back(call);
+    group->original = call;
+    group->maxHedges = max_hedges;
+    call->_hedgeGroup = group;
+    startCall(call);
+
+    std::lock_guard<std::mutex> lock(group->mutex);
+    if (!group->done) {
+        group->timer = new HedgeTimer(this, group, delay); // yes: naked new
+        if (!armHedgeTimer(group->timer)) {
+            delete group->timer;
+            group->timer = nullptr;
+        }
+    }
+}
+
+void Client::startCall(GrpcUtil::Call* call) {
+    size_t i = pickChannel();
+    if (_stubs[i] == nullptr) {
+        // derived class only supplied a stub for channel 0
+        i = 0;
+    }
+    call->_channelIndex = i;
+    ++_numCallsInFlight[i];
+
+    call->_startTime = std::chrono::steady_clock::now();
+    if (call->_timeout != Call::NO_TIMEOUT) {
+        // Note: gRPC only understands system_clock deadlines
+        call->_context.set_deadline(
+                std::chrono::system_clock::now() + std::chrono::milliseconds(call->_timeout));
+    }
+
     // the call will cast the stub to the right type
-    call->start(_queue.get(), _stub);
+    call->start(_queue.get(), _stubs[i]);
+}
+
+size_t Client::pickChannel() {
+    size_t num_channels = _channels.size();
+    if (num_channels == 1) {
+        return 0;
+    }
+    if (_channelPolicy == ChannelPolicy::LEAST_LOADED) {
+        // start the scan at a rotating offset so ties don't
+        // always land on the same channel
+        size_t offset = _nextChannel++ % num_channels;
+        size_t best = offset;
+        uint32_t best_load = _numCallsInFlight[best];
+        for (size_t j = 1; j < num_channels && best_load > 0; ++j) {
+            size_t i = (offset + j) % num_channels;
+            uint32_t load = _numCallsInFlight[i];
+            if (load < best_load) {
+                best = i;
+                best_load = load;
+            }
+        }
+        return best;
+    }
+    return _nextChannel++ % num_channels;
 }
 
 void Client::start() {
@@ -36,6 +248,7 @@ void Client::start() {
     TRACE_THREAD("Client");
     _running = true;
     _stopped = false;
+    watchChannels();
     while (_running) {
         void* tag;
         bool read_ok = false;
@@ -54,13 +267,22 @@ void Client::start() {
 
         // The tag is always a pointer to a Call which has a processReply() method
         GrpcUtil::Call* call = static_cast<GrpcUtil::Call*>(tag);
-        {
+
+        // only the first reply of a hedged group is delivered
+        bool deliver = !call->_hedgeGroup || claimHedgeReply(call, read_ok);
+        if (deliver) {
             TRACE_CONTEXT("processReply", "GrpcUtil::Client");
             call->processReply(read_ok);
         }
 
         // the destroy() here is to signal "the queue no longer cares" about the call
         if (!call->keepAlive()) {
+            if (call->_channelIndex != Call::NO_CHANNEL) {
+                --_numCallsInFlight[call->_channelIndex];
+            }
+            if (deliver) {
+                recordCallStats(call);
+            }
             call->destroy();
         }
     }
@@ -74,15 +296,275 @@ void Client::start() {
 }
 
 void Client::stop() {
-    _queue->Shutdown();
+    {
+        // watchers and hedges must not re-arm on a queue that has been shut down
+        std::lock_guard<std::mutex> lock(_watchMutex);
+        _watching = false;
+        _queueShutdown = true;
+        _queue->Shutdown();
+    }
     _running = false;
     while (!_stopped) {
         std::this_thread::sleep_for(std::chrono::milliseconds(1));
     }
 }
 
+bool Client::warmUp(uint64_t timeout_msec) {
+    std::chrono::system_clock::time_point deadline = std::chrono::system_clock::now()
+        + std::chrono::milliseconds(timeout_msec);
+
+    // kick off all connections at once...
+    for (const auto& channel : _channels) {
+        channel->GetState(true);
+    }
+
+    // ... then wait for each
+    bool all_ready = true;
+    for (const auto& channel : _channels) {
+        grpc_connectivity_state state = channel->GetState(true);
+        while (state != GRPC_CHANNEL_READY) {
+            if (state == GRPC_CHANNEL_SHUTDOWN
+                    || !channel->WaitForStateChange(state, deadline)) {
+                all_ready = false;
+                break;
+            }
+            state = channel->GetState(true);
+        }
+    }
+    return all_ready;
+}
+
+bool Client::isReady() const {
+    for (const auto& channel : _channels) {
+        if (channel->GetState(false) != GRPC_CHANNEL_READY) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Client::watchChannels() {
+    if (!_connectivityCallback && !_keepWarm) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(_watchMutex);
+    if (_queueShutdown) {
+        // stop() came first
+        return;
+    }
+    if (_watchers.empty()) {
+        for (size_t i = 0; i < _channels.size(); ++i) {
+            _watchers.push_back(std::make_unique<ChannelWatcher>(this, i));
+        }
+    }
+    _watching = true;
+    for (size_t i = 0; i < _watchers.size(); ++i) {
+        if (_keepWarm) {
+            // start connecting now
+            _channels[i]->GetState(true);
+        }
+        _watchers[i]->start(_queue.get(), nullptr);
+    }
+}
+
+bool Client::watchChannel(ChannelWatcher* watcher) {
+    std::lock_guard<std::mutex> lock(_watchMutex);
+    if (!_watching) {
+        return false;
+    }
+    watcher->start(_queue.get(), nullptr);
+    return true;
+}
+
+void Client::onChannelStateChange(size_t channel_index, grpc_connectivity_state state) {
+    if (_keepWarm && (state == GRPC_CHANNEL_IDLE || state == GRPC_CHANNEL_TRANSIENT_FAILURE)) {
+        // reconnect in the background before the next Call needs it
+        _channels[channel_index]->GetState(true);
+    }
+    if (_connectivityCallback) {
+        _connectivityCallback(channel_index, state);
+    }
+}
+
+void Client::setAdaptiveTimeoutLimits(uint64_t min_msec, uint64_t max_msec) {
+    if (min_msec > max_msec) {
+        std::swap(min_msec, max_msec);
+    }
+    std::lock_guard<std::mutex> lock(_statsMutex);
+    _minAdaptiveTimeout = min_msec;
+    _maxAdaptiveTimeout = max_msec;
+}
+
+void Client::setAdaptiveTimeoutFactor(float factor) {
+    std::lock_guard<std::mutex> lock(_statsMutex);
+    _adaptiveTimeoutFactor = factor;
+}
+
+uint64_t Client::computeAdaptiveTimeout(const std::string& method) {
+    std::lock_guard<std::mutex> lock(_statsMutex);
+    uint64_t timeout = _maxAdaptiveTimeout;
+    if (method.empty()) {
+        return timeout;
+    }
+    MethodStats& stats = _methodStats[method];
+    if (stats.latency.getCount() >= MIN_ADAPTIVE_SAMPLES) {
+        constexpr float P99 = 0.99f;
+        uint64_t p99 = stats.latency.getPercentile(P99); // usec
+        timeout = (uint64_t)(_adaptiveTimeoutFactor * (float)p99) / TimeUtil::USEC_PER_MSEC;
+        timeout = std::max(_minAdaptiveTimeout, std::min(timeout, _maxAdaptiveTimeout));
+    }
+    stats.adaptiveTimeout = timeout;
+    return timeout;
+}
+
+void Client::setHedgePolicy(float percentile, uint32_t max_hedges) {
+    std::lock_guard<std::mutex> lock(_statsMutex);
+    _hedgePercentile = std::max(0.0f, std::min(percentile, 1.0f));
+    _maxHedges = max_hedges;
+}
+
+void Client::setHedgeBudget(float budget) {
+    std::lock_guard<std::mutex> lock(_statsMutex);
+    _hedgeBudget = std::max(0.0f, budget);
+}
+
+uint64_t Client::computeHedgeDelay(const std::string& method) const {
+    std::lock_guard<std::mutex> lock(_statsMutex);
+    auto itr = _methodStats.find(method);
+    if (itr == _methodStats.end() || itr->second.latency.getCount() < MIN_ADAPTIVE_SAMPLES) {
+        return 0;
+    }
+    return itr->second.latency.getPercentile(_hedgePercentile);
+}
+
+bool Client::consumeHedgeToken() {
+    std::lock_guard<std::mutex> lock(_statsMutex);
+    if (_hedgeTokens < 1.0f) {
+        return false;
+    }
+    _hedgeTokens -= 1.0f;
+    return true;
+}
+
+void Client::launchHedge(const std::shared_ptr<HedgeGroup>& group) {
+    Call* hedge = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(group->mutex);
+        if (group->done || group->calls.empty() || group->numHedges >= group->maxHedges) {
+            return;
+        }
+        if (!consumeHedgeToken()) {
+            // over budget: stop hedging this group
+            group->numHedges = group->maxHedges;
+            return;
+        }
+        const Call* source = group->calls.front();
+        hedge = source->clone();
+        if (!hedge) {
+            group->numHedges = group->maxHedges;
+            return;
+        }
+        hedge->_method = source->_method;
+        hedge->_timeout = source->_timeout;
+        hedge->_hedgeGroup = group;
+        group->calls.push_back(hedge);
+        ++group->numHedges;
+    }
+    if (!hedge->_method.empty()) {
+        std::lock_guard<std::mutex> lock(_statsMutex);
+        ++_methodStats[hedge->_method].numHedges;
+    }
+    {
+        // the queue may have been shut down by stop() since the timer fired
+        std::lock_guard<std::mutex> lock(_watchMutex);
+        if (!_queueShutdown) {
+            startCall(hedge);
+            return;
+        }
+    }
+    std::lock_guard<std::mutex> lock(group->mutex);
+    auto& calls = group->calls;
+    calls.erase(std::remove(calls.begin(), calls.end(), hedge), calls.end());
+    hedge->destroy();
+}
+
+bool Client::armHedgeTimer(HedgeTimer* timer) {
+    std::lock_guard<std::mutex> lock(_watchMutex);
+    if (_queueShutdown) {
+        return false;
+    }
+    timer->start(_queue.get(), nullptr);
+    return true;
+}
+
+bool Client::claimHedgeReply(Call* call, bool read_ok) {
+    std::shared_ptr<HedgeGroup> group = call->_hedgeGroup;
+    std::lock_guard<std::mutex> lock(group->mutex);
+    auto& calls = group->calls;
+    calls.erase(std::remove(calls.begin(), calls.end(), call), calls.end());
+    if (group->done) {
+        // someone else won
+        return false;
+    }
+    bool success = read_ok && call->_rpcStatus.ok();
+    if (!success && !calls.empty()) {
+        // failed but others are still outstanding: let them try
+        return false;
+    }
+
+    // this call wins: cancel the rest
+    group->done = true;
+    for (Call* other : calls) {
+        other->cancel();
+    }
+    if (group->timer) {
+        group->timer->disarm();
+    }
+    if (call != group->original && !call->_method.empty()) {
+        std::lock_guard<std::mutex> stats_lock(_statsMutex);
+        ++_methodStats[call->_method].numHedgeWins;
+    }
+    return true;
+}
+
+std::map<std::string, Client::MethodStats> Client::getMethodStats() const {
+    std::lock_guard<std::mutex> lock(_statsMutex);
+    return _methodStats;
+}
+
+void Client::recordCallStats(const Call* call) {
+    if (call->_method.empty()) {
+        return;
+    }
+    uint64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - call->_startTime).count();
+    grpc::StatusCode code = call->_rpcStatus.error_code();
+    std::lock_guard<std::mutex> lock(_statsMutex);
+    MethodStats& stats = _methodStats[call->_method];
+    ++stats.numCalls;
+    if (code == grpc::StatusCode::DEADLINE_EXCEEDED) {
+        // Note: we record expired latency (approximately the timeout) so the
+        // adaptive timeout can grow when the server legitimately slows down
+        ++stats.numExpired;
+        stats.latency.add(latency);
+    } else if (code == grpc::StatusCode::OK) {
+        // other failures (e.g. UNAVAILABLE) tend to fail fast
+        // and would skew the percentiles low
+        stats.latency.add(latency);
+    }
+}
+
 void Client::setStub(void* stub) {
-    _stub = stub;
+    setStub(0, stub);
+}
+
+void Client::setStub(size_t i, void* stub) {
+    if (i < _stubs.size()) {
+        _stubs[i] = stub;
+        if (i == 0) {
+            _stub = stub;
+        }
+    }
 }
 
 
@@ -91,14 +573,14 @@ void Client::setStub(void* stub) {
 //#include <string>
 
 
-Server::~Server() {
+AsynchServer::~AsynchServer() {
     // drain queue before delete, else will assert
     void* ignored_tag;
     bool ignored_ok;
     while (_queue->Next(&ignored_tag, &ignored_ok)) { }
 }
 
-void Server::buildService(uint32_t port) {
+void AsynchServer::buildService(uint32_t port) {
     _port = port;
     grpc::ServerBuilder builder;
 
@@ -108,6 +590,10 @@ void Server::buildService(uint32_t port) {
 
     registerService(builder);
 
+    if (_metrics) {
+        builder.experimental().SetInterceptorCreators(createServerMetricsInterceptors(_metrics));
+    }
+
     // Obtain a pointer to the completion queue used for asynchronous
     // communication with the gRPC runtime.
     _queue = builder.AddCompletionQueue();
@@ -116,7 +602,7 @@ void Server::buildService(uint32_t port) {
     _grpcServer = builder.BuildAndStart();
 }
 
-void Server::start() {
+void AsynchServer::start() {
     if (_running) {
         return;
     }
@@ -150,10 +636,55 @@ void Server::start() {
     _stopped = true;
 }
 
-void Server::stop() {
+void AsynchServer::stop() {
     _running = false;
     // always shutdown grpc_server BEFORE queue
     _grpcServer->Shutdown();
     _queue->Shutdown();
 }
 
+CallbackServer::~CallbackServer() {
+    stop();
+}
+
+void CallbackServer::buildService(uint32_t port) {
+    _port = port;
+    grpc::ServerBuilder builder;
+
+    // Listen on the given address without any authentication mechanism.
+    std::string uri = fmt::format("[::]:{}", port);
+    builder.AddListeningPort(uri, grpc::InsecureServerCredentials());
+
+    registerService(builder);
+
+    if (_metrics) {
+        builder.experimental().SetInterceptorCreators(createServerMetricsInterceptors(_metrics));
+    }
+
+    // assemble the server: no completion queue necessary
+    // because gRPC drives the reactors on its own threads
+    _grpcServer = builder.BuildAndStart();
+}
+
+void CallbackServer::start() {
+    if (_running || !_grpcServer) {
+        return;
+    }
+    _running = true;
+    _stopped = false;
+    // process requests until Shutdown
+    _grpcServer->Wait();
+    _stopped = true;
+}
+
+void CallbackServer::stop() {
+    if (_running) {
+        _running = false;
+        // Note: Shutdown() cancels unfinished reactors
+        _grpcServer->Shutdown();
+        // wait until start() is done
+        while (!_stopped) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+}
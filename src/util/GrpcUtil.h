@@ -7,22 +7,65 @@
 //
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include <grpcpp/grpcpp.h>
 #include <grpc/support/log.h>
 
+#include "LatencyHistogram.h"
+
+#ifdef SFERAMONDO_COROUTINES
+#include <coroutine>
+
+#include "ThreadPool.h"
+#endif
+
 namespace GrpcUtil {
 
+class ChannelWatcher;
+class HedgeGroup;
+class RpcMetrics;
+class HedgeTimer;
+
 // asynchronos call
 //
 // Using asynchronous Calls is recommended.
 // It allows the client thread to put RPC requests on the wire
 // and not block while waiting for response.
 //
+// By default a Call has no deadline, which means a stalled server will
+// pin the Call (and its context) forever.  A deadline can be set before
+// Client::addCall() with either:
+//
+//   setTimeout(msec) = explicit deadline, measured from addCall()
+//   setAdaptiveTimeout() = Client derives the deadline from the rolling p99
+//       of recent latencies for the same method (see setMethod())
+//
+// When the deadline passes gRPC finishes the Call with DEADLINE_EXCEEDED
+// and it is reaped through the completion queue like any other reply.
+//
+// Hedging is opt-in and only safe for idempotent unary RPCs: override
+// clone() to return a fresh copy of the Call (same request) and call
+// setHedged() before addCall().  If the Call has not completed by the
+// Client's hedge delay a duplicate is sent, the first successful reply
+// is delivered to processReply(), and the rest are cancel()ed.
+//
 class Call {
 public:
+    friend class Client;
+
+    static constexpr uint64_t NO_TIMEOUT = 0;
+    static constexpr size_t NO_CHANNEL = size_t(-1);
+
     virtual ~Call() {}
 
     virtual void start(grpc::CompletionQueue* queue, void* stub) = 0;
@@ -32,6 +75,21 @@ public:
     const grpc::Status& getRpcStatus() const { return _rpcStatus; }
     void cancel() { _context.TryCancel(); }
 
+    // method name is the key for per-method latency stats
+    void setMethod(const std::string& method) { _method = method; }
+    const std::string& getMethod() const { return _method; }
+
+    void setTimeout(uint64_t msec) { _timeout = msec; _adaptiveTimeout = false; }
+    void setAdaptiveTimeout() { _adaptiveTimeout = true; }
+
+    // returns timeout actually applied (msec), valid after addCall()
+    uint64_t getTimeout() const { return _timeout; }
+
+    // override to support hedging: return new copy of this Call
+    // which the Client will own, or nullptr if it can't be hedged
+    virtual Call* clone() const { return nullptr; }
+    void setHedged() { _hedged = true; }
+
 protected:
     // ClientContext for this call can be used to convey extra information
     // to the client/server and/or tweak certain RPC behaviors.
@@ -40,6 +98,16 @@ protected:
     // (b) it must remain alive and valid for the lifetime of this call
     grpc::ClientContext _context;
     grpc::Status _rpcStatus;
+
+private:
+    std::string _method;
+    std::shared_ptr<HedgeGroup> _hedgeGroup;
+    std::chrono::steady_clock::time_point _startTime;
+    uint64_t _timeout { NO_TIMEOUT }; // msec
+    // index of the Client channel this call was started on
+    size_t _channelIndex { NO_CHANNEL };
+    bool _adaptiveTimeout { false };
+    bool _hedged { false };
 };
 
 // asynchronous Client
@@ -48,13 +116,70 @@ protected:
 // It allows the client thread to put RPC requests on the wire
 // and not block while waiting for response.
 //
+// A Client can optionally maintain a pool of channels to the same uri.
+// Each channel gets its own HTTP/2 connection (they do not share
+// subchannels) which lifts the per-connection concurrent stream limit
+// and spreads the load across several transports.  This is only useful
+// for high-fanout clients talking to one server at very high QPS: for
+// everyone else the default num_channels=1 is best.
+//
+// The first Call on a fresh channel pays for DNS, TCP and HTTP/2 setup.
+// Use warmUp() to pay that up front, and keep-warm mode to reconnect in
+// the background whenever a channel drops to IDLE or TRANSIENT_FAILURE.
+//
 class Client {
 public:
-    Client(const std::string& uri);
+    friend class ChannelWatcher;
+    friend class HedgeTimer;
+
+    // invoked on the Client thread (inside start()) when a channel changes state
+    using ConnectivityCallback = std::function<void(size_t channel_index, grpc_connectivity_state state)>;
+
+    // how often idle channel watchers wake up to re-arm (msec)
+    // Note: gRPC can't cancel a pending watch so this also bounds
+    // how long stop() blocks when watchers are running
+    static constexpr uint64_t CHANNEL_WATCH_PERIOD = 250;
+
+    // how addCall() picks a channel when there is more than one
+    enum ChannelPolicy : uint8_t {
+        ROUND_ROBIN,
+        LEAST_LOADED // fewest calls in flight
+    };
+
+    // latency histograms halve their counts this often (in samples)
+    // so percentiles follow recent history
+    static constexpr uint32_t LATENCY_DECAY_PERIOD = 1024;
+
+    // adaptive timeouts fall back to max until a method has this many samples
+    static constexpr uint64_t MIN_ADAPTIVE_SAMPLES = 32;
+
+    // per-method call stats, keyed by Call::getMethod()
+    struct MethodStats {
+        LatencyHistogram latency { LATENCY_DECAY_PERIOD }; // usec
+        uint64_t numCalls { 0 };
+        uint64_t numExpired { 0 }; // finished with DEADLINE_EXCEEDED
+        uint64_t numHedges { 0 }; // duplicates sent
+        uint64_t numHedgeWins { 0 }; // replies won by a duplicate
+        uint64_t adaptiveTimeout { 0 }; // msec, most recently chosen
+    };
+
+    // hedge budget accrues this many tokens at most
+    static constexpr float MAX_HEDGE_TOKENS = 10.0f;
+
+    // when metrics is not null every channel gets metrics interceptors
+    // (see GrpcMetrics.h) and metrics must outlive the Client
+    Client(const std::string& uri,
+            size_t num_channels = 1,
+            ChannelPolicy policy = ChannelPolicy::ROUND_ROBIN,
+            RpcMetrics* metrics = nullptr);
     virtual ~Client();
 
     std::string getUri() const { return _uri; }
 
+    size_t getNumChannels() const { return _channels.size(); }
+    std::shared_ptr<grpc::Channel> getChannel(size_t i) const { return _channels[i]; }
+    uint32_t getNumCallsInFlight(size_t i) const { return _numCallsInFlight[i]; }
+
     virtual void start();
     void stop();
     bool isRunning() const { return _running; }
@@ -63,14 +188,84 @@ public:
     // assumes ownership of Call
     void addCall(Call* call);
 
+    // Drives all channels to READY (connecting if necessary) and blocks until
+    // they are or timeout expires.  Returns true when all channels are READY.
+    // Note: this can be called before start() and from any thread.
+    bool warmUp(uint64_t timeout_msec);
+
+    // returns true when all channels are READY (does not try to connect)
+    bool isReady() const;
+
+    // Note: set these BEFORE start()
+    void setConnectivityCallback(ConnectivityCallback callback) { _connectivityCallback = callback; }
+    void setKeepWarm(bool keep_warm) { _keepWarm = keep_warm; }
+
+    // adaptive timeout = factor * p99, clamped to [min_msec, max_msec]
+    void setAdaptiveTimeoutLimits(uint64_t min_msec, uint64_t max_msec);
+    void setAdaptiveTimeoutFactor(float factor);
+    uint64_t computeAdaptiveTimeout(const std::string& method);
+
+    // hedge delay = 'percentile' latency of the method (e.g. 0.95 for p95)
+    // and at most max_hedges duplicates are sent per Call
+    void setHedgePolicy(float percentile, uint32_t max_hedges);
+
+    // budget = max ratio of hedges to hedged Calls (e.g. 0.1 = +10% load)
+    void setHedgeBudget(float budget);
+
+    // returns hedge delay (usec) or 0 when there is not enough latency history
+    uint64_t computeHedgeDelay(const std::string& method) const;
+
+    // returns a copy of per-method stats (e.g. for logging or monitoring)
+    std::map<std::string, MethodStats> getMethodStats() const;
+
 protected:
+    // supply stub for channel 0
     void setStub(void* stub);
 
+    // supply stub for channel i (one stub per channel)
+    void setStub(size_t i, void* stub);
+
+    size_t pickChannel();
+    void startCall(Call* call);
+    void recordCallStats(const Call* call);
+
+    // hedging helpers
+    void launchHedge(const std::shared_ptr<HedgeGroup>& group);
+    bool claimHedgeReply(Call* call, bool read_ok);
+    bool consumeHedgeToken();
+    bool armHedgeTimer(HedgeTimer* timer);
+
+    // connectivity helpers
+    void watchChannels();
+    bool watchChannel(ChannelWatcher* watcher);
+    void onChannelStateChange(size_t channel_index, grpc_connectivity_state state);
+
 protected:
     std::unique_ptr<grpc::CompletionQueue> _queue;
-    std::shared_ptr<grpc::Channel> _channel;
+    std::shared_ptr<grpc::Channel> _channel; // same as _channels[0]
+    std::vector<std::shared_ptr<grpc::Channel> > _channels;
+    std::vector<void*> _stubs;
+    std::unique_ptr<std::atomic<uint32_t>[]> _numCallsInFlight;
     std::string _uri;
-    void* _stub { nullptr };
+    void* _stub { nullptr }; // same as _stubs[0]
+    std::atomic<uint32_t> _nextChannel { 0 };
+    mutable std::mutex _statsMutex;
+    // the stats and policy fields below are guarded by _statsMutex
+    std::map<std::string, MethodStats> _methodStats;
+    uint64_t _minAdaptiveTimeout { 10 }; // msec
+    uint64_t _maxAdaptiveTimeout { 5000 }; // msec
+    float _adaptiveTimeoutFactor { 1.5f };
+    float _hedgePercentile { 0.95f };
+    float _hedgeBudget { 0.1f };
+    float _hedgeTokens { 0.0f };
+    uint32_t _maxHedges { 1 };
+    std::vector<std::unique_ptr<ChannelWatcher> > _watchers;
+    std::mutex _watchMutex; // also guards arming hedges vs queue shutdown
+    ConnectivityCallback _connectivityCallback;
+    ChannelPolicy _channelPolicy { ChannelPolicy::ROUND_ROBIN };
+    bool _keepWarm { false };
+    bool _watching { false }; // guarded by _watchMutex
+    bool _queueShutdown { false }; // guarded by _watchMutex
     bool _running { false };
     bool _stopped { true };
 };
@@ -145,12 +340,18 @@ private:
 // asynchronous Server
 //
 // Using an asynchronous Server is not recommended.
+// If you need replies computed on some other thread use CallbackServer.
 //
 class AsynchServer {
 public:
     AsynchServer() {}
     virtual ~AsynchServer();
 
+    // when metrics is not null the server gets metrics interceptors
+    // (see GrpcMetrics.h) and metrics must outlive the server
+    // Note: call this BEFORE buildService()
+    void setMetrics(RpcMetrics* metrics) { _metrics = metrics; }
+
     void buildService(uint32_t port);
 
     void start();
@@ -180,11 +381,273 @@ protected:
 
 private:
     std::unique_ptr<grpc::Server> _grpcServer;
+    RpcMetrics* _metrics { nullptr };
     int32_t _port { 0 };
     bool _running { false };
     bool _stopped { false };
 };
 
+// callback reactors
+//
+// The callback (aka "reactor") API is the third server flavor: no
+// completion-queue loop to hand-write and no thread blocked per call.
+// gRPC invokes the CallbackService methods on its own threads and the
+// handler returns a reactor immediately.  The reactor can be finished
+// later from ANY thread (e.g. the simulation thread when it has the
+// reply for a PollInOut).  The reactors delete themselves when done.
+
+// UnaryReactor is for unary RPCs whose reply is computed elsewhere.
+// The handler keeps a pointer to the reactor, fills in the reply
+// whenever it can and then calls finish().
+//
+template <typename Request, typename Reply>
+class UnaryReactor : public grpc::ServerUnaryReactor {
+public:
+    UnaryReactor(grpc::CallbackServerContext* context, const Request* request, Reply* reply)
+        : _context(context), _request(request), _reply(reply)
+    {
+    }
+
+    // call finish() exactly once, from any thread, after filling the reply
+    void finish(const grpc::Status& status = grpc::Status::OK) { Finish(status); }
+
+    const Request* getRequest() const { return _request; }
+    Reply* getReply() { return _reply; }
+    bool isCancelled() const { return _cancelled; }
+
+    // Note: the client may cancel before finish() is called,
+    // but finish() must still be called
+    void OnCancel() override { _cancelled = true; onCancel(); }
+
+    void OnDone() override { delete this; } // yes: naked delete
+
+protected:
+    virtual void onCancel() { }
+
+protected:
+    grpc::CallbackServerContext* _context;
+    const Request* _request;
+    Reply* _reply;
+    std::atomic<bool> _cancelled { false };
+};
+
+// BidiReactor is for bidirectional streams.
+// Override processRequest() to handle each incoming message and call write()
+// to queue an outgoing message: writes are sent in order, one at a time, as
+// gRPC requires.  The stream finishes when the client is done writing and
+// all queued writes have been sent.
+//
+// The reactor deletes itself when the stream is done, so other threads must
+// not hold a pointer to it.  They hold the Writer instead (see getWriter()),
+// which outlives the reactor: its write() returns false once the stream has
+// finished, and is safe to call from any thread at any time.
+//
+template <typename Request, typename Reply>
+class BidiReactor : public grpc::ServerBidiReactor<Request, Reply> {
+public:
+    class Writer {
+    public:
+        // returns false (and drops reply) when the stream has finished
+        bool write(const Reply& reply) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_finished) {
+                return false;
+            }
+            _writes.push_back(reply);
+            if (_writes.size() == 1) {
+                _reactor->StartWrite(&_writes.front());
+            }
+            return true;
+        }
+
+        bool isFinished() const {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _finished;
+        }
+
+    private:
+        friend class BidiReactor;
+
+        // Note: only call this under lock
+        void maybeFinish() {
+            if (_readsDone && _writes.empty() && !_finished) {
+                _finished = true;
+                _reactor->Finish(grpc::Status::OK);
+            }
+        }
+
+    private:
+        mutable std::mutex _mutex;
+        std::deque<Reply> _writes;
+        BidiReactor* _reactor { nullptr }; // null after OnDone()
+        bool _readsDone { false };
+        bool _finished { false };
+    };
+
+    BidiReactor() : _writer(std::make_shared<Writer>()) {
+        _writer->_reactor = this;
+    }
+
+    // call this at end of derived ctor
+    void begin() { this->StartRead(&_request); }
+
+    // hold this to write from other threads
+    std::shared_ptr<Writer> getWriter() const { return _writer; }
+
+    // Note: only call this from inside the reactor (e.g. in processRequest())
+    // elsewhere use getWriter()->write()
+    bool write(const Reply& reply) { return _writer->write(reply); }
+
+    void OnReadDone(bool ok) override {
+        if (ok) {
+            processRequest(_request);
+            this->StartRead(&_request);
+        } else {
+            // client is done writing (or the stream broke)
+            std::lock_guard<std::mutex> lock(_writer->_mutex);
+            _writer->_readsDone = true;
+            _writer->maybeFinish();
+        }
+    }
+
+    void OnWriteDone(bool ok) override {
+        std::lock_guard<std::mutex> lock(_writer->_mutex);
+        _writer->_writes.pop_front();
+        if (!ok) {
+            _writer->_writes.clear();
+        }
+        if (!_writer->_writes.empty()) {
+            this->StartWrite(&_writer->_writes.front());
+        } else {
+            _writer->maybeFinish();
+        }
+    }
+
+    void OnDone() override {
+        {
+            // detach the Writer: later writes are dropped
+            std::lock_guard<std::mutex> lock(_writer->_mutex);
+            _writer->_finished = true;
+            _writer->_reactor = nullptr;
+            _writer->_writes.clear();
+        }
+        delete this; // yes: naked delete
+    }
+
+protected:
+    virtual void processRequest(const Request& request) = 0;
+
+private:
+    std::shared_ptr<Writer> _writer;
+    Request _request;
+};
+
+// callback Server
+//
+// Use this with a CallbackService (the generated foo::FubarService::CallbackService)
+// whose methods return reactors.  Like the synchronous Service, start() blocks
+// so it should be called on a devoted thread.
+//
+class CallbackServer {
+public:
+    CallbackServer() {}
+    virtual ~CallbackServer();
+
+    // Note: call this BEFORE buildService()
+    void setMetrics(RpcMetrics* metrics) { _metrics = metrics; }
+
+    void buildService(uint32_t port);
+
+    // call start() on devoted thread: it blocks until stop()
+    void start();
+
+    // stop() will block until threaded work is done
+    void stop();
+
+    int32_t getPort() const { return _port; }
+
+    bool isRunning() const { return _running; }
+    bool isStopped() const { return _stopped; }
+
+protected:
+    virtual void registerService(grpc::ServerBuilder& builder) = 0;
+
+private:
+    std::unique_ptr<grpc::Server> _grpcServer;
+    RpcMetrics* _metrics { nullptr };
+    int32_t _port { 0 };
+    std::atomic<bool> _running { false };
+    std::atomic<bool> _stopped { true };
+};
+
+#ifdef SFERAMONDO_COROUTINES
+// AwaitableCall is a Call which a coroutine can co_await (see CoroUtil.h):
+//
+//     auto call = std::make_unique<BarCall>(); // derived from AwaitableCall
+//     bool reply_is_ok = co_await GrpcUtil::asyncCall(client, *call, &pool);
+//     // read the reply and call->getRpcStatus() here
+//
+// The Client does not own an AwaitableCall: instead of deleting it, destroy()
+// resumes the awaiting coroutine, which owns the Call and reads the reply
+// after the co_await.  So derived classes only implement start().
+// The coroutine resumes on a worker of the pool passed to asyncCall() or,
+// when that is null, inline on the Client thread (fine for short work, but
+// it holds up the completion queue meanwhile).
+//
+// Note: hedging and keepAlive() streams are not supported, and a Call still
+// pending when the Client stops never resumes its coroutine
+class AwaitableCall : public Call {
+public:
+    friend class CallAwaiter;
+
+    void processReply(bool reply_is_ok) final { _replyOk = reply_is_ok; }
+
+    // the Client is done with us: hand control back to the coroutine
+    void destroy() final {
+        std::coroutine_handle<> continuation = _continuation;
+        if (_pool) {
+            _pool->post([continuation] { continuation.resume(); });
+        } else {
+            // Note: the coroutine may delete this Call
+            continuation.resume();
+        }
+    }
+
+    bool isReplyOk() const { return _replyOk; }
+
+private:
+    std::coroutine_handle<> _continuation;
+    ThreadPool* _pool { nullptr };
+    bool _replyOk { false };
+};
+
+class CallAwaiter {
+public:
+    CallAwaiter(Client& client, AwaitableCall& call, ThreadPool* pool)
+        :   _client(client), _call(call), _pool(pool) { }
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) {
+        _call._continuation = handle;
+        _call._pool = _pool;
+        // Note: the reply may arrive (and resume the coroutine on another
+        // thread) before addCall() returns, so don't touch anything after it
+        _client.addCall(&_call);
+    }
+    bool await_resume() const { return _call.isReplyOk(); }
+
+private:
+    Client& _client;
+    AwaitableCall& _call;
+    ThreadPool* _pool;
+};
+
+// co_await asyncCall(...) starts call on client and returns reply_is_ok
+inline CallAwaiter asyncCall(Client& client, AwaitableCall& call, ThreadPool* pool = nullptr) {
+    return CallAwaiter(client, call, pool);
+}
+#endif // SFERAMONDO_COROUTINES
+
 } // namespace GrpcUtil
 
 
@@ -228,6 +691,25 @@ protected:
 };
 */
 
+// A Client with a pool of channels needs one Stub per channel:
+
+/*
+class PooledFubarClient : public GrpcUtil::Client {
+public:
+    PooledFubarClient(const std::string& serverIpPort, size_t num_channels) :
+            GrpcUtil::Client(serverIpPort, num_channels, GrpcUtil::Client::LEAST_LOADED)
+    {
+        for (size_t i = 0; i < getNumChannels(); ++i) {
+            _fubarStubs.push_back(foo::FubarService::NewStub(getChannel(i)));
+            setStub(i, _fubarStubs.back().get());
+        }
+    }
+
+protected:
+    std::vector<std::unique_ptr<foo::FubarService::Stub> > _fubarStubs;
+};
+*/
+
 // The Caller would look like this:
 
 /*
@@ -237,6 +719,18 @@ public:
         // set _request fields here
         // or from external context
         // but before calling start
+
+        // optionally: name the method and ask for an adaptive deadline
+        setMethod("Bar");
+        setAdaptiveTimeout();
+    }
+
+    // optionally: Bar is idempotent so it can be hedged
+    // (the caller must also call setHedged())
+    GrpcUtil::Call* clone() const override {
+        BarCaller* copy = new BarCaller();
+        copy->_request = _request;
+        return copy;
     }
 
     void start(grpc::CompletionQueue* queue, void* stub) override {
@@ -367,3 +861,45 @@ private:
 };
 */
 
+// The CallbackServer and a UnaryReactor which is finished
+// by some other thread might look like this:
+
+/*
+class BarReactor : public GrpcUtil::UnaryReactor<foo::BarRequest, foo::BarReply> {
+public:
+    using GrpcUtil::UnaryReactor<foo::BarRequest, foo::BarReply>::UnaryReactor;
+};
+
+class FubarCallbackService : public foo::FubarService::CallbackService {
+public:
+    grpc::ServerUnaryReactor* Bar(
+            grpc::CallbackServerContext* context,
+            const foo::BarRequest* request,
+            foo::BarReply* reply) override
+    {
+        BarReactor* reactor = new BarReactor(context, request, reply); // yes: naked new
+
+        // hand the reactor to the thread that knows the answer
+        // which will fill in reactor->getReply() and call reactor->finish()
+        _pendingBars.push(reactor);
+        return reactor;
+    }
+
+    ThreadSafeQueue<BarReactor*> _pendingBars;
+};
+
+class FubarCallbackServer : public GrpcUtil::CallbackServer {
+public:
+    FubarCallbackServer(int32_t port) {
+        buildService(port);
+    }
+
+protected:
+    void registerService(grpc::ServerBuilder& builder) override {
+        builder.RegisterService(&_service);
+    }
+
+private:
+    FubarCallbackService _service;
+};
+*/
@@ -7,81 +7,379 @@
 //
 #pragma once
 
-#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
 #include <vector>
 
-// NOTE: Index_t can be: int32_t or int16_t
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
-template <typename Index_t>
+// NOTE: Index_t can be: int16_t, int32_t, uint32_t or uint64_t
+// (or any integral type).  INVALID_VALUE is the sentinel returned when the
+// allocator is full: by default -1, which for unsigned types is the max value.
+// It is never handed out as an index, so indices are limited to
+// [0, INVALID_VALUE) when INVALID_VALUE is non-negative.
+//
+// Freed indices are recycled lowest first.  They are tracked in a
+// hierarchical bitset: bit i of level 0 is set when index i is free and bit j
+// of level k+1 is set when word j of level k is non-zero.  With 64-bit words
+// a tree over 2^31 indices is at most six levels deep, so allocate() (find
+// first set, top down) and free() (set a bit, bottom up) are O(log64 n) and
+// neither ever sorts.  Double-free is harmless: the bit is already set.
+//
+// serialize() writes a small header and the leaf level of the bitset (one bit
+// per allocated index) in native byte order, and deserialize() copies it back
+// and rebuilds the upper levels: a snapshot restores the allocator without
+// replaying its allocations.
+
+template <typename Index_t, Index_t INVALID_VALUE = Index_t(-1)>
 class IndexAllocator {
 public:
-    static constexpr Index_t INVALID_INDEX{-1};
+    static_assert(std::is_integral<Index_t>::value, "Index_t must be an integral type");
+    static constexpr Index_t INVALID_INDEX{INVALID_VALUE};
 
     explicit IndexAllocator(Index_t max_num_elements, Index_t preallocated_num_elements = 0) :
-        _maxNumElements(max_num_elements),
+        _maxNumElements(fitsBelowInvalid(max_num_elements) ? max_num_elements : INVALID_INDEX),
         _nextNewIndex(preallocated_num_elements)
     {
     }
 
     bool check(Index_t idx) const {
-        return ((idx >= 0) && (idx < _nextNewIndex));
+        return (isNonNegative(idx) && (idx < _nextNewIndex));
     }
     Index_t getNumLive() const {
-        return _nextNewIndex - (Index_t)(_freeIndices.size());
+        return _nextNewIndex - _numFree;
     }
     Index_t getNumFree() const {
-        return (Index_t)_freeIndices.size();
+        return _numFree;
     }
     Index_t getNumAllocated() const {
         return _nextNewIndex;
     }
 
     Index_t allocate() {
-        if (_freeIndices.empty()) {
+        if (_numFree == 0) {
             Index_t idx = _nextNewIndex;
             if (idx >= _maxNumElements) { return INVALID_INDEX; }
             _nextNewIndex++;
             return idx;
         } else {
-            if (!_freeIndicesAreSorted) {
-                // when recycling we sort (high to low) and use lowest index
-                std::sort(_freeIndices.begin(),
-                          _freeIndices.end(),
-                          std::greater<Index_t>());
-                _freeIndicesAreSorted = true;
-            }
-            Index_t idx = _freeIndices.back();
-            _freeIndices.pop_back();
-
-            // in case an index was double-freed we check for dupe indices and
-            // remove them
-            while (_freeIndices.size() > 0 && _freeIndices.back() == idx) {
-                _freeIndices.pop_back();
+            // recycle the lowest free index
+            size_t i = 0;
+            for (size_t level = _freeBits.size(); level-- > 0; ) {
+                i = (i << LOG2_WORD_BITS) + findFirstSet(_freeBits[level][i]);
             }
-            return idx;
+            clearFreeBit(i);
+            --_numFree;
+            return (Index_t)i;
         }
     }
 
     void free(Index_t idx) {
         if (check(idx)) {
-            if (_freeIndicesAreSorted && _freeIndices.size() > 0 &&
-                (idx < _freeIndices.back())) {
-                _freeIndicesAreSorted = false;
+            // Note: double-free is allowed and ignored
+            if (setFreeBit((size_t)idx)) {
+                ++_numFree;
+            }
+        }
+    }
+
+    // appends up to num indices (lowest first, like allocate()) to indices
+    // and returns how many it got: fewer than num means the allocator is full
+    Index_t allocateN(Index_t num, std::vector<Index_t>& indices) {
+        Index_t count = 0;
+        indices.reserve(indices.size() + (isNonNegative(num) ? (size_t)num : 0));
+        // recycle whole leaf words at a time
+        while (count < num && _numFree > 0) {
+            size_t word_index = 0;
+            for (size_t level = _freeBits.size(); level-- > 1; ) {
+                word_index = (word_index << LOG2_WORD_BITS) + findFirstSet(_freeBits[level][word_index]);
+            }
+            uint64_t word = _freeBits[0][word_index];
+            while (word != 0 && count < num) {
+                size_t bit = findFirstSet(word);
+                indices.push_back((Index_t)((word_index << LOG2_WORD_BITS) + bit));
+                word &= word - 1;
+                ++count;
+                --_numFree;
+            }
+            _freeBits[0][word_index] = word;
+            if (word == 0) {
+                // the word is empty now: tell the levels above
+                clearFreeBit(word_index, 1);
+            }
+        }
+        // then new ones
+        while (count < num && _nextNewIndex < _maxNumElements) {
+            indices.push_back(_nextNewIndex++);
+            ++count;
+        }
+        return count;
+    }
+
+    void freeN(const Index_t* indices, size_t num) {
+        for (size_t i = 0; i < num; ++i) {
+            free(indices[i]);
+        }
+    }
+    void freeN(const std::vector<Index_t>& indices) {
+        freeN(indices.data(), indices.size());
+    }
+
+    // renumbers the live indices into [0, getNumLive()), keeping their order,
+    // and returns the remap table: remap[old_index] = new_index, or
+    // INVALID_INDEX for indices which were free.  Dependent arrays can then
+    // be compacted in one pass:
+    //
+    //     for (size_t i = 0; i < remap.size(); ++i) {
+    //         if (remap[i] != INVALID_INDEX) { data[remap[i]] = std::move(data[i]); }
+    //     }
+    //
+    // (moving down is safe since remap[i] <= i)
+    std::vector<Index_t> compact() {
+        std::vector<Index_t> remap(_nextNewIndex, INVALID_INDEX);
+        Index_t next = 0;
+        for (Index_t i = 0; i < _nextNewIndex; ++i) {
+            if (!isFree((size_t)i)) {
+                remap[i] = next++;
             }
-            // Note: double-free is allowed, we push_back
-            // and deal with dupes later when recycling used indices
-            _freeIndices.push_back(idx);
         }
+        _freeBits.clear();
+        _numFree = 0;
+        _nextNewIndex = next;
+        return remap;
     }
 
     void clear() {
-        _freeIndices.clear();
+        _freeBits.clear();
+        _numFree = 0;
         _nextNewIndex = 0;
     }
 
+    // appends the state to buffer
+    void serialize(std::vector<uint8_t>& buffer) const {
+        Header header;
+        header.indexSize = sizeof(Index_t);
+        header.invalidIndex = (uint64_t)INVALID_INDEX;
+        header.maxNumElements = (uint64_t)_maxNumElements;
+        header.nextNewIndex = (uint64_t)_nextNewIndex;
+        header.numFree = (uint64_t)_numFree;
+        header.numWords = getNumUsedWords();
+        size_t offset = buffer.size();
+        buffer.resize(offset + sizeof(Header) + header.numWords * sizeof(uint64_t));
+        std::memcpy(buffer.data() + offset, &header, sizeof(Header));
+        // leaf words past those grown by free() are all zero (as resize() left them)
+        uint64_t num_leaves = _freeBits.empty() ? 0 : (uint64_t)_freeBits[0].size();
+        if (num_leaves > header.numWords) {
+            num_leaves = header.numWords;
+        }
+        if (num_leaves > 0) {
+            std::memcpy(buffer.data() + offset + sizeof(Header), _freeBits[0].data(), num_leaves * sizeof(uint64_t));
+        }
+    }
+
+    size_t getSerializedSize() const {
+        return sizeof(Header) + getNumUsedWords() * sizeof(uint64_t);
+    }
+
+    // restores state written by serialize() and returns true on success,
+    // else returns false and leaves the allocator unchanged: the header
+    // limits and the leaf bits (one per free index) are checked for
+    // consistency before anything is restored
+    // Note: the max_num_elements passed to the constructor is replaced
+    bool deserialize(const uint8_t* data, size_t size) {
+        Header header;
+        if (size < sizeof(Header)) {
+            return false;
+        }
+        std::memcpy(&header, data, sizeof(Header));
+        if (header.magic != Header::MAGIC
+                || header.version != Header::VERSION
+                || header.indexSize != sizeof(Index_t)
+                || header.invalidIndex != (uint64_t)INVALID_INDEX
+                || !isIndexValue(header.maxNumElements)
+                || !fitsBelowInvalid((Index_t)header.maxNumElements)
+                || header.nextNewIndex > header.maxNumElements
+                || header.numFree > header.nextNewIndex
+                || header.numWords != getNumWords(header.nextNewIndex)
+                || (size - sizeof(Header)) / sizeof(uint64_t) < header.numWords) {
+            return false;
+        }
+
+        // the leaf bits must agree with the header: one per free index,
+        // none at or beyond nextNewIndex
+        std::vector<uint64_t> leaves((size_t)header.numWords);
+        if (header.numWords > 0) {
+            std::memcpy(leaves.data(), data + sizeof(Header), header.numWords * sizeof(uint64_t));
+        }
+        uint64_t num_free = 0;
+        for (uint64_t word : leaves) {
+            num_free += popCount(word);
+        }
+        uint64_t tail_bits = header.nextNewIndex & WORD_MASK;
+        if (num_free != header.numFree
+                || (tail_bits != 0 && !leaves.empty() && (leaves.back() >> tail_bits) != 0)) {
+            return false;
+        }
+
+        _maxNumElements = (Index_t)header.maxNumElements;
+        _nextNewIndex = (Index_t)header.nextNewIndex;
+        _numFree = (Index_t)header.numFree;
+        _freeBits.clear();
+        if (header.numWords > 0) {
+            grow((size_t)(header.numWords << LOG2_WORD_BITS) - 1);
+            std::memcpy(_freeBits[0].data(), leaves.data(), leaves.size() * sizeof(uint64_t));
+            rebuildUpperLevels();
+        }
+        return true;
+    }
+
+    bool deserialize(const std::vector<uint8_t>& buffer) {
+        return deserialize(buffer.data(), buffer.size());
+    }
+
+private:
+    struct Header {
+        static constexpr uint32_t MAGIC = 0x41584449; // "IDXA"
+        static constexpr uint32_t VERSION = 1;
+        uint32_t magic { MAGIC };
+        uint32_t version { VERSION };
+        uint64_t indexSize { 0 };
+        uint64_t invalidIndex { 0 };
+        uint64_t maxNumElements { 0 };
+        uint64_t nextNewIndex { 0 };
+        uint64_t numFree { 0 };
+        uint64_t numWords { 0 }; // of leaf bitset that follow
+    };
+
+    static constexpr bool isNonNegative(Index_t idx) {
+        if constexpr (std::is_signed<Index_t>::value) {
+            return idx >= 0;
+        } else {
+            return true;
+        }
+    }
+
+    // true unless the sentinel lies in [0, max)
+    static constexpr bool fitsBelowInvalid(Index_t max_num_elements) {
+        return !isNonNegative(INVALID_INDEX) || max_num_elements <= INVALID_INDEX;
+    }
+
+    // true when value round-trips through a non-negative Index_t
+    static constexpr bool isIndexValue(uint64_t value) {
+        return isNonNegative((Index_t)value) && (uint64_t)(Index_t)value == value;
+    }
+
+    // leaf words which cover [0, num_indices)
+    // Note: rounds up without adding WORD_MASK first, which would wrap near UINT64_MAX
+    static constexpr uint64_t getNumWords(uint64_t num_indices) {
+        return (num_indices >> LOG2_WORD_BITS) + ((num_indices & WORD_MASK) != 0);
+    }
+
+    // leaf words which cover [0, _nextNewIndex)
+    uint64_t getNumUsedWords() const {
+        return getNumWords((uint64_t)_nextNewIndex);
+    }
+
+    static constexpr size_t LOG2_WORD_BITS = 6;
+    static constexpr size_t WORD_MASK = 63;
+
+    static size_t findFirstSet(uint64_t word) {
+#ifdef _MSC_VER
+        unsigned long bit;
+        _BitScanForward64(&bit, word);
+        return bit;
+#else
+        return (size_t)__builtin_ctzll(word);
+#endif
+    }
+
+    static size_t popCount(uint64_t word) {
+#ifdef _MSC_VER
+        return (size_t)__popcnt64(word);
+#else
+        return (size_t)__builtin_popcountll(word);
+#endif
+    }
+
+    bool isFree(size_t i) const {
+        size_t word_index = i >> LOG2_WORD_BITS;
+        return !_freeBits.empty() && word_index < _freeBits[0].size()
+            && (_freeBits[0][word_index] & (uint64_t(1) << (i & WORD_MASK)));
+    }
+
+    // returns false if the bit was already set
+    bool setFreeBit(size_t i) {
+        if ((i >> LOG2_WORD_BITS) >= (_freeBits.empty() ? 0 : _freeBits[0].size())) {
+            grow(i);
+        }
+        for (std::vector<uint64_t>& words : _freeBits) {
+            uint64_t& word = words[i >> LOG2_WORD_BITS];
+            uint64_t bit = uint64_t(1) << (i & WORD_MASK);
+            if (word & bit) {
+                return false;
+            }
+            bool was_empty = (word == 0);
+            word |= bit;
+            if (!was_empty) {
+                // the levels above already know this word is non-zero
+                break;
+            }
+            i >>= LOG2_WORD_BITS;
+        }
+        return true;
+    }
+
+    void clearFreeBit(size_t i, size_t first_level = 0) {
+        for (size_t level = first_level; level < _freeBits.size(); ++level) {
+            uint64_t& word = _freeBits[level][i >> LOG2_WORD_BITS];
+            word &= ~(uint64_t(1) << (i & WORD_MASK));
+            if (word != 0) {
+                break;
+            }
+            i >>= LOG2_WORD_BITS;
+        }
+    }
+
+    // makes room for index i (doubling)
+    void grow(size_t i) {
+        size_t num_words = _freeBits.empty() ? 1 : _freeBits[0].size();
+        while (num_words <= (i >> LOG2_WORD_BITS)) {
+            num_words *= 2;
+        }
+        if (_freeBits.empty()) {
+            _freeBits.emplace_back();
+        }
+        _freeBits[0].resize(num_words, 0);
+        rebuildUpperLevels();
+    }
+
+    void rebuildUpperLevels() {
+        size_t level = 0;
+        while (_freeBits[level].size() > 1) {
+            const std::vector<uint64_t>& lower = _freeBits[level];
+            std::vector<uint64_t> upper(((lower.size() - 1) >> LOG2_WORD_BITS) + 1, 0);
+            for (size_t j = 0; j < lower.size(); ++j) {
+                if (lower[j] != 0) {
+                    upper[j >> LOG2_WORD_BITS] |= uint64_t(1) << (j & WORD_MASK);
+                }
+            }
+            ++level;
+            if (level < _freeBits.size()) {
+                _freeBits[level].swap(upper);
+            } else {
+                _freeBits.push_back(std::move(upper));
+            }
+        }
+        _freeBits.resize(level + 1);
+    }
+
 private:
-    std::vector<Index_t> _freeIndices;
+    // _freeBits[0] is the leaf level, _freeBits.back() is a single word
+    std::vector< std::vector<uint64_t> > _freeBits;
     Index_t _maxNumElements;
     Index_t _nextNewIndex{0};
-    bool _freeIndicesAreSorted{true};
+    Index_t _numFree{0};
 };
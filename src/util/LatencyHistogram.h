@@ -0,0 +1,135 @@
+//
+// LatencyHistogram.h
+//
+// Distributed under the Apache License, Version 2.0.
+// See the accompanying file LICENSE or
+// http://www.apache.org/licenses/LICENSE-2.0.html
+//
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+// LatencyHistogram counts values (typically usec) in log-spaced buckets:
+// four buckets per power of two, so any percentile is accurate to within 25%.
+// It is not thread-safe: external logic must lock, or keep one per thread.
+//
+// When decay_period is non-zero the counts are halved every decay_period
+// samples, which makes percentiles track recent history (a cheap "rolling"
+// window) rather than all-time history.
+//
+class LatencyHistogram {
+public:
+    static constexpr uint32_t SUB_BUCKET_BITS = 2;
+    static constexpr uint32_t NUM_SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    // enough buckets for values up to 2^40 (~12 days of usec)
+    static constexpr uint32_t MAX_VALUE_BITS = 40;
+    static constexpr uint32_t NUM_BUCKETS = NUM_SUB_BUCKETS * (MAX_VALUE_BITS - SUB_BUCKET_BITS + 1);
+
+    static uint32_t computeBucket(uint64_t value) {
+        if (value < NUM_SUB_BUCKETS) {
+            return (uint32_t)value;
+        }
+        uint32_t msb = 63 - (uint32_t)__builtin_clzll(value);
+        uint32_t shift = msb - SUB_BUCKET_BITS;
+        uint32_t sub = (uint32_t)(value >> shift) & (NUM_SUB_BUCKETS - 1);
+        uint32_t bucket = NUM_SUB_BUCKETS * (shift + 1) + sub;
+        return (bucket < NUM_BUCKETS) ? bucket : NUM_BUCKETS - 1;
+    }
+
+    // smallest value that lands in bucket
+    static uint64_t getBucketFloor(uint32_t bucket) {
+        if (bucket < NUM_SUB_BUCKETS) {
+            return bucket;
+        }
+        uint32_t shift = bucket / NUM_SUB_BUCKETS - 1;
+        uint64_t sub = bucket % NUM_SUB_BUCKETS;
+        return (NUM_SUB_BUCKETS + sub) << shift;
+    }
+
+    // smallest value that lands in the next bucket
+    static uint64_t getBucketCeiling(uint32_t bucket) {
+        if (bucket < NUM_SUB_BUCKETS) {
+            return bucket + 1;
+        }
+        uint32_t shift = bucket / NUM_SUB_BUCKETS - 1;
+        return getBucketFloor(bucket) + (uint64_t(1) << shift);
+    }
+
+    explicit LatencyHistogram(uint32_t decay_period = 0) : _decayPeriod(decay_period) {
+        clear();
+    }
+
+    void add(uint64_t value) {
+        ++_buckets[computeBucket(value)];
+        ++_count;
+        if (value > _max) {
+            _max = value;
+        }
+        if (_decayPeriod > 0 && ++_numSinceDecay >= _decayPeriod) {
+            decay();
+        }
+    }
+
+    // adds the counts of other into this
+    void merge(const LatencyHistogram& other) {
+        for (uint32_t i = 0; i < NUM_BUCKETS; ++i) {
+            _buckets[i] += other._buckets[i];
+        }
+        _count += other._count;
+        if (other._max > _max) {
+            _max = other._max;
+        }
+    }
+
+    // halve all counts
+    void decay() {
+        _count = 0;
+        for (uint32_t i = 0; i < NUM_BUCKETS; ++i) {
+            _buckets[i] >>= 1;
+            _count += _buckets[i];
+        }
+        _numSinceDecay = 0;
+    }
+
+    void clear() {
+        _buckets.fill(0);
+        _count = 0;
+        _max = 0;
+        _numSinceDecay = 0;
+    }
+
+    uint64_t getCount() const { return _count; }
+
+    // largest value added since clear()
+    uint64_t getMax() const { return _max; }
+
+    // returns the ceiling of the bucket containing the 'fraction' percentile
+    // (e.g. fraction=0.99 for p99) or 0 when empty
+    uint64_t getPercentile(float fraction) const {
+        if (_count == 0) {
+            return 0;
+        }
+        uint64_t threshold = (uint64_t)(fraction * (float)_count);
+        if (threshold >= _count) {
+            threshold = _count - 1;
+        }
+        uint64_t sum = 0;
+        for (uint32_t i = 0; i < NUM_BUCKETS; ++i) {
+            sum += _buckets[i];
+            if (sum > threshold) {
+                return getBucketCeiling(i);
+            }
+        }
+        return getBucketCeiling(NUM_BUCKETS - 1);
+    }
+
+    const std::array<uint32_t, NUM_BUCKETS>& getBuckets() const { return _buckets; }
+
+private:
+    std::array<uint32_t, NUM_BUCKETS> _buckets;
+    uint64_t _count { 0 };
+    uint64_t _max { 0 };
+    uint32_t _decayPeriod { 0 };
+    uint32_t _numSinceDecay { 0 };
+};
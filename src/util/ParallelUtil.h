@@ -0,0 +1,185 @@
+//
+// ParallelUtil.h
+//
+// Distributed under the Apache License, Version 2.0.
+// See the accompanying file LICENSE or
+// http://www.apache.org/licenses/LICENSE-2.0.html
+//
+#pragma once
+
+#include <atomic>
+#include <exception>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "ThreadPool.h"
+
+// Data-parallel loops on a ThreadPool.
+//
+// The range [begin, end) is cut into chunks of 'grain' indices and the chunks
+// are split recursively: each task hands the upper half of its chunk range
+// back to the pool and keeps the lower half, until it holds a single chunk.
+// Idle workers steal the halves, so work spreads out in log(num_chunks) steps
+// without the calling thread posting every chunk itself.
+//
+// The calling thread participates: it runs the first chunk and then helps
+// with pending pool tasks until the loop is done.  This makes it safe to call
+// parallel_for from inside a pool task (nested loops).
+//
+// When grain == 0 it is chosen automatically: about eight chunks per thread,
+// which leaves enough slack for stealing to balance uneven chunks.
+//
+// If fn throws, the first exception is rethrown on the calling thread after
+// all chunks have finished.
+//
+namespace ParallelUtil {
+
+inline size_t compute_grain(const ThreadPool& pool, size_t num_indices) {
+    constexpr size_t CHUNKS_PER_THREAD = 8;
+    size_t num_threads = pool.getNumThreads() > 0 ? pool.getNumThreads() : 1;
+    size_t grain = num_indices / (num_threads * CHUNKS_PER_THREAD);
+    return grain > 0 ? grain : 1;
+}
+
+namespace detail {
+
+// ChunkLoop lives on the caller's stack: the caller does not return until
+// _numPending drops to zero, after which no task touches the loop again.
+template<typename ChunkFn>
+class ChunkLoop {
+public:
+    ChunkLoop(ThreadPool& pool, size_t num_chunks, ChunkFn& fn)
+        : _pool(pool), _fn(fn), _numChunks(num_chunks) { }
+
+    void run() {
+        if (_numChunks == 0) {
+            return;
+        }
+        _numPending.store(1, std::memory_order_relaxed);
+        split(0, _numChunks);
+        // help until all chunks are done
+        while (_numPending.load(std::memory_order_acquire) > 0) {
+            if (!_pool.tryRunTask()) {
+                std::this_thread::yield();
+            }
+        }
+        if (_error) {
+            std::rethrow_exception(_error);
+        }
+    }
+
+private:
+    // runs chunks [first, last)
+    // Note: caller has already counted this range in _numPending
+    void split(size_t first, size_t last) {
+        while (last - first > 1) {
+            size_t middle = first + (last - first) / 2;
+            _numPending.fetch_add(1, std::memory_order_relaxed);
+            try {
+                _pool.post([this, middle, last] { split(middle, last); });
+            } catch (...) {
+                // the pool is shutting down: undo the count and do that half here
+                _numPending.fetch_sub(1, std::memory_order_relaxed);
+                for (size_t chunk = middle; chunk < last; ++chunk) {
+                    runChunk(chunk);
+                }
+            }
+            last = middle;
+        }
+        runChunk(first);
+        // Note: this must be the last access to 'this'
+        _numPending.fetch_sub(1, std::memory_order_acq_rel);
+    }
+
+    void runChunk(size_t chunk) {
+        if (!_failed.load(std::memory_order_relaxed)) {
+            try {
+                _fn(chunk);
+            } catch (...) {
+                bool expected = false;
+                if (_failed.compare_exchange_strong(expected, true)) {
+                    _error = std::current_exception();
+                }
+            }
+        }
+    }
+
+private:
+    ThreadPool& _pool;
+    ChunkFn& _fn;
+    size_t _numChunks;
+    std::atomic<size_t> _numPending { 0 };
+    std::atomic<bool> _failed { false };
+    std::exception_ptr _error;
+};
+
+template<typename ChunkFn>
+void for_each_chunk(ThreadPool& pool, size_t num_chunks, ChunkFn fn) {
+    ChunkLoop<ChunkFn> loop(pool, num_chunks, fn);
+    loop.run();
+}
+
+} // namespace detail
+
+// calls fn(i) for every i in [begin, end)
+// or fn(chunk_begin, chunk_end) once per chunk, when fn takes two arguments
+template<typename Fn>
+void parallel_for(ThreadPool& pool, size_t begin, size_t end, size_t grain, Fn&& fn) {
+    if (end <= begin) {
+        return;
+    }
+    size_t num_indices = end - begin;
+    if (grain == 0) {
+        grain = compute_grain(pool, num_indices);
+    }
+    size_t num_chunks = (num_indices + grain - 1) / grain;
+    detail::for_each_chunk(pool, num_chunks, [&](size_t chunk) {
+        size_t chunk_begin = begin + chunk * grain;
+        size_t chunk_end = (end - chunk_begin > grain) ? chunk_begin + grain : end;
+        if constexpr (std::is_invocable_v<Fn&, size_t, size_t>) {
+            fn(chunk_begin, chunk_end);
+        } else {
+            for (size_t i = chunk_begin; i < chunk_end; ++i) {
+                fn(i);
+            }
+        }
+    });
+}
+
+// returns combine(...combine(combine(identity, map(begin)), map(begin+1))..., map(end-1))
+// Each chunk is folded separately and the per-chunk results are then combined
+// in index order, so combine must be associative but need not be commutative,
+// and the result does not depend on which thread ran which chunk.
+template<typename T, typename Map, typename Combine>
+T parallel_reduce(ThreadPool& pool, size_t begin, size_t end, size_t grain,
+        const T& identity, Map&& map, Combine&& combine) {
+    if (end <= begin) {
+        return identity;
+    }
+    size_t num_indices = end - begin;
+    if (grain == 0) {
+        grain = compute_grain(pool, num_indices);
+    }
+    size_t num_chunks = (num_indices + grain - 1) / grain;
+    // wrapped so that T=bool doesn't get the packed std::vector<bool>
+    // (which chunks could not write concurrently)
+    struct Result { T value; };
+    std::vector<Result> results(num_chunks, Result { identity });
+    detail::for_each_chunk(pool, num_chunks, [&](size_t chunk) {
+        size_t chunk_begin = begin + chunk * grain;
+        size_t chunk_end = (end - chunk_begin > grain) ? chunk_begin + grain : end;
+        T value = identity;
+        for (size_t i = chunk_begin; i < chunk_end; ++i) {
+            value = combine(value, map(i));
+        }
+        results[chunk].value = std::move(value);
+    });
+    T value = identity;
+    for (Result& result : results) {
+        value = combine(value, result.value);
+    }
+    return value;
+}
+
+} // namespace ParallelUtil
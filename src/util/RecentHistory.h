@@ -12,88 +12,86 @@
 
 #include <glm/glm.hpp>
 
+#include "RingUtil.h"
+
+// RecentHistory keeps the most recent events in a ring whose capacity is
+// rounded up to a power of two, so a version maps to its slot with a mask.
+// Versions are 64-bit and never wrap in practice: the event which advanced
+// the history from version v to v+1 lives in slot (v & mask) until it is
+// overwritten capacity events later.
+
 template < typename Event >
 class RecentHistory {
 public:
+    static constexpr uint32_t MAX_RING_CAPACITY = RingUtil::MAX_RING_CAPACITY;
 
     class Consumer {
     public:
-        uint32_t getVersion() const { return _version; }
-        void setVersion(uint32_t version) { _version = version; }
+        uint64_t getVersion() const { return _version; }
+        void setVersion(uint64_t version) { _version = version; }
         virtual void consumeEvent(const Event& event) = 0;
     private:
-        uint32_t _version {0};
+        uint64_t _version {0};
     };
 
     RecentHistory(uint32_t ring_capacity) {
-        const uint32_t MAX_RING_SIZE = 512;
-        if (ring_capacity > MAX_RING_SIZE) {
-            ring_capacity = MAX_RING_SIZE;
-        }
-        _ringCapacity = ring_capacity;
+        _ringCapacity = RingUtil::roundUpCapacity(ring_capacity);
+        _mask = _ringCapacity - 1;
         _events.resize(_ringCapacity);
     }
 
     uint32_t getSize() const {
-        return (_head >= _tail) ?
-            _head - _tail :
-            _ringCapacity - (_tail - _head);
+        uint64_t size = _version - _firstVersion;
+        return (size < _ringCapacity) ? (uint32_t)size : _ringCapacity;
     }
 
     uint32_t getCapacity() const { return _ringCapacity; }
 
-    void clearAndSetVersion(uint32_t version) {
-        _head = 0;
-        _tail = 0;
+    void clearAndSetVersion(uint64_t version) {
+        _firstVersion = version;
         _version = version;
     }
 
-    uint32_t getVersion() const { return _version; }
+    uint64_t getVersion() const { return _version; }
 
     // copies event to history
     // use this if you must, else consider using swap() or take() when possible
     // (they should be faster)
     void copy(const Event& event) {
-        _events[_head] = event;
+        _events[_version & _mask] = event;
         advanceHead();
     }
 
     void swap(Event& event) {
-        _events[_head].swap(event);
+        _events[_version & _mask].swap(event);
         advanceHead();
     }
 
     // take() is slower than swap()
     // use it for clarity of code (if that is important)
     void take(Event& event) {
-        _events[_head].clear();
-        _events[_head].swap(event);
+        Event& slot = _events[_version & _mask];
+        slot.clear();
+        slot.swap(event);
         advanceHead();
     }
 
     template<typename Consumer_t>
     bool advanceConsumer(Consumer_t& consumer) const {
-        uint32_t version = consumer.getVersion();
+        uint64_t version = consumer.getVersion();
         if (version > _version) {
             // wants a future version --> fail
             return false;
         }
-        uint32_t snake_length = getSize();
-        if (version < _version - snake_length) {
+        if (version < _version - getSize()) {
             // wants a version lost to history --> fail
             return false;
         }
 
-        // compute idx where consumer will start
-        uint32_t num_changes = _version - version;
-        uint32_t idx = (num_changes > _head) ?
-            (_ringCapacity + _head - num_changes) :
-            (_head - num_changes);
-
         // read history
-        while (idx != _head) {
-            consumer.consumeEvent(_events[idx]);
-            idx = (idx + 1) % _ringCapacity;
+        while (version != _version) {
+            consumer.consumeEvent(_events[version & _mask]);
+            ++version;
         }
         consumer.setVersion(_version);
         return true;
@@ -101,25 +99,19 @@ public:
 
 protected:
     void advanceHead() {
+        // Note: once the ring is full each new event overwrites the oldest
+        // and any consumers not moving fast enough will lose data.
+        // It is the duty of external logic to not push changes faster than
+        // it advances its consumers.
         ++_version;
-        _head = (_head + 1) % _ringCapacity;
-        if (_head == _tail) {
-            // snake has wrapped around on itself and is about to eat its tail
-            // so we advance the tail
-            // Note: any consumers not moving fast enough will lose data.
-            // It is the duty of external logic to not push changes faster than
-            // it advances its consumers.
-            _tail = (_tail + 1) % _ringCapacity;
-        }
     }
 
 private:
-    // recent changes are stored in a "snake" which moves around a "ring"
-    // new changes are placed in front of the head
-    // tail moves forward when necessary so as to not get eaten
-    uint32_t _tail {0};
-    uint32_t _head {0};
+    // recent changes are stored in a "snake" which moves around a "ring":
+    // its head is at _version and its tail is at most _ringCapacity behind
+    uint64_t _version {0};
+    uint64_t _firstVersion {0}; // oldest version since clear
     uint32_t _ringCapacity {0};
-    uint32_t _version {0};
+    uint32_t _mask {0};
     std::vector<Event> _events;
 };
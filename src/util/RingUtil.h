@@ -0,0 +1,31 @@
+//
+// RingUtil.h
+//
+// Distributed under the Apache License, Version 2.0.
+// See the accompanying file LICENSE or
+// http://www.apache.org/licenses/LICENSE-2.0.html
+//
+#pragma once
+
+#include <cstdint>
+
+// helpers for power-of-two rings (e.g. RecentHistory and ConcurrentRecentHistory)
+// where a version maps to its slot with (version & (capacity - 1))
+
+namespace RingUtil {
+
+constexpr uint32_t MAX_RING_CAPACITY = 1 << 24;
+
+// returns smallest power of two >= capacity, clamped to [1, MAX_RING_CAPACITY]
+constexpr uint32_t roundUpCapacity(uint32_t capacity) {
+    if (capacity > MAX_RING_CAPACITY) {
+        capacity = MAX_RING_CAPACITY;
+    }
+    uint32_t rounded = 1;
+    while (rounded < capacity) {
+        rounded <<= 1;
+    }
+    return rounded;
+}
+
+} // namespace RingUtil
@@ -0,0 +1,135 @@
+//
+// SlotMap.h
+//
+// Distributed under the Apache License, Version 2.0.
+// See the accompanying file LICENSE or
+// http://www.apache.org/licenses/LICENSE-2.0.html
+//
+#pragma once
+
+#include <utility>
+#include <vector>
+
+#include "GenerationalIndexAllocator.h"
+
+// SlotMap stores one T per entity in a densely packed array and hands out
+// GenerationalIndexAllocator handles as keys.
+//
+// An indirection table maps each handle's index to its element's position in
+// the dense array (and a reverse table maps positions back to indices), so:
+//   * get(handle) is O(1): a generation check and two loads
+//   * erase(handle) is O(1): the last element is moved into the hole
+//   * iterating over all live elements is one linear pass over contiguous
+//     memory with no holes, so the compiler can vectorize it
+//
+// Erase reorders the elements, so don't rely on their order, and pointers
+// returned by get() are only good until the next insert or erase.
+//
+// Example:
+//
+//     SlotMap<Position> positions(MAX_ENTITIES);
+//     auto handle = positions.insert({ 0.0f, 0.0f, 0.0f });
+//     ...
+//     for (Position& p : positions) {
+//         p.y -= 9.8f * dt;
+//     }
+//     if (Position* p = positions.get(handle)) { ... }
+//     positions.erase(handle);
+//
+// NOTE: Index_t can be: int32_t or int16_t
+
+template <typename T, typename Index_t = int32_t>
+class SlotMap {
+public:
+    using Allocator = GenerationalIndexAllocator<Index_t>;
+    using Handle = typename Allocator::Handle;
+    using iterator = typename std::vector<T>::iterator;
+    using const_iterator = typename std::vector<T>::const_iterator;
+
+    static constexpr Handle INVALID_HANDLE{ Allocator::INVALID_HANDLE };
+
+    explicit SlotMap(Index_t max_num_elements) : _handles(max_num_elements) { }
+
+    // returns INVALID_HANDLE when full
+    Handle insert(const T& value) { return emplace(value); }
+    Handle insert(T&& value) { return emplace(std::move(value)); }
+
+    template<typename... Args>
+    Handle emplace(Args&&... args) {
+        Handle handle = _handles.allocate();
+        if (handle == INVALID_HANDLE) {
+            return INVALID_HANDLE;
+        }
+        Index_t idx = Allocator::getIndex(handle);
+        if ((size_t)idx >= _indexToDense.size()) {
+            _indexToDense.resize(idx + 1);
+        }
+        _indexToDense[idx] = (Index_t)_values.size();
+        _values.emplace_back(std::forward<Args>(args)...);
+        _denseToIndex.push_back(idx);
+        return handle;
+    }
+
+    // returns false if handle is stale or invalid
+    bool erase(Handle handle) {
+        if (!_handles.free(handle)) {
+            return false;
+        }
+        Index_t idx = Allocator::getIndex(handle);
+        Index_t dense = _indexToDense[idx];
+        Index_t last = (Index_t)(_values.size() - 1);
+        if (dense != last) {
+            // swap-remove: move the last element into the hole
+            _values[dense] = std::move(_values[last]);
+            Index_t moved = _denseToIndex[last];
+            _denseToIndex[dense] = moved;
+            _indexToDense[moved] = dense;
+        }
+        _values.pop_back();
+        _denseToIndex.pop_back();
+        return true;
+    }
+
+    bool contains(Handle handle) const { return _handles.isValid(handle); }
+
+    // returns nullptr if handle is stale or invalid
+    T* get(Handle handle) {
+        return _handles.isValid(handle) ? &_values[_indexToDense[Allocator::getIndex(handle)]] : nullptr;
+    }
+    const T* get(Handle handle) const {
+        return _handles.isValid(handle) ? &_values[_indexToDense[Allocator::getIndex(handle)]] : nullptr;
+    }
+
+    // handle of the element at dense position i
+    Handle getHandle(size_t i) const { return _handles.getHandle(_denseToIndex[i]); }
+
+    size_t size() const { return _values.size(); }
+    bool empty() const { return _values.empty(); }
+
+    // the dense array
+    T* data() { return _values.data(); }
+    const T* data() const { return _values.data(); }
+    iterator begin() { return _values.begin(); }
+    iterator end() { return _values.end(); }
+    const_iterator begin() const { return _values.begin(); }
+    const_iterator end() const { return _values.end(); }
+
+    void reserve(size_t num_elements) {
+        _values.reserve(num_elements);
+        _denseToIndex.reserve(num_elements);
+        _indexToDense.reserve(num_elements);
+    }
+
+    // erases everything: all outstanding handles become stale
+    void clear() {
+        _handles.clear();
+        _values.clear();
+        _denseToIndex.clear();
+    }
+
+private:
+    Allocator _handles;
+    std::vector<T> _values; // dense
+    std::vector<Index_t> _denseToIndex; // parallel to _values
+    std::vector<Index_t> _indexToDense; // by handle index, only valid for live handles
+};
@@ -0,0 +1,266 @@
+//
+// TaskGraph.h
+//
+// Distributed under the Apache License, Version 2.0.
+// See the accompanying file LICENSE or
+// http://www.apache.org/licenses/LICENSE-2.0.html
+//
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ThreadPool.h"
+#include "TraceUtil.h"
+
+// TaskGraph is a reusable DAG of tasks which runs on a ThreadPool.
+//
+// Build it once (addNode, addEdge) and run() it every tick: each node has an
+// atomic count of unfinished predecessors which is reset at the start of the
+// run, and the node that finishes last releases its successor.  No thread
+// blocks on a future: the first ready successor runs in place on the same
+// worker and the rest are post()ed to the pool, so run() does no heap
+// allocation once the graph is built.
+//
+// run() blocks the calling thread but it helps with pool work meanwhile,
+// so it is safe to call from inside a pool task.
+//
+// Each node's last duration is kept in memory and, while TraceUtil is
+// collecting, each node also emits Duration events on the thread that ran it.
+//
+// Example: a simulation tick
+//
+//     TaskGraph tick("tick");
+//     auto input = tick.addNode("input", [&]{ readInput(); });
+//     auto physics = tick.addNode("physics", [&]{ stepPhysics(); });
+//     auto interest = tick.addNode("interest", [&]{ updateInterest(); });
+//     auto serialize = tick.addNode("serialize", [&]{ serializeState(); });
+//     tick.addEdge(input, physics);
+//     tick.addEdge(physics, interest);
+//     tick.addEdge(physics, serialize);
+//     ...
+//     while (running) {
+//         tick.run(pool);
+//     }
+//
+class TaskGraph {
+public:
+    using NodeId = uint32_t;
+
+    explicit TaskGraph(const std::string& name = "TaskGraph") : _name(name) { }
+
+    TaskGraph(const TaskGraph&) = delete;
+    TaskGraph& operator=(const TaskGraph&) = delete;
+
+    NodeId addNode(const std::string& name, std::function<void()> fn) {
+        assertNotRunning();
+        _nodes.push_back({ name, std::move(fn), {}, 0 });
+        _finalized = false;
+        return NodeId(_nodes.size() - 1);
+    }
+
+    // 'after' will not start until 'before' has finished
+    void addEdge(NodeId before, NodeId after) {
+        assertNotRunning();
+        if (before >= _nodes.size() || after >= _nodes.size() || before == after) {
+            throw std::invalid_argument("TaskGraph::addEdge bad node");
+        }
+        _nodes[before].successors.push_back(after);
+        ++_nodes[after].numPredecessors;
+        _finalized = false;
+    }
+
+    // validates the graph and allocates per-run state
+    // throws std::logic_error if the graph has a cycle
+    // Note: run() calls this when necessary, so it is only needed to
+    // move the allocation (and validation) out of the first run
+    void finalize();
+
+    // runs every node once and returns when all are done
+    // rethrows the first exception thrown by a node (after which
+    // the remaining nodes are skipped)
+    void run(ThreadPool& pool);
+
+    size_t getNumNodes() const { return _nodes.size(); }
+    const std::string& getName() const { return _name; }
+    const std::string& getNodeName(NodeId id) const { return _nodes[id].name; }
+
+    // duration of node during last run(), or 0 if it was skipped
+    uint64_t getNodeUsec(NodeId id) const { return _nodeUsec ? _nodeUsec[id] : 0; }
+
+private:
+    struct Node {
+        std::string name;
+        std::function<void()> fn;
+        std::vector<NodeId> successors;
+        uint32_t numPredecessors;
+    };
+
+    void assertNotRunning() const {
+        if (_running.load(std::memory_order_relaxed)) {
+            throw std::logic_error("TaskGraph modified or run while running");
+        }
+    }
+
+    void runNode(NodeId id);
+    void runFrom(NodeId id);
+
+private:
+    std::string _name;
+    std::vector<Node> _nodes;
+    std::vector<NodeId> _roots;
+    std::unique_ptr<std::atomic<uint32_t>[]> _numPending; // per node
+    std::unique_ptr<uint64_t[]> _nodeUsec; // per node
+    ThreadPool* _pool { nullptr };
+    std::atomic<size_t> _numRemaining { 0 };
+    std::atomic<bool> _running { false };
+    std::atomic<bool> _failed { false };
+    std::exception_ptr _error;
+    bool _traceEnabled { false };
+    bool _finalized { false };
+};
+
+inline void TaskGraph::finalize() {
+    assertNotRunning();
+    size_t num_nodes = _nodes.size();
+
+    // Kahn's algorithm: if we can't visit every node there is a cycle
+    std::vector<uint32_t> num_predecessors(num_nodes);
+    std::vector<NodeId> ready;
+    _roots.clear();
+    for (size_t i = 0; i < num_nodes; ++i) {
+        num_predecessors[i] = _nodes[i].numPredecessors;
+        if (num_predecessors[i] == 0) {
+            _roots.push_back(NodeId(i));
+            ready.push_back(NodeId(i));
+        }
+    }
+    size_t num_visited = 0;
+    while (!ready.empty()) {
+        NodeId id = ready.back();
+        ready.pop_back();
+        ++num_visited;
+        for (NodeId successor : _nodes[id].successors) {
+            if (--num_predecessors[successor] == 0) {
+                ready.push_back(successor);
+            }
+        }
+    }
+    if (num_visited != num_nodes) {
+        throw std::logic_error("TaskGraph '" + _name + "' has a cycle");
+    }
+
+    _numPending.reset(new std::atomic<uint32_t>[num_nodes]);
+    _nodeUsec.reset(new uint64_t[num_nodes]());
+    _finalized = true;
+}
+
+inline void TaskGraph::run(ThreadPool& pool) {
+    if (!_finalized) {
+        finalize();
+    }
+    bool expected = false;
+    if (!_running.compare_exchange_strong(expected, true)) {
+        throw std::logic_error("TaskGraph run while running");
+    }
+    if (_nodes.empty()) {
+        _running = false;
+        return;
+    }
+
+    _pool = &pool;
+    _failed.store(false, std::memory_order_relaxed);
+    _error = nullptr;
+    _traceEnabled = TraceUtil::Tracer::instance().isEnabled();
+    for (size_t i = 0; i < _nodes.size(); ++i) {
+        _numPending[i].store(_nodes[i].numPredecessors, std::memory_order_relaxed);
+        _nodeUsec[i] = 0;
+    }
+    _numRemaining.store(_nodes.size(), std::memory_order_relaxed);
+
+    for (size_t i = 1; i < _roots.size(); ++i) {
+        NodeId root = _roots[i];
+        try {
+            pool.post([this, root] { runFrom(root); });
+        } catch (...) {
+            // the pool is shutting down: run it here
+            runFrom(root);
+        }
+    }
+    runFrom(_roots[0]);
+
+    // help until all nodes are done
+    while (_numRemaining.load(std::memory_order_acquire) > 0) {
+        if (!pool.tryRunTask()) {
+            std::this_thread::yield();
+        }
+    }
+    _running = false;
+    if (_error) {
+        std::rethrow_exception(_error);
+    }
+}
+
+inline void TaskGraph::runNode(NodeId id) {
+    Node& node = _nodes[id];
+    if (_failed.load(std::memory_order_relaxed)) {
+        return;
+    }
+    if (_traceEnabled) {
+        TraceUtil::Tracer::instance().addEvent(node.name, _name, TraceUtil::Phase::DurationBegin);
+    }
+    auto start = std::chrono::steady_clock::now();
+    try {
+        node.fn();
+    } catch (...) {
+        bool expected = false;
+        if (_failed.compare_exchange_strong(expected, true)) {
+            _error = std::current_exception();
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    _nodeUsec[id] = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    if (_traceEnabled) {
+        TraceUtil::Tracer::instance().addEvent(node.name, _name, TraceUtil::Phase::DurationEnd);
+    }
+}
+
+// runs node 'id' then any successors it releases: the first in place
+// and the rest on the pool
+inline void TaskGraph::runFrom(NodeId id) {
+    for (;;) {
+        runNode(id);
+        NodeId next = NodeId(-1);
+        for (NodeId successor : _nodes[id].successors) {
+            // acq_rel: successor sees the work of all its predecessors
+            if (_numPending[successor].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                if (next == NodeId(-1)) {
+                    next = successor;
+                } else {
+                    try {
+                        _pool->post([this, successor] { runFrom(successor); });
+                    } catch (...) {
+                        // the pool is shutting down: run it here
+                        // (we still hold our count in _numRemaining)
+                        runFrom(successor);
+                    }
+                }
+            }
+        }
+        // Note: after the last decrement run() may return, so
+        // this must be the last access to 'this' when next is not set
+        _numRemaining.fetch_sub(1, std::memory_order_acq_rel);
+        if (next == NodeId(-1)) {
+            break;
+        }
+        id = next;
+    }
+}
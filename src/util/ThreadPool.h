@@ -23,8 +23,26 @@
 *   distribution.
 */
 
+// Altered: the single mutex-protected task queue has been replaced by a
+// work-stealing scheduler.  Each worker owns a Chase-Lev deque: it pushes and
+// pops at the bottom without locks while idle workers steal from the top, so
+// tasks that spawn tasks (the common case for fan-out work) never touch a
+// lock.  Tasks enqueued from outside the pool, and tasks in the HIGH, LOW and
+// deadline lanes, go into shared queues under the one remaining lock, and a
+// relaxed atomic count per lane keeps workers from taking that lock when the
+// lanes are empty.  An idle worker spins briefly, steals from random victims
+// and only then parks.
+//
+// On top of that the pool has allocation-free post(), priority lanes and
+// deadlines, CPU pinning and NUMA grouping, always-on stats, timers and
+// adaptive sizing: see the notes on the corresponding API below.
+
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <vector>
 #include <queue>
 #include <memory>
@@ -33,85 +51,1637 @@
 #include <condition_variable>
 #include <future>
 #include <functional>
+#include <fstream>
+#include <new>
 #include <stdexcept>
+#include <string>
+#include <system_error>
+#include <tuple>
+#include <type_traits>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "LatencyHistogram.h"
+#include "TraceMacros.h"
 
 class ThreadPool {
 public:
+    static constexpr size_t NO_WORKER = size_t(-1);
+
+    // Task is a move-only callable with small-buffer storage: callables of up
+    // to INLINE_SIZE bytes (e.g. a lambda capturing a handful of pointers) are
+    // stored in place.  Larger callables fall back to the heap.  The deque
+    // nodes which carry Tasks are recycled through per-thread free lists.
+    class Task {
+    public:
+        static constexpr size_t INLINE_SIZE = 64;
+
+        Task() = default;
+
+        template<class F, class = typename std::enable_if<
+                !std::is_same<typename std::decay<F>::type, Task>::value>::type>
+        Task(F&& f) {
+            using Callable = typename std::decay<F>::type;
+            if constexpr (sizeof(Callable) <= INLINE_SIZE
+                    && alignof(Callable) <= alignof(std::max_align_t)
+                    && std::is_nothrow_move_constructible<Callable>::value) {
+                new (_storage) Callable(std::forward<F>(f));
+                _ops = &InlineOps<Callable>::OPS;
+            } else {
+                // yes: naked new
+                *reinterpret_cast<Callable**>(_storage) = new Callable(std::forward<F>(f));
+                _ops = &HeapOps<Callable>::OPS;
+            }
+        }
+
+        Task(Task&& other) noexcept { moveFrom(other); }
+
+        Task& operator=(Task&& other) noexcept {
+            if (this != &other) {
+                reset();
+                moveFrom(other);
+            }
+            return *this;
+        }
+
+        Task(const Task&) = delete;
+        Task& operator=(const Task&) = delete;
+
+        ~Task() { reset(); }
+
+        friend class ThreadPool;
+
+        void operator()() { _ops->invoke(_storage); }
+
+        void reset() {
+            if (_ops) {
+                _ops->destroy(_storage);
+                _ops = nullptr;
+            }
+            _enqueueTime = 0;
+        }
+
+        explicit operator bool() const { return _ops != nullptr; }
+
+        // true when the callable lives in the inline buffer
+        bool isInline() const { return _ops && _ops->isInline; }
+
+    private:
+        struct Ops {
+            void (*invoke)(void*);
+            void (*relocate)(void* dst, void* src); // move to dst and destroy src
+            void (*destroy)(void*);
+            bool isInline;
+        };
+
+        template<class C>
+        struct InlineOps {
+            static void invoke(void* p) { (*static_cast<C*>(p))(); }
+            static void relocate(void* dst, void* src) {
+                C* c = static_cast<C*>(src);
+                new (dst) C(std::move(*c));
+                c->~C();
+            }
+            static void destroy(void* p) { static_cast<C*>(p)->~C(); }
+            static constexpr Ops OPS { &invoke, &relocate, &destroy, true };
+        };
+
+        template<class C>
+        struct HeapOps {
+            static void invoke(void* p) { (**static_cast<C**>(p))(); }
+            static void relocate(void* dst, void* src) {
+                *static_cast<C**>(dst) = *static_cast<C**>(src);
+            }
+            static void destroy(void* p) { delete *static_cast<C**>(p); } // yes: naked delete
+            static constexpr Ops OPS { &invoke, &relocate, &destroy, false };
+        };
+
+        void moveFrom(Task& other) {
+            _ops = other._ops;
+            if (_ops) {
+                _ops->relocate(_storage, other._storage);
+                other._ops = nullptr;
+            }
+            _enqueueTime = other._enqueueTime;
+            other._enqueueTime = 0;
+        }
+
+    private:
+        alignas(std::max_align_t) unsigned char _storage[INLINE_SIZE];
+        const Ops* _ops { nullptr };
+        int64_t _enqueueTime { 0 }; // nsec, only set on sampled tasks
+    };
+
+    // HIGH tasks run before anything else except expired deadline tasks.
+    // NORMAL tasks are the work-stealing path: only NORMAL tasks posted from
+    // a worker go on its deque.  LOW tasks run when there is nothing else to
+    // do, except that a LOW task which has waited longer than the low
+    // priority max wait is promoted (starvation protection).
+    enum class Priority : uint8_t {
+        HIGH = 0,
+        NORMAL,
+        LOW
+    };
+
+    // Deadline tasks run in earliest-deadline-first order after HIGH work.
+    // This is what to do with one whose deadline passes before it starts:
+    // DROP it, or EXPEDITE it ahead of everything.
+    enum class DeadlinePolicy : uint8_t {
+        DROP,
+        EXPEDITE
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr uint64_t DEFAULT_LOW_PRIORITY_MAX_WAIT = 50000; // usec
+    static constexpr uint32_t DEFAULT_SPIN_USEC = 50;
+    static constexpr uint32_t DEFAULT_IDLE_TIMEOUT_MSEC = 10000;
+    // the pool grows by at most one worker this often
+    static constexpr int64_t GROW_INTERVAL_USEC = 500;
+
+    // Options can pin workers to CPUs and group them by NUMA node (as read
+    // from /sys on Linux).  When grouped, each node has its own NORMAL
+    // injection queue: tasks posted from outside the pool go to the queue of
+    // the caller's node, and workers try their own node's queue and steal
+    // from their own node's workers before they look further afield.
+    // Workers are named "<name>:<index>" for the OS and for TraceUtil.
+    struct Options {
+        size_t numThreads { std::thread::hardware_concurrency() }; // initial
+        // adaptive limits: zero means numThreads, so by default the size is fixed
+        // Note: maxThreads is also the hard cap for setThreadLimits()
+        size_t minThreads { 0 };
+        size_t maxThreads { 0 };
+        // idle workers spin this long before they park (ignored on one cpu)
+        uint32_t spinUsec { DEFAULT_SPIN_USEC };
+        // workers above minThreads retire after parking this long
+        uint32_t idleTimeoutMsec { DEFAULT_IDLE_TIMEOUT_MSEC };
+        std::string name { "pool" }; // threads are named "<name>:<index>"
+        // when not empty worker i is pinned to cpus[i % cpus.size()]
+        std::vector<int32_t> cpus;
+        // group workers by NUMA node with node-local injection queues
+        // (workers are spread over the nodes and pinned to their node's cpus
+        // unless 'cpus' says otherwise)
+        bool numaAware { false };
+    };
+
     ThreadPool(size_t);
+    explicit ThreadPool(const Options& options);
+
+    // enqueue a task and get a future for its result
+    // Note: the future's shared state costs one allocation
     template<class F, class... Args>
     auto enqueue(F&& f, Args&&... args)
-        -> std::future<typename std::result_of<F(Args...)>::type>;
+        -> std::future<std::invoke_result_t<F, Args...>>;
+
+    template<class F, class... Args>
+    auto enqueue(Priority priority, F&& f, Args&&... args)
+        -> std::future<std::invoke_result_t<F, Args...>>;
+
+    // Note: the future throws std::future_error (broken_promise)
+    // if the task is dropped
+    template<class F, class... Args>
+    auto enqueueWithDeadline(Clock::time_point deadline, DeadlinePolicy policy, F&& f, Args&&... args)
+        -> std::future<std::invoke_result_t<F, Args...>>;
+
+    // enqueue a fire-and-forget task: no future, and no heap allocation in
+    // steady state when f fits in Task::INLINE_SIZE
+    // Note: f must not throw
+    template<class F>
+    void post(F&& f);
+
+    template<class F>
+    void post(Priority priority, F&& f);
+
+    template<class F>
+    void postWithDeadline(Clock::time_point deadline, DeadlinePolicy policy, F&& f);
+
+    class TimerHandle;
+
+    // Timers live in one min-heap served by a timer thread (started on first
+    // use) which posts each task to the pool when it is due.  The returned
+    // TimerHandle cancels it.
+
+    // run f once at (or soon after) time
+    // Note: like post() f must not throw, and timers which have not fired
+    // when the pool is destroyed never run
+    template<class F>
+    TimerHandle enqueueAt(Clock::time_point time, F&& f);
+
+    template<class F>
+    TimerHandle enqueueAfter(Clock::duration delay, F&& f);
+
+    // run f every period, starting one period from now
+    // The schedule is fixed-rate: when a run is still in progress as the next
+    // one comes due that run is skipped, and after a stall the schedule
+    // restarts from now rather than firing a burst to catch up.
+    template<class F>
+    TimerHandle enqueueEvery(Clock::duration period, F&& f);
+
+    // a LOW task which has waited longer than this is run ahead of NORMAL work
+    void setLowPriorityMaxWait(uint64_t usec) { _lowPriorityMaxWait.store(usec, std::memory_order_relaxed); }
+    uint64_t getLowPriorityMaxWait() const { return _lowPriorityMaxWait.load(std::memory_order_relaxed); }
+
     ~ThreadPool();
+
+    // The pool is adaptive: it runs between a min and a max number of workers.
+    // An idle worker first spins for up to spinUsec (polling the queues with
+    // cpu pause hints) before it parks, and while any worker spins enqueue
+    // skips the wakeup.  A worker parked longer than the idle timeout retires
+    // while there are more than minThreads, and the pool grows (at most once
+    // per GROW_INTERVAL_USEC) when tasks queue up while no worker is parked or
+    // spinning.  Worker slots, up to the max, are allocated at construction
+    // so indices and stats stay stable as threads come and go.
+
+    // number of running workers
+    size_t getNumThreads() const { return _numThreads.load(std::memory_order_relaxed); }
+
+    // clamps max to the capacity set at construction and min to [1, max]
+    // (unless the pool has no workers at all), grows the pool to min at once
+    // and lets surplus workers retire when they next go idle
+    // (see ThreadPoolConfig.h to drive this from config)
+    void setThreadLimits(size_t min_threads, size_t max_threads);
+    size_t getMinThreads() const { return _minThreads.load(std::memory_order_relaxed); }
+    size_t getMaxThreads() const { return _maxThreads.load(std::memory_order_relaxed); }
+    // number of worker slots: the most threads the pool can ever have
+    size_t getThreadCapacity() const { return _workerStates.size(); }
+
+    void setSpinUsec(uint32_t usec) { _spinUsec.store(usec, std::memory_order_relaxed); }
+    uint32_t getSpinUsec() const { return _spinUsec.load(std::memory_order_relaxed); }
+    void setIdleTimeout(uint32_t msec) { _idleTimeoutMsec.store(msec, std::memory_order_relaxed); }
+    uint32_t getIdleTimeout() const { return _idleTimeoutMsec.load(std::memory_order_relaxed); }
+
+    // number of node-local injection queues (one unless Options::numaAware)
+    size_t getNumNodes() const { return tasks.size(); }
+
+    // returns NUMA node of worker
+    uint32_t getWorkerNode(size_t index) const { return _workerStates[index]->node; }
+
+    // Stats are always on but cheap: every task bumps a per-worker counter,
+    // parking and waking are timestamped (for busy ratios), and only one task
+    // in STATS_SAMPLE_PERIOD is timestamped on enqueue and around its run.
+
+    // one task in STATS_SAMPLE_PERIOD is timed for the wait/run histograms
+    static constexpr uint32_t STATS_SAMPLE_PERIOD = 64;
+    // histograms halve their counts this often (in samples)
+    static constexpr uint32_t STATS_DECAY_PERIOD = 4096;
+
+    struct Stats {
+        uint64_t numTasks { 0 }; // tasks run by workers
+        uint64_t numDropped { 0 }; // expired DROP tasks
+        size_t queueDepth { 0 }; // tasks waiting to run (approximate)
+        uint64_t uptimeUsec { 0 };
+        std::vector<uint64_t> busyUsec; // per worker slot: time not parked (retired counts as parked)
+        LatencyHistogram waitUsec; // enqueue to start (sampled)
+        LatencyHistogram runUsec; // run time (sampled)
+    };
+
+    Stats getStats() const;
+
+    // returns fraction of worker time spent not parked between two Stats
+    static float computeBusyRatio(const Stats& before, const Stats& after);
+
+    // adds pool counters to TraceUtil (while it is enabled):
+    // queue_depth, wait and run percentiles, and busy_percent since the
+    // previous call.  Call it periodically, e.g. once per main loop.
+    void sampleCounters();
+
+    // parses a Linux cpu list, e.g. "0-3,8,10-11"
+    static std::vector<int32_t> parseCpuList(const std::string& list);
+
+    // returns the cpus of each NUMA node, or an empty list when the topology
+    // is not available (e.g. not Linux)
+    static std::vector< std::vector<int32_t> > readNumaNodes();
+
+    // returns index of calling thread's worker in this pool, else NO_WORKER
+    size_t getWorkerIndex() const;
+
+    // runs one pending task on the calling thread, if one can be found,
+    // and returns true if it did: a thread which must wait on pool work
+    // can help instead of blocking (and a worker which waits won't deadlock)
+    bool tryRunTask();
+
+private:
+    // TaskNode carries a Task through a TaskDeque
+    struct TaskNode {
+        Task task;
+        TaskNode* next { nullptr };
+    };
+
+    // TaskNodes are recycled through a per-thread free list so steady-state
+    // fan-out from workers does no heap allocation.  A node is returned to the
+    // list of whichever thread ran it, so the list is capped.
+    static constexpr size_t MAX_CACHED_NODES = 4096;
+    struct NodeCache {
+        ~NodeCache() {
+            while (head) {
+                TaskNode* node = head;
+                head = node->next;
+                delete node;
+            }
+        }
+        TaskNode* head { nullptr };
+        size_t size { 0 };
+    };
+    static NodeCache& nodeCache() {
+        static thread_local NodeCache cache;
+        return cache;
+    }
+    static TaskNode* acquireNode(Task&& task);
+    static void releaseNode(TaskNode* node);
+
+    // TaskRing is a growable FIFO which stores Tasks (or structs holding them)
+    // by value so the shared queues don't allocate in steady state
+    template<typename T>
+    class TaskRing {
+    public:
+        bool empty() const { return _size == 0; }
+        size_t size() const { return _size; }
+
+        void push(T&& item) {
+            if (_size == _slots.size()) {
+                grow();
+            }
+            _slots[(_head + _size) & (_slots.size() - 1)] = std::move(item);
+            ++_size;
+        }
+
+        T& front() { return _slots[_head]; }
+
+        T pop() {
+            T item = std::move(_slots[_head]);
+            _head = (_head + 1) & (_slots.size() - 1);
+            --_size;
+            return item;
+        }
+
+    private:
+        void grow() {
+            std::vector<T> bigger(_slots.empty() ? 256 : 2 * _slots.size());
+            for (size_t i = 0; i < _size; ++i) {
+                bigger[i] = std::move(_slots[(_head + i) & (_slots.size() - 1)]);
+            }
+            _slots.swap(bigger);
+            _head = 0;
+        }
+
+    private:
+        std::vector<T> _slots;
+        size_t _head { 0 };
+        size_t _size { 0 };
+    };
+
+    struct LowTask {
+        Task task;
+        Clock::time_point enqueueTime;
+    };
+
+    struct DeadlineTask {
+        Task task;
+        Clock::time_point deadline;
+        DeadlinePolicy policy;
+        // for a min-heap on deadline
+        bool operator<(const DeadlineTask& other) const { return deadline > other.deadline; }
+    };
+
+    // TaskDeque is the Chase-Lev work-stealing deque as described in
+    // "Correct and Efficient Work-Stealing for Weak Memory Models"
+    // (Lê, Pop, Cohen, Zappa Nardelli 2013).
+    // The owner pushes and pops at the bottom, thieves steal from the top.
+    // The ring grows when full; retired rings are kept until destruction
+    // because a slow thief may still be reading them.
+    class TaskDeque {
+    public:
+        explicit TaskDeque(int64_t capacity = 1024) {
+            _ring.store(new Ring(capacity), std::memory_order_relaxed);
+        }
+
+        ~TaskDeque() {
+            delete _ring.load(std::memory_order_relaxed);
+            for (Ring* ring : _retiredRings) {
+                delete ring;
+            }
+        }
+
+        // owner only
+        void push(TaskNode* task) {
+            int64_t b = _bottom.load(std::memory_order_relaxed);
+            int64_t t = _top.load(std::memory_order_acquire);
+            Ring* ring = _ring.load(std::memory_order_relaxed);
+            if (b - t > ring->capacity - 1) {
+                ring = grow(ring, t, b);
+            }
+            ring->put(b, task);
+            std::atomic_thread_fence(std::memory_order_release);
+            _bottom.store(b + 1, std::memory_order_relaxed);
+        }
+
+        // owner only
+        TaskNode* pop() {
+            int64_t b = _bottom.load(std::memory_order_relaxed) - 1;
+            Ring* ring = _ring.load(std::memory_order_relaxed);
+            _bottom.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t t = _top.load(std::memory_order_relaxed);
+            TaskNode* task = nullptr;
+            if (t <= b) {
+                task = ring->get(b);
+                if (t == b) {
+                    // last item: race against thieves
+                    if (!_top.compare_exchange_strong(t, t + 1,
+                            std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                        task = nullptr;
+                    }
+                    _bottom.store(b + 1, std::memory_order_relaxed);
+                }
+            } else {
+                _bottom.store(b + 1, std::memory_order_relaxed);
+            }
+            return task;
+        }
+
+        // any thread
+        // Note: returns nullptr when empty OR when it lost a race
+        TaskNode* steal() {
+            int64_t t = _top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t b = _bottom.load(std::memory_order_acquire);
+            if (t < b) {
+                Ring* ring = _ring.load(std::memory_order_acquire);
+                TaskNode* task = ring->get(t);
+                if (_top.compare_exchange_strong(t, t + 1,
+                        std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                    return task;
+                }
+            }
+            return nullptr;
+        }
+
+        // approximate when called by non-owner
+        size_t size() const {
+            int64_t b = _bottom.load(std::memory_order_relaxed);
+            int64_t t = _top.load(std::memory_order_relaxed);
+            return b > t ? (size_t)(b - t) : 0;
+        }
+
+        // approximate when called by non-owner
+        bool empty() const {
+            int64_t b = _bottom.load(std::memory_order_seq_cst);
+            int64_t t = _top.load(std::memory_order_seq_cst);
+            return b <= t;
+        }
+
+    private:
+        struct Ring {
+            explicit Ring(int64_t c) : capacity(c), mask(c - 1), slots(new std::atomic<TaskNode*>[c]) { }
+            ~Ring() { delete[] slots; }
+            void put(int64_t i, TaskNode* task) { slots[i & mask].store(task, std::memory_order_relaxed); }
+            TaskNode* get(int64_t i) const { return slots[i & mask].load(std::memory_order_relaxed); }
+            int64_t capacity;
+            int64_t mask;
+            std::atomic<TaskNode*>* slots;
+        };
+
+        Ring* grow(Ring* ring, int64_t t, int64_t b) {
+            Ring* bigger = new Ring(2 * ring->capacity);
+            for (int64_t i = t; i < b; ++i) {
+                bigger->put(i, ring->get(i));
+            }
+            _retiredRings.push_back(ring);
+            _ring.store(bigger, std::memory_order_release);
+            return bigger;
+        }
+
+    private:
+        alignas(64) std::atomic<int64_t> _top { 0 };
+        alignas(64) std::atomic<int64_t> _bottom { 0 };
+        std::atomic<Ring*> _ring;
+        std::vector<Ring*> _retiredRings;
+    };
+
+    struct Worker {
+        TaskDeque deque;
+        std::vector<int32_t> cpus; // affinity, empty means any
+        uint64_t rng { 0 }; // for picking random steal victims
+        uint32_t numSearches { 0 }; // for pacing starvation checks
+        uint32_t node { 0 };
+        std::atomic<bool> active { false }; // has a running thread
+
+        // stats: written only by the owner
+        std::atomic<uint64_t> numTasks { 0 };
+        std::atomic<int64_t> parkedNsec { 0 }; // completed parks
+        std::atomic<int64_t> parkStart { 0 }; // nsec, zero when not parked
+        mutable std::mutex histogramMutex;
+        LatencyHistogram waitUsec { STATS_DECAY_PERIOD };
+        LatencyHistogram runUsec { STATS_DECAY_PERIOD };
+    };
+
+    static int64_t getNowNsec() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+    }
+
+    // timestamps every STATS_SAMPLE_PERIOD'th task pushed by this thread
+    static void sampleEnqueueTime(Task& task) {
+        static thread_local uint32_t num_pushed = 0;
+        if (++num_pushed % STATS_SAMPLE_PERIOD == 0) {
+            task._enqueueTime = getNowNsec();
+        }
+    }
+
+    void runTask(Worker& worker, Task& task);
+
+    struct TimerState {
+        explicit TimerState(Task&& t) : task(std::move(t)) { }
+        Task task;
+        std::atomic<bool> cancelled { false };
+        std::atomic<bool> running { false };
+        std::atomic<bool> done { false };
+    };
+
+    struct Timer {
+        Clock::time_point due;
+        Clock::duration period; // zero for one-shot
+        std::shared_ptr<TimerState> state;
+        // for a min-heap on due
+        bool operator<(const Timer& other) const { return due > other.due; }
+    };
+
+    TimerHandle addTimer(Clock::time_point due, Clock::duration period, Task&& task);
+    void runTimers();
+
+    // how many tasks a worker runs between checks for starving LOW tasks
+    static constexpr uint32_t LOW_PRIORITY_CHECK_INTERVAL = 32;
+
+    // identifies the pool+worker of the current thread
+    struct WorkerIdentity {
+        const ThreadPool* pool { nullptr };
+        size_t index { NO_WORKER };
+    };
+    static WorkerIdentity& currentWorker() {
+        static thread_local WorkerIdentity identity;
+        return identity;
+    }
+
+    template<class F, class... Args>
+    static auto makePackagedTask(F&& f, Args&&... args)
+        -> std::packaged_task<std::invoke_result_t<F, Args...>()>;
+
+    void push(Task&& task, Priority priority);
+    void pushWithDeadline(Task&& task, Clock::time_point deadline, DeadlinePolicy policy);
+    void pushShared(Priority priority, Task&& task);
+    bool popUrgent(Task& task);
+    bool popStarving(Task& task);
+    bool popShared(Task& task, Priority priority, uint32_t node);
+    bool findTask(size_t index, Task& task);
+    bool findExternalTask(Task& task);
+    static Options makeOptions(size_t threads) {
+        Options options;
+        options.numThreads = threads;
+        return options;
+    }
+    bool stealFrom(const std::vector<size_t>& victims, size_t index, Task& task);
+    static void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#else
+        std::this_thread::yield();
+#endif
+    }
+    // pause hints between polls of the queues while spinning
+    static constexpr uint32_t SPIN_PAUSES = 32;
+    bool spinForTask(size_t index, Task& task);
+    bool hasQueuedWork() const;
+    void notifyLocked();
+    void maybeGrow();
+    bool addWorker();
+    bool tryRetire(size_t limit);
+    uint32_t getCurrentNode() const;
+    void startWorker(size_t index);
+    bool hasVisibleWork() const;
+    void wakeOne();
+    void runWorker(size_t index);
+
 private:
     // need to keep track of threads so we can join them
     std::vector< std::thread > workers;
-    // the task queue
-    std::queue< std::function<void()> > tasks;
+    std::vector< std::unique_ptr<Worker> > _workerStates;
+    // the injection queues for NORMAL tasks from outside the pool: one per node
+    std::vector< TaskRing<Task> > tasks;
+    std::vector< std::vector<size_t> > _nodeWorkers; // worker indices by node
+    std::vector<size_t> _allWorkers;
+    std::vector<uint32_t> _cpuToNode;
+    std::string _name;
+    // the other lanes, all guarded by _queuMutex
+    TaskRing<Task> _highTasks;
+    TaskRing<LowTask> _lowTasks;
+    std::vector<DeadlineTask> _deadlineTasks; // min-heap on deadline
+    // lock-free peeks at the lanes above
+    std::atomic<uint32_t> _numUrgent { 0 }; // HIGH + deadline
+    std::atomic<uint32_t> _numLow { 0 };
+    std::atomic<uint32_t> _numShared { 0 }; // NORMAL tasks in the injection queues
+    std::atomic<uint64_t> _lowPriorityMaxWait { DEFAULT_LOW_PRIORITY_MAX_WAIT };
+    std::atomic<uint64_t> _numDropped { 0 };
+
+    // stats
+    int64_t _startTime; // nsec
+    std::mutex _sampleMutex;
+    Stats _lastSample; // guarded by _sampleMutex
 
     // synchronization
-    std::mutex _queuMutex;
+    mutable std::mutex _queuMutex;
     std::condition_variable condition;
-    bool stop;
+    std::atomic<uint32_t> _numParked { 0 };
+    uint32_t _numWakeups { 0 }; // guarded by _queuMutex
+    std::atomic<uint32_t> _numSpinning { 0 };
+    // adaptive sizing
+    std::atomic<size_t> _numThreads { 0 };
+    std::atomic<size_t> _minThreads { 0 };
+    std::atomic<size_t> _maxThreads { 0 };
+    std::atomic<uint32_t> _spinUsec { 0 };
+    std::atomic<uint32_t> _idleTimeoutMsec { 0 };
+    std::atomic<int64_t> _lastGrowTime { 0 }; // nsec
+    std::mutex _resizeMutex; // guards starting and joining threads
+    // timers
+    std::thread _timerThread; // started on first use
+    std::vector<Timer> _timers; // min-heap on due, guarded by _timerMutex
+    std::mutex _timerMutex;
+    std::condition_variable _timerCondition;
+    bool _stopTimers { false }; // guarded by _timerMutex
+
+    std::atomic<bool> stop;
+};
+
+// TimerHandle refers to a task scheduled by enqueueAt/After/Every
+class ThreadPool::TimerHandle {
+public:
+    TimerHandle() = default;
+
+    // prevents any future run (a run already in progress completes)
+    void cancel() {
+        if (_state) {
+            _state->cancelled.store(true, std::memory_order_relaxed);
+        }
+    }
+
+    // true until cancelled, or until a one-shot timer has run
+    bool isActive() const {
+        return _state
+            && !_state->cancelled.load(std::memory_order_relaxed)
+            && !_state->done.load(std::memory_order_acquire);
+    }
+
+private:
+    friend class ThreadPool;
+    explicit TimerHandle(std::shared_ptr<TimerState> state) : _state(std::move(state)) { }
+    std::shared_ptr<TimerState> _state;
 };
 
 // the constructor just launches some amount of workers
 inline ThreadPool::ThreadPool(size_t threads)
-    :   stop(false)
+    :   ThreadPool(makeOptions(threads))
 {
-    for (size_t i = 0;i<threads;++i) {
-        workers.emplace_back(
-            [this] {
-                for (;;) {
-                    std::function<void()> task;
-                    {
-                        std::unique_lock<std::mutex> lock(this->_queuMutex);
-                        this->condition.wait(lock,
-                            [this]{ return this->stop || !this->tasks.empty(); });
-                        if (this->stop && this->tasks.empty()) {
-                            return;
-                        }
-                        task = std::move(this->tasks.front());
-                        this->tasks.pop();
-                    }
-                    task();
-                }
+}
+
+inline ThreadPool::ThreadPool(const Options& options)
+    :   _name(options.name), _startTime(getNowNsec()), stop(false)
+{
+    size_t threads = options.numThreads;
+    size_t min_threads = options.minThreads > 0 ? options.minThreads : threads;
+    size_t max_threads = std::max(options.maxThreads > 0 ? options.maxThreads : threads, min_threads);
+    if (max_threads > 0) {
+        min_threads = std::max(min_threads, size_t(1));
+    }
+    threads = std::min(std::max(threads, min_threads), max_threads);
+    _minThreads.store(min_threads, std::memory_order_relaxed);
+    _maxThreads.store(max_threads, std::memory_order_relaxed);
+    // spinning only helps when another cpu can post the work
+    _spinUsec.store(std::thread::hardware_concurrency() > 1 ? options.spinUsec : 0, std::memory_order_relaxed);
+    _idleTimeoutMsec.store(options.idleTimeoutMsec, std::memory_order_relaxed);
+
+    // topology
+    std::vector< std::vector<int32_t> > nodes;
+    if (options.numaAware) {
+        nodes = readNumaNodes();
+    }
+    if (nodes.empty()) {
+        nodes.push_back({});
+    }
+    for (uint32_t node = 0; node < nodes.size(); ++node) {
+        for (int32_t cpu : nodes[node]) {
+            if (cpu >= (int32_t)_cpuToNode.size()) {
+                _cpuToNode.resize(cpu + 1, 0);
             }
-        );
+            _cpuToNode[cpu] = node;
+        }
     }
+    tasks.resize(nodes.size());
+    _nodeWorkers.resize(nodes.size());
+
+    // a slot per potential worker
+    for (size_t i = 0;i<max_threads;++i) {
+        _workerStates.emplace_back(new Worker());
+        Worker& worker = *_workerStates.back();
+        worker.rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        if (!options.cpus.empty()) {
+            int32_t cpu = options.cpus[i % options.cpus.size()];
+            worker.cpus = { cpu };
+            if (cpu >= 0 && cpu < (int32_t)_cpuToNode.size()) {
+                worker.node = _cpuToNode[cpu];
+            }
+        } else if (nodes.size() > 1) {
+            worker.node = (uint32_t)(i % nodes.size());
+            worker.cpus = nodes[worker.node];
+        }
+        _nodeWorkers[worker.node].push_back(i);
+        _allWorkers.push_back(i);
+    }
+    _lastSample.busyUsec.resize(max_threads, 0);
+    _numThreads.store(threads, std::memory_order_relaxed);
+    workers.resize(max_threads);
+    for (size_t i = 0;i<max_threads;++i) {
+        Worker& worker = *_workerStates[i];
+        if (i < threads) {
+            worker.active.store(true, std::memory_order_relaxed);
+            workers[i] = std::thread([this, i] { startWorker(i); });
+        } else {
+            // slots without a thread count as parked
+            worker.parkStart.store(_startTime, std::memory_order_relaxed);
+        }
+    }
+}
+
+inline std::vector<int32_t> ThreadPool::parseCpuList(const std::string& list) {
+    std::vector<int32_t> cpus;
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        std::string range = list.substr(pos, end - pos);
+        size_t dash = range.find('-');
+        try {
+            int32_t first = std::stoi(range.substr(0, dash));
+            int32_t last = (dash == std::string::npos) ? first : std::stoi(range.substr(dash + 1));
+            for (int32_t cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        } catch (const std::exception&) {
+            // skip malformed range (e.g. trailing newline)
+        }
+        pos = end + 1;
+    }
+    return cpus;
+}
+
+inline std::vector< std::vector<int32_t> > ThreadPool::readNumaNodes() {
+    std::vector< std::vector<int32_t> > nodes;
+#ifdef __linux__
+    const std::string root = "/sys/devices/system/node/";
+    std::string online;
+    std::ifstream online_file(root + "online");
+    if (!std::getline(online_file, online)) {
+        return nodes;
+    }
+    for (int32_t node_id : parseCpuList(online)) {
+        std::string cpulist;
+        std::ifstream cpulist_file(root + "node" + std::to_string(node_id) + "/cpulist");
+        if (std::getline(cpulist_file, cpulist)) {
+            std::vector<int32_t> cpus = parseCpuList(cpulist);
+            if (!cpus.empty()) {
+                nodes.push_back(std::move(cpus));
+            }
+        }
+    }
+#endif
+    return nodes;
+}
+
+inline size_t ThreadPool::getWorkerIndex() const {
+    const WorkerIdentity& identity = currentWorker();
+    return (identity.pool == this) ? identity.index : NO_WORKER;
 }
 
 // add new work item to the pool
 template<class F, class... Args>
 auto ThreadPool::enqueue(F&& f, Args&&... args)
-    -> std::future<typename std::result_of<F(Args...)>::type>
+    -> std::future<std::invoke_result_t<F, Args...>>
 {
-    using return_type = typename std::result_of<F(Args...)>::type;
+    return enqueue(Priority::NORMAL, std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+template<class F, class... Args>
+auto ThreadPool::makePackagedTask(F&& f, Args&&... args)
+    -> std::packaged_task<std::invoke_result_t<F, Args...>()>
+{
+    // the packaged_task keeps the callable in the future's shared state
+    // (one allocation) and is itself small enough to sit inline in the Task
+    return std::packaged_task<std::invoke_result_t<F, Args...>()>(
+        [f = std::forward<F>(f), args = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+            return std::apply(std::move(f), std::move(args));
+        });
+}
+
+template<class F, class... Args>
+auto ThreadPool::enqueue(Priority priority, F&& f, Args&&... args)
+    -> std::future<std::invoke_result_t<F, Args...>>
+{
+    auto task = makePackagedTask(std::forward<F>(f), std::forward<Args>(args)...);
+    auto res = task.get_future();
+    // don't allow enqueueing after stopping the pool
+    if (stop) {
+        throw std::runtime_error("enqueue on stopped ThreadPool");
+    }
+    push(Task(std::move(task)), priority);
+    return res;
+}
+
+template<class F, class... Args>
+auto ThreadPool::enqueueWithDeadline(Clock::time_point deadline, DeadlinePolicy policy, F&& f, Args&&... args)
+    -> std::future<std::invoke_result_t<F, Args...>>
+{
+    auto task = makePackagedTask(std::forward<F>(f), std::forward<Args>(args)...);
+    auto res = task.get_future();
+    if (stop) {
+        throw std::runtime_error("enqueue on stopped ThreadPool");
+    }
+    pushWithDeadline(Task(std::move(task)), deadline, policy);
+    return res;
+}
+
+template<class F>
+void ThreadPool::post(F&& f) {
+    post(Priority::NORMAL, std::forward<F>(f));
+}
+
+template<class F>
+void ThreadPool::post(Priority priority, F&& f) {
+    if (stop) {
+        throw std::runtime_error("post on stopped ThreadPool");
+    }
+    push(Task(std::forward<F>(f)), priority);
+}
 
-    auto task = std::make_shared< std::packaged_task<return_type()> >(
-            std::bind(std::forward<F>(f), std::forward<Args>(args)...)
-        );
+template<class F>
+void ThreadPool::postWithDeadline(Clock::time_point deadline, DeadlinePolicy policy, F&& f) {
+    if (stop) {
+        throw std::runtime_error("post on stopped ThreadPool");
+    }
+    pushWithDeadline(Task(std::forward<F>(f)), deadline, policy);
+}
 
-    std::future<return_type> res = task->get_future();
+template<class F>
+ThreadPool::TimerHandle ThreadPool::enqueueAt(Clock::time_point time, F&& f) {
+    return addTimer(time, Clock::duration::zero(), Task(std::forward<F>(f)));
+}
+
+template<class F>
+ThreadPool::TimerHandle ThreadPool::enqueueAfter(Clock::duration delay, F&& f) {
+    return addTimer(Clock::now() + delay, Clock::duration::zero(), Task(std::forward<F>(f)));
+}
+
+template<class F>
+ThreadPool::TimerHandle ThreadPool::enqueueEvery(Clock::duration period, F&& f) {
+    if (period <= Clock::duration::zero()) {
+        throw std::invalid_argument("enqueueEvery with non-positive period");
+    }
+    return addTimer(Clock::now() + period, period, Task(std::forward<F>(f)));
+}
+
+inline ThreadPool::TimerHandle ThreadPool::addTimer(Clock::time_point due, Clock::duration period, Task&& task) {
+    if (stop) {
+        throw std::runtime_error("enqueue on stopped ThreadPool");
+    }
+    auto state = std::make_shared<TimerState>(std::move(task));
+    {
+        std::lock_guard<std::mutex> lock(_timerMutex);
+        if (_stopTimers) {
+            // else we would start a timer thread nobody joins
+            throw std::runtime_error("enqueue on stopped ThreadPool");
+        }
+        if (!_timerThread.joinable()) {
+            _timerThread = std::thread([this] { runTimers(); });
+        }
+        _timers.push_back({ due, period, state });
+        std::push_heap(_timers.begin(), _timers.end());
+    }
+    // the timer thread only needs to know if the earliest timer changed
+    // but waking it unconditionally is simpler and cheap enough
+    _timerCondition.notify_one();
+    return TimerHandle(state);
+}
+
+inline void ThreadPool::runTimers() {
+    TRACE_THREAD(_name + ":timer");
+    std::unique_lock<std::mutex> lock(_timerMutex);
+    while (!_stopTimers) {
+        if (_timers.empty()) {
+            _timerCondition.wait(lock);
+            continue;
+        }
+        Clock::time_point now = Clock::now();
+        if (_timers.front().due > now) {
+            _timerCondition.wait_until(lock, _timers.front().due);
+            continue;
+        }
+        std::pop_heap(_timers.begin(), _timers.end());
+        Timer timer = std::move(_timers.back());
+        _timers.pop_back();
+
+        std::shared_ptr<TimerState> state = timer.state;
+        if (state->cancelled.load(std::memory_order_relaxed)) {
+            continue;
+        }
+        bool one_shot = (timer.period == Clock::duration::zero());
+        if (!one_shot) {
+            timer.due += timer.period;
+            if (timer.due <= now) {
+                timer.due = now + timer.period;
+            }
+            _timers.push_back(std::move(timer));
+            std::push_heap(_timers.begin(), _timers.end());
+        }
+
+        // skip this run if the last one is still going
+        bool expected = false;
+        if (state->running.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            post([state, one_shot] {
+                if (!state->cancelled.load(std::memory_order_relaxed)) {
+                    state->task();
+                }
+                if (one_shot) {
+                    state->done.store(true, std::memory_order_release);
+                }
+                state->running.store(false, std::memory_order_release);
+            });
+        }
+    }
+}
+
+inline ThreadPool::TaskNode* ThreadPool::acquireNode(Task&& task) {
+    NodeCache& cache = nodeCache();
+    TaskNode* node = cache.head;
+    if (node) {
+        cache.head = node->next;
+        --cache.size;
+    } else {
+        node = new TaskNode(); // yes: naked new
+    }
+    node->task = std::move(task);
+    return node;
+}
+
+inline void ThreadPool::releaseNode(TaskNode* node) {
+    node->task.reset();
+    NodeCache& cache = nodeCache();
+    if (cache.size < MAX_CACHED_NODES) {
+        node->next = cache.head;
+        cache.head = node;
+        ++cache.size;
+    } else {
+        delete node;
+    }
+}
+
+inline void ThreadPool::push(Task&& task, Priority priority) {
+    sampleEnqueueTime(task);
+    size_t index = getWorkerIndex();
+    if (index != NO_WORKER && priority == Priority::NORMAL) {
+        _workerStates[index]->deque.push(acquireNode(std::move(task)));
+        // pairs with the fences in runWorker() before it parks and in
+        // spinForTask() when it stops spinning: either we see the worker
+        // parked (or spinning) or it sees our task
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_numSpinning.load(std::memory_order_relaxed) == 0
+                && _numParked.load(std::memory_order_relaxed) > 0) {
+            wakeOne();
+        }
+    } else {
+        pushShared(priority, std::move(task));
+    }
+    maybeGrow();
+}
+
+// wakes a parked worker unless one is spinning (which will find the work)
+// Note: call this under _queuMutex after adding work
+inline void ThreadPool::notifyLocked() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_numSpinning.load(std::memory_order_relaxed) == 0
+            && _numWakeups < _numParked.load(std::memory_order_relaxed)) {
+        ++_numWakeups;
+        condition.notify_one();
+    }
+}
+
+inline void ThreadPool::pushShared(Priority priority, Task&& task) {
+    uint32_t node = (priority == Priority::NORMAL) ? getCurrentNode() : 0;
+    std::unique_lock<std::mutex> lock(_queuMutex);
+    // the callers' checks of stop are only a fast path: the destructor sets it
+    // under this lock, after which no worker will ever look at the shared lanes
+    if (stop) {
+        throw std::runtime_error("enqueue on stopped ThreadPool");
+    }
+    switch (priority) {
+        case Priority::HIGH:
+            _highTasks.push(std::move(task));
+            _numUrgent.fetch_add(1, std::memory_order_relaxed);
+            break;
+        case Priority::LOW:
+            _lowTasks.push({ std::move(task), Clock::now() });
+            _numLow.fetch_add(1, std::memory_order_relaxed);
+            break;
+        default:
+            tasks[node].push(std::move(task));
+            _numShared.fetch_add(1, std::memory_order_relaxed);
+            break;
+    }
+    notifyLocked();
+}
+
+inline void ThreadPool::pushWithDeadline(Task&& task, Clock::time_point deadline, DeadlinePolicy policy) {
+    sampleEnqueueTime(task);
     {
         std::unique_lock<std::mutex> lock(_queuMutex);
-        // don't allow enqueueing after stopping the pool
         if (stop) {
             throw std::runtime_error("enqueue on stopped ThreadPool");
         }
-        tasks.emplace([task](){ (*task)(); });
+        _deadlineTasks.push_back({ std::move(task), deadline, policy });
+        std::push_heap(_deadlineTasks.begin(), _deadlineTasks.end());
+        _numUrgent.fetch_add(1, std::memory_order_relaxed);
+        notifyLocked();
+    }
+    maybeGrow();
+}
+
+inline void ThreadPool::wakeOne() {
+    std::unique_lock<std::mutex> lock(_queuMutex);
+    // don't hand out more wakeups than there are parked workers
+    if (_numWakeups < _numParked.load(std::memory_order_relaxed)) {
+        ++_numWakeups;
+        condition.notify_one();
+    }
+}
+
+// pops an expired EXPEDITE task, else a HIGH task, else the deadline task
+// with the earliest deadline, and drops expired DROP tasks along the way
+inline bool ThreadPool::popUrgent(Task& task) {
+    Task dropped;
+    std::unique_lock<std::mutex> lock(_queuMutex);
+    while (!_deadlineTasks.empty()) {
+        const DeadlineTask& next = _deadlineTasks.front();
+        bool expired = Clock::now() >= next.deadline;
+        if (expired && next.policy == DeadlinePolicy::DROP) {
+            std::pop_heap(_deadlineTasks.begin(), _deadlineTasks.end());
+            dropped = std::move(_deadlineTasks.back().task);
+            _deadlineTasks.pop_back();
+            _numUrgent.fetch_sub(1, std::memory_order_relaxed);
+            _numDropped.fetch_add(1, std::memory_order_relaxed);
+            // destroy it outside the lock
+            lock.unlock();
+            dropped.reset();
+            lock.lock();
+            continue;
+        }
+        if (expired || _highTasks.empty()) {
+            std::pop_heap(_deadlineTasks.begin(), _deadlineTasks.end());
+            task = std::move(_deadlineTasks.back().task);
+            _deadlineTasks.pop_back();
+            _numUrgent.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+        break;
+    }
+    if (!_highTasks.empty()) {
+        task = _highTasks.pop();
+        _numUrgent.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+// pops a LOW task which has waited too long
+inline bool ThreadPool::popStarving(Task& task) {
+    std::unique_lock<std::mutex> lock(_queuMutex);
+    if (_lowTasks.empty()) {
+        return false;
+    }
+    auto max_wait = std::chrono::microseconds(_lowPriorityMaxWait.load(std::memory_order_relaxed));
+    if (Clock::now() - _lowTasks.front().enqueueTime < max_wait) {
+        return false;
+    }
+    task = _lowTasks.pop().task;
+    _numLow.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+// pops from the LOW queue or the NORMAL queues (starting with node's own)
+inline bool ThreadPool::popShared(Task& task, Priority priority, uint32_t node) {
+    std::unique_lock<std::mutex> lock(_queuMutex);
+    if (priority == Priority::LOW) {
+        if (_lowTasks.empty()) {
+            return false;
+        }
+        task = _lowTasks.pop().task;
+        _numLow.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        TaskRing<Task>& queue = tasks[(node + i) % tasks.size()];
+        if (!queue.empty()) {
+            task = queue.pop();
+            _numShared.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+// tries random victims, skipping index
+inline bool ThreadPool::stealFrom(const std::vector<size_t>& victims, size_t index, Task& task) {
+    Worker& self = *_workerStates[index];
+    size_t num_victims = victims.size();
+    for (size_t attempt = 0; attempt < 2 * num_victims; ++attempt) {
+        // xorshift64
+        self.rng ^= self.rng << 13;
+        self.rng ^= self.rng >> 7;
+        self.rng ^= self.rng << 17;
+        size_t victim = victims[self.rng % num_victims];
+        if (victim != index) {
+            TaskNode* node = _workerStates[victim]->deque.steal();
+            if (node) {
+                task = std::move(node->task);
+                releaseNode(node);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+inline bool ThreadPool::findTask(size_t index, Task& task) {
+    Worker& self = *_workerStates[index];
+
+    // (1) HIGH and deadline tasks
+    if (_numUrgent.load(std::memory_order_relaxed) > 0 && popUrgent(task)) {
+        return true;
+    }
+
+    // (2) LOW tasks which have waited too long
+    if (++self.numSearches % LOW_PRIORITY_CHECK_INTERVAL == 0
+            && _numLow.load(std::memory_order_relaxed) > 0
+            && popStarving(task)) {
+        return true;
+    }
+
+    // (3) own deque
+    TaskNode* node = self.deque.pop();
+    if (node) {
+        task = std::move(node->task);
+        releaseNode(node);
+        return true;
+    }
+
+    // (4) injection queues
+    if (_numShared.load(std::memory_order_relaxed) > 0 && popShared(task, Priority::NORMAL, self.node)) {
+        return true;
+    }
+
+    // (5) steal from random victims: same node first
+    if (_nodeWorkers.size() > 1 && stealFrom(_nodeWorkers[self.node], index, task)) {
+        return true;
+    }
+    if (stealFrom(_allWorkers, index, task)) {
+        return true;
+    }
+
+    // (6) LOW tasks
+    return _numLow.load(std::memory_order_relaxed) > 0 && popShared(task, Priority::LOW, self.node);
+}
+
+inline bool ThreadPool::findExternalTask(Task& task) {
+    if (_numUrgent.load(std::memory_order_relaxed) > 0 && popUrgent(task)) {
+        return true;
+    }
+    if (_numShared.load(std::memory_order_relaxed) > 0 && popShared(task, Priority::NORMAL, getCurrentNode())) {
+        return true;
+    }
+    for (const auto& worker : _workerStates) {
+        TaskNode* node = worker->deque.steal();
+        if (node) {
+            task = std::move(node->task);
+            releaseNode(node);
+            return true;
+        }
+    }
+    return _numLow.load(std::memory_order_relaxed) > 0 && popShared(task, Priority::LOW, 0);
+}
+
+inline bool ThreadPool::tryRunTask() {
+    Task task;
+    size_t index = getWorkerIndex();
+    if (index == NO_WORKER) {
+        if (!findExternalTask(task)) {
+            return false;
+        }
+        task();
+    } else {
+        if (!findTask(index, task)) {
+            return false;
+        }
+        runTask(*_workerStates[index], task);
+    }
+    return true;
+}
+
+// Note: call this under _queuMutex
+inline bool ThreadPool::hasVisibleWork() const {
+    if (!_highTasks.empty() || !_lowTasks.empty() || !_deadlineTasks.empty()) {
+        return true;
+    }
+    for (const auto& queue : tasks) {
+        if (!queue.empty()) {
+            return true;
+        }
+    }
+    for (const auto& worker : _workerStates) {
+        if (!worker->deque.empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// lock-free and approximate version of hasVisibleWork()
+inline bool ThreadPool::hasQueuedWork() const {
+    if (_numUrgent.load(std::memory_order_relaxed) > 0
+            || _numShared.load(std::memory_order_relaxed) > 0
+            || _numLow.load(std::memory_order_relaxed) > 0) {
+        return true;
+    }
+    for (const auto& worker : _workerStates) {
+        if (worker->deque.size() > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// polls for work for up to spinUsec before the worker parks
+inline bool ThreadPool::spinForTask(size_t index, Task& task) {
+    uint32_t spin_usec = _spinUsec.load(std::memory_order_relaxed);
+    if (spin_usec == 0) {
+        return false;
+    }
+    // no more than half the workers spin at once
+    size_t max_spinning = std::max(_numThreads.load(std::memory_order_relaxed) / 2, size_t(1));
+    if (_numSpinning.load(std::memory_order_relaxed) >= max_spinning) {
+        return false;
+    }
+    _numSpinning.fetch_add(1, std::memory_order_relaxed);
+    int64_t deadline = getNowNsec() + (int64_t)spin_usec * 1000;
+    bool found = false;
+    while (!stop.load(std::memory_order_relaxed)) {
+        for (uint32_t i = 0; i < SPIN_PAUSES; ++i) {
+            cpuRelax();
+        }
+        if (findTask(index, task)) {
+            found = true;
+            break;
+        }
+        if (getNowNsec() > deadline) {
+            break;
+        }
+    }
+    _numSpinning.fetch_sub(1, std::memory_order_relaxed);
+    // pairs with the fences in push() and notifyLocked(): a push which saw us
+    // spinning skipped its wakeup, so look once more
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!found) {
+        found = findTask(index, task);
+    }
+    // if we were the last spinner and there is more work then wake a worker
+    // to take our place: pushes made while we spun woke nobody
+    if (found && _numSpinning.load(std::memory_order_relaxed) == 0
+            && _numParked.load(std::memory_order_relaxed) > 0
+            && hasQueuedWork()) {
+        wakeOne();
+    }
+    return found;
+}
+
+// adds a worker when tasks are queueing up and no worker is idle
+inline void ThreadPool::maybeGrow() {
+    if (stop.load(std::memory_order_relaxed)) {
+        return;
+    }
+    size_t num_threads = _numThreads.load(std::memory_order_relaxed);
+    if (num_threads >= _maxThreads.load(std::memory_order_relaxed)
+            || _numParked.load(std::memory_order_relaxed) > 0
+            || _numSpinning.load(std::memory_order_relaxed) > 0) {
+        return;
+    }
+    int64_t now = getNowNsec();
+    int64_t last_grow = _lastGrowTime.load(std::memory_order_relaxed);
+    if (now - last_grow < GROW_INTERVAL_USEC * 1000
+            || !_lastGrowTime.compare_exchange_strong(last_grow, now, std::memory_order_relaxed)) {
+        return;
+    }
+    size_t queue_depth = _numUrgent.load(std::memory_order_relaxed)
+        + _numShared.load(std::memory_order_relaxed)
+        + _numLow.load(std::memory_order_relaxed);
+    for (const auto& worker : _workerStates) {
+        queue_depth += worker->deque.size();
+    }
+    if (queue_depth >= num_threads) {
+        addWorker();
+    }
+}
+
+// starts a thread in an empty slot, returns false if there is none
+inline bool ThreadPool::addWorker() {
+    std::lock_guard<std::mutex> resize_lock(_resizeMutex);
+    if (stop) {
+        return false;
+    }
+    size_t num_threads = _numThreads.load(std::memory_order_relaxed);
+    if (num_threads >= _maxThreads.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    for (size_t i = 0; i < _workerStates.size(); ++i) {
+        Worker& worker = *_workerStates[i];
+        if (worker.active.load(std::memory_order_acquire)) {
+            continue;
+        }
+        // a retired thread may still be on its way out
+        if (workers[i].joinable()) {
+            workers[i].join();
+        }
+        // the slot was 'parked' since it retired
+        int64_t park_start = worker.parkStart.load(std::memory_order_relaxed);
+        if (park_start != 0) {
+            worker.parkedNsec.store(worker.parkedNsec.load(std::memory_order_relaxed)
+                    + (getNowNsec() - park_start), std::memory_order_relaxed);
+            worker.parkStart.store(0, std::memory_order_relaxed);
+        }
+        worker.active.store(true, std::memory_order_relaxed);
+        _numThreads.fetch_add(1, std::memory_order_relaxed);
+        try {
+            workers[i] = std::thread([this, i] { startWorker(i); });
+        } catch (const std::system_error&) {
+            // out of threads: carry on with what we have
+            _numThreads.fetch_sub(1, std::memory_order_relaxed);
+            worker.parkStart.store(getNowNsec(), std::memory_order_relaxed);
+            worker.active.store(false, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+// claims a retirement when there are more than limit workers
+inline bool ThreadPool::tryRetire(size_t limit) {
+    size_t num_threads = _numThreads.load(std::memory_order_relaxed);
+    while (num_threads > limit) {
+        if (_numThreads.compare_exchange_weak(num_threads, num_threads - 1, std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void ThreadPool::setThreadLimits(size_t min_threads, size_t max_threads) {
+    max_threads = std::min(max_threads, _workerStates.size());
+    min_threads = std::min(min_threads, max_threads);
+    if (max_threads > 0) {
+        min_threads = std::max(min_threads, size_t(1));
+    }
+    {
+        std::unique_lock<std::mutex> lock(_queuMutex);
+        _minThreads.store(min_threads, std::memory_order_relaxed);
+        _maxThreads.store(max_threads, std::memory_order_relaxed);
+    }
+    // parked workers re-check the limits
+    condition.notify_all();
+    while (_numThreads.load(std::memory_order_relaxed) < min_threads && addWorker()) {
+    }
+}
+
+inline void ThreadPool::startWorker(size_t index) {
+    std::string name = _name + ":" + std::to_string(index);
+#ifdef __linux__
+    // Linux limits thread names to 15 chars
+    pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+    const std::vector<int32_t>& cpus = _workerStates[index]->cpus;
+    if (!cpus.empty()) {
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        for (int32_t cpu : cpus) {
+            if (cpu >= 0 && cpu < CPU_SETSIZE) {
+                CPU_SET(cpu, &cpu_set);
+            }
+        }
+        // Note: failure (e.g. cpu not in our cgroup) leaves the thread unpinned
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+    }
+#endif
+    TRACE_THREAD(name);
+    runWorker(index);
+}
+
+inline uint32_t ThreadPool::getCurrentNode() const {
+#ifdef __linux__
+    if (tasks.size() > 1) {
+        int32_t cpu = sched_getcpu();
+        if (cpu >= 0 && cpu < (int32_t)_cpuToNode.size()) {
+            return _cpuToNode[cpu];
+        }
+    }
+#endif
+    return 0;
+}
+
+inline void ThreadPool::runTask(Worker& worker, Task& task) {
+    // owner-only counter: a plain load+store is cheaper than fetch_add
+    worker.numTasks.store(worker.numTasks.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    int64_t enqueue_time = task._enqueueTime;
+    if (enqueue_time == 0) {
+        task();
+        task.reset();
+        return;
+    }
+    int64_t start = getNowNsec();
+    task();
+    task.reset();
+    int64_t end = getNowNsec();
+    std::lock_guard<std::mutex> lock(worker.histogramMutex);
+    worker.waitUsec.add((uint64_t)(start - enqueue_time) / 1000);
+    worker.runUsec.add((uint64_t)(end - start) / 1000);
+}
+
+inline ThreadPool::Stats ThreadPool::getStats() const {
+    Stats stats;
+    int64_t now = getNowNsec();
+    stats.uptimeUsec = (uint64_t)(now - _startTime) / 1000;
+    stats.numDropped = _numDropped.load(std::memory_order_relaxed);
+    for (const auto& worker : _workerStates) {
+        stats.numTasks += worker->numTasks.load(std::memory_order_relaxed);
+        stats.queueDepth += worker->deque.size();
+        int64_t parked = worker->parkedNsec.load(std::memory_order_relaxed);
+        int64_t park_start = worker->parkStart.load(std::memory_order_relaxed);
+        if (park_start != 0 && park_start < now) {
+            parked += now - park_start;
+        }
+        int64_t busy = (now - _startTime) - parked;
+        stats.busyUsec.push_back(busy > 0 ? (uint64_t)busy / 1000 : 0);
+        std::lock_guard<std::mutex> lock(worker->histogramMutex);
+        stats.waitUsec.merge(worker->waitUsec);
+        stats.runUsec.merge(worker->runUsec);
+    }
+    // the shared queues: approximate, so don't bother with the lock
+    stats.queueDepth += _numUrgent.load(std::memory_order_relaxed) + _numLow.load(std::memory_order_relaxed);
+    {
+        std::unique_lock<std::mutex> lock(_queuMutex);
+        for (const auto& queue : tasks) {
+            stats.queueDepth += queue.size();
+        }
+    }
+    return stats;
+}
+
+inline float ThreadPool::computeBusyRatio(const Stats& before, const Stats& after) {
+    uint64_t elapsed = 0;
+    uint64_t busy = 0;
+    size_t num_workers = std::min(before.busyUsec.size(), after.busyUsec.size());
+    for (size_t i = 0; i < num_workers; ++i) {
+        elapsed += after.uptimeUsec - before.uptimeUsec;
+        if (after.busyUsec[i] > before.busyUsec[i]) {
+            busy += after.busyUsec[i] - before.busyUsec[i];
+        }
+    }
+    if (elapsed == 0) {
+        return 0.0f;
+    }
+    float ratio = (float)busy / (float)elapsed;
+    return ratio < 1.0f ? ratio : 1.0f;
+}
+
+inline void ThreadPool::sampleCounters() {
+    TraceUtil::Tracer& tracer = TraceUtil::Tracer::instance();
+    if (!tracer.isEnabled()) {
+        return;
+    }
+    Stats stats = getStats();
+    float busy_ratio = 0.0f;
+    {
+        std::lock_guard<std::mutex> lock(_sampleMutex);
+        busy_ratio = computeBusyRatio(_lastSample, stats);
+        _lastSample = stats;
+    }
+    const std::string cat = "ThreadPool";
+    tracer.setCounter(_name + ":queue_depth", cat, (int64_t)stats.queueDepth);
+    tracer.setCounter(_name + ":wait_p50_usec", cat, (int64_t)stats.waitUsec.getPercentile(0.5f));
+    tracer.setCounter(_name + ":wait_p99_usec", cat, (int64_t)stats.waitUsec.getPercentile(0.99f));
+    tracer.setCounter(_name + ":run_p50_usec", cat, (int64_t)stats.runUsec.getPercentile(0.5f));
+    tracer.setCounter(_name + ":run_p99_usec", cat, (int64_t)stats.runUsec.getPercentile(0.99f));
+    tracer.setCounter(_name + ":busy_percent", cat, (int64_t)(100.0f * busy_ratio));
+}
+
+inline void ThreadPool::runWorker(size_t index) {
+    currentWorker() = { this, index };
+    Worker& worker = *_workerStates[index];
+    Task task;
+    for (;;) {
+        if (findTask(index, task) || spinForTask(index, task)) {
+            runTask(worker, task);
+            continue;
+        }
+
+        // nothing found: park until there is work or we are stopping
+        std::unique_lock<std::mutex> lock(_queuMutex);
+        _numParked.fetch_add(1, std::memory_order_relaxed);
+        // pairs with the fence in push()
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (hasVisibleWork()) {
+            _numParked.fetch_sub(1, std::memory_order_relaxed);
+            continue;
+        }
+        if (stop) {
+            _numParked.fetch_sub(1, std::memory_order_relaxed);
+            return;
+        }
+        int64_t park_start = getNowNsec();
+        worker.parkStart.store(park_start, std::memory_order_relaxed);
+        auto idle_deadline = Clock::now() + std::chrono::milliseconds(_idleTimeoutMsec.load(std::memory_order_relaxed));
+        bool retire = false;
+        while (!stop && _numWakeups == 0) {
+            if (tryRetire(_maxThreads.load(std::memory_order_relaxed))) {
+                retire = true;
+                break;
+            }
+            if (_numThreads.load(std::memory_order_relaxed) > _minThreads.load(std::memory_order_relaxed)) {
+                if (condition.wait_until(lock, idle_deadline) == std::cv_status::timeout
+                        && !stop && _numWakeups == 0
+                        && tryRetire(_minThreads.load(std::memory_order_relaxed))) {
+                    retire = true;
+                    break;
+                }
+            } else {
+                condition.wait(lock);
+            }
+        }
+        if (retire) {
+            // leave parkStart set: the empty slot counts as parked
+            // Note: our deque is empty since only we push to it
+            _numParked.fetch_sub(1, std::memory_order_relaxed);
+            worker.active.store(false, std::memory_order_release);
+            return;
+        }
+        if (_numWakeups > 0) {
+            --_numWakeups;
+        }
+        _numParked.fetch_sub(1, std::memory_order_relaxed);
+        worker.parkedNsec.store(worker.parkedNsec.load(std::memory_order_relaxed)
+                + (getNowNsec() - park_start), std::memory_order_relaxed);
+        worker.parkStart.store(0, std::memory_order_relaxed);
     }
-    condition.notify_one();
-    return res;
 }
 
 // the destructor joins all threads
 inline ThreadPool::~ThreadPool() {
+    // stop timers first: they post to the pool
+    {
+        std::lock_guard<std::mutex> lock(_timerMutex);
+        _stopTimers = true;
+    }
+    _timerCondition.notify_one();
+    if (_timerThread.joinable()) {
+        _timerThread.join();
+    }
     {
         std::unique_lock<std::mutex> lock(_queuMutex);
         stop = true;
     }
+    // Note: workers only exit once parked with no visible work, so tasks
+    // already queued (including those in worker deques, which only workers
+    // push to) still run; pushShared() refuses new ones under the lock
     condition.notify_all();
-    for (std::thread &worker: workers) {
-        worker.join();
+    // Note: join outside _resizeMutex: a worker still finishing a task may
+    // be in addWorker(), which takes the lock before it sees stop
+    std::vector< std::thread > threads;
+    {
+        std::lock_guard<std::mutex> resize_lock(_resizeMutex);
+        for (std::thread &worker: workers) {
+            threads.push_back(std::move(worker));
+        }
+    }
+    for (std::thread &worker: threads) {
+        if (worker.joinable()) {
+            worker.join();
+        }
     }
 }
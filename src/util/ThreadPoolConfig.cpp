@@ -0,0 +1,92 @@
+//
+// ThreadPoolConfig.cpp
+//
+// Distributed under the Apache License, Version 2.0.
+// See the accompanying file LICENSE or
+// http://www.apache.org/licenses/LICENSE-2.0.html
+//
+
+#include "ThreadPoolConfig.h"
+
+#include "LogUtil.h"
+
+using json = nlohmann::json;
+
+ThreadPoolConfig::ThreadPoolConfig(const ThreadPool& pool)
+    :   _minThreads(pool.getMinThreads()),
+        _maxThreads(pool.getMaxThreads()),
+        _spinUsec(pool.getSpinUsec()),
+        _idleTimeoutMsec(pool.getIdleTimeout()),
+        _applied(true)
+{
+}
+
+json ThreadPoolConfig::getJson() const {
+    json obj;
+    obj["min_threads"] = getMinThreads();
+    obj["max_threads"] = getMaxThreads();
+    obj["spin_usec"] = getSpinUsec();
+    obj["idle_timeout_msec"] = getIdleTimeout();
+    return obj;
+}
+
+void ThreadPoolConfig::updateJson(const json& obj) {
+    bool something_changed = false;
+    if (obj.contains("min_threads") && obj["min_threads"].is_number_unsigned()) {
+        _minThreads = obj["min_threads"].get<size_t>();
+        something_changed = true;
+    }
+    if (obj.contains("max_threads") && obj["max_threads"].is_number_unsigned()) {
+        _maxThreads = obj["max_threads"].get<size_t>();
+        something_changed = true;
+    }
+    if (obj.contains("spin_usec") && obj["spin_usec"].is_number_unsigned()) {
+        _spinUsec = obj["spin_usec"].get<uint32_t>();
+        something_changed = true;
+    }
+    if (obj.contains("idle_timeout_msec") && obj["idle_timeout_msec"].is_number_unsigned()) {
+        _idleTimeoutMsec = obj["idle_timeout_msec"].get<uint32_t>();
+        something_changed = true;
+    }
+    if (something_changed) {
+        bumpVersion();
+    }
+}
+
+void ThreadPoolConfig::setThreadLimits(size_t min_threads, size_t max_threads) {
+    _minThreads = min_threads;
+    _maxThreads = max_threads;
+    bumpVersion();
+}
+
+void ThreadPoolConfig::setSpinUsec(uint32_t usec) {
+    _spinUsec = usec;
+    bumpVersion();
+}
+
+void ThreadPoolConfig::setIdleTimeout(uint32_t msec) {
+    _idleTimeoutMsec = msec;
+    bumpVersion();
+}
+
+bool ThreadPoolConfig::applyIfChanged(ThreadPool& pool) {
+    uint32_t version = getVersion();
+    if (_applied && version == _appliedVersion) {
+        return false;
+    }
+    _appliedVersion = version;
+    _applied = true;
+    pool.setSpinUsec(getSpinUsec());
+    pool.setIdleTimeout(getIdleTimeout());
+    pool.setThreadLimits(getMinThreads(), getMaxThreads());
+    LOG1("ThreadPool '{}' min_threads={} max_threads={} spin_usec={} idle_timeout_msec={}\n",
+        getName(), pool.getMinThreads(), pool.getMaxThreads(), pool.getSpinUsec(), pool.getIdleTimeout());
+    return true;
+}
+
+ThreadPool::TimerHandle ThreadPoolConfig::watch(ThreadPool& pool, std::chrono::milliseconds period) {
+    return pool.enqueueEvery(period, [this, &pool] {
+        readFileIfChanged();
+        applyIfChanged(pool);
+    });
+}
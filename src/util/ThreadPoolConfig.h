@@ -0,0 +1,68 @@
+//
+// ThreadPoolConfig.h
+//
+// Distributed under the Apache License, Version 2.0.
+// See the accompanying file LICENSE or
+// http://www.apache.org/licenses/LICENSE-2.0.html
+//
+#pragma once
+
+#include <atomic>
+#include <chrono>
+
+#include "ConfigUtil.h"
+#include "ThreadPool.h"
+
+// ThreadPoolConfig holds the adaptive limits of a ThreadPool so they can be
+// changed at runtime, via editing a config file, or by network packet:
+//
+//     {
+//         "min_threads": 2,
+//         "max_threads": 16,
+//         "spin_usec": 50,
+//         "idle_timeout_msec": 10000
+//     }
+//
+// Missing keys keep their current values.  The pool picks up changes when
+// applyIfChanged() is called, or periodically after watch().
+//
+class ThreadPoolConfig : public ConfigUtil::ConfigInterface {
+public:
+    ThreadPoolConfig() { }
+
+    // starts with the pool's current settings
+    explicit ThreadPoolConfig(const ThreadPool& pool);
+
+    // required overrides
+    nlohmann::json getJson() const override;
+    void updateJson(const nlohmann::json& obj) override;
+
+    void setThreadLimits(size_t min_threads, size_t max_threads);
+    void setSpinUsec(uint32_t usec);
+    void setIdleTimeout(uint32_t msec);
+
+    // no lock necessary since these are atomic
+    size_t getMinThreads() const { return _minThreads; }
+    size_t getMaxThreads() const { return _maxThreads; }
+    uint32_t getSpinUsec() const { return _spinUsec; }
+    uint32_t getIdleTimeout() const { return _idleTimeoutMsec; }
+
+    // applies the config to pool if it changed since the last apply
+    // returns true if it did
+    bool applyIfChanged(ThreadPool& pool);
+
+    // calls readFileIfChanged() and applyIfChanged() on a pool timer
+    // Note: cancel the handle before this config is destroyed
+    ThreadPool::TimerHandle watch(ThreadPool& pool, std::chrono::milliseconds period);
+
+private:
+    // Note: ConfigInterface::readFileIfChanged() and writeFile() hold _mutex
+    // while they call updateJson() and getJson(), so the fields are atomic
+    // rather than guarded by _mutex
+    std::atomic<size_t> _minThreads { 1 };
+    std::atomic<size_t> _maxThreads { 1 };
+    std::atomic<uint32_t> _spinUsec { ThreadPool::DEFAULT_SPIN_USEC };
+    std::atomic<uint32_t> _idleTimeoutMsec { ThreadPool::DEFAULT_IDLE_TIMEOUT_MSEC };
+    std::atomic<uint32_t> _appliedVersion { 0 };
+    std::atomic<bool> _applied { false };
+};
@@ -157,6 +157,10 @@ public:
             const std::string& args);
     void setCounter(const std::string& name, const std::string& cat, int64_t count);
 
+    // events are only collected while there are Consumers
+    // so use this to skip expensive prep of event args
+    bool isEnabled() const { return _enabled; }
+
     // type = process_name, process_lables, or thread_name
     void addMetaEvent(const std::string& type, const std::string& arg);
 
@@ -0,0 +1,157 @@
+//
+// test_ConcurrentIndexAllocator.cpp
+//
+//  Distributed under the Apache License, Version 2.0.
+//  See the accompanying file LICENSE or
+//  http://www.apache.org/licenses/LICENSE-2.0.html
+//
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <vector>
+
+#include <fmt/format.h>
+#include <gtest/gtest.h>
+
+#include <util/ConcurrentIndexAllocator.h>
+#include <util/IndexAllocator.h>
+#include <util/ThreadPool.h>
+
+TEST(ConcurrentIndexAllocator_test, single_thread) {
+    using Index_t = int16_t;
+    constexpr Index_t NUM_INDICES = 100;
+    ConcurrentIndexAllocator<Index_t> allocator(NUM_INDICES);
+    for (Index_t i = 0; i < NUM_INDICES; ++i) {
+        EXPECT_EQ(i, allocator.allocate());
+    }
+    EXPECT_EQ(-1, allocator.allocate());
+    EXPECT_EQ(NUM_INDICES, allocator.getNumLive());
+
+    allocator.free(37);
+    allocator.free(200); // out of range: ignored
+    EXPECT_EQ(1, allocator.getNumFree());
+    EXPECT_EQ(37, allocator.allocate());
+    EXPECT_EQ(0, allocator.getNumFree());
+
+    allocator.clear();
+    EXPECT_EQ(0, allocator.getNumLive());
+    EXPECT_EQ(0, allocator.allocate());
+}
+
+TEST(ConcurrentIndexAllocator_test, parallel_churn) {
+    constexpr int32_t NUM_INDICES = 20000;
+    constexpr uint32_t NUM_TASKS = 16;
+    constexpr uint32_t NUM_ROUNDS = 50;
+    constexpr uint32_t NUM_PER_ROUND = 500;
+    ConcurrentIndexAllocator<int32_t> allocator(NUM_INDICES);
+    std::vector<std::atomic<uint8_t>> owned(NUM_INDICES);
+    std::atomic<uint32_t> num_errors { 0 };
+
+    ThreadPool pool(4);
+    std::vector<std::future<void>> futures;
+    for (uint32_t t = 0; t < NUM_TASKS; ++t) {
+        futures.push_back(pool.enqueue([&] {
+            std::vector<int32_t> mine;
+            for (uint32_t round = 0; round < NUM_ROUNDS; ++round) {
+                for (uint32_t i = 0; i < NUM_PER_ROUND; ++i) {
+                    int32_t index = allocator.allocate();
+                    if (index < 0 || owned[index].exchange(1) != 0) {
+                        ++num_errors; // failed, or handed out twice
+                    } else {
+                        mine.push_back(index);
+                    }
+                }
+                for (int32_t index : mine) {
+                    owned[index].store(0);
+                    allocator.free(index);
+                }
+                mine.clear();
+            }
+        }));
+    }
+    for (auto& f : futures) {
+        f.get();
+    }
+    EXPECT_EQ(0, num_errors);
+    EXPECT_EQ(0, allocator.getNumLive());
+    EXPECT_LE(allocator.getNumAllocated(), NUM_TASKS * NUM_PER_ROUND);
+
+    // fill to the max from several threads: free indices cached by other
+    // threads are found, and every index is handed out exactly once
+    std::atomic<int32_t> num_allocated { 0 };
+    futures.clear();
+    for (uint32_t t = 0; t < NUM_TASKS; ++t) {
+        futures.push_back(pool.enqueue([&] {
+            for (;;) {
+                int32_t index = allocator.allocate();
+                if (index < 0) {
+                    break;
+                }
+                if (owned[index].exchange(1) != 0) {
+                    ++num_errors;
+                }
+                ++num_allocated;
+            }
+        }));
+    }
+    for (auto& f : futures) {
+        f.get();
+    }
+    EXPECT_EQ(0, num_errors);
+    EXPECT_EQ(NUM_INDICES, num_allocated);
+    EXPECT_EQ(NUM_INDICES, allocator.getNumLive());
+    EXPECT_EQ(0, allocator.getNumFree());
+}
+
+TEST(ConcurrentIndexAllocator_test, spawn_benchmark) {
+    // bursts of allocate+free from pool workers:
+    // mutex around an IndexAllocator vs the concurrent allocator
+    constexpr int32_t NUM_INDICES = 1000000;
+    constexpr uint32_t NUM_TASKS = 64;
+    constexpr uint32_t NUM_PER_TASK = 10000;
+    ThreadPool pool(std::max(4u, std::thread::hardware_concurrency()));
+
+    auto run = [&pool](auto allocate, auto free) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::future<void>> futures;
+        for (uint32_t t = 0; t < NUM_TASKS; ++t) {
+            futures.push_back(pool.enqueue([&] {
+                std::vector<int32_t> mine;
+                mine.reserve(NUM_PER_TASK);
+                for (uint32_t i = 0; i < NUM_PER_TASK; ++i) {
+                    mine.push_back(allocate());
+                }
+                for (int32_t index : mine) {
+                    free(index);
+                }
+            }));
+        }
+        for (auto& f : futures) {
+            f.get();
+        }
+        auto end = std::chrono::steady_clock::now();
+        return std::chrono::duration<double, std::milli>(end - start).count();
+    };
+
+    std::mutex mutex;
+    IndexAllocator<int32_t> locked(NUM_INDICES);
+    double locked_msec = run(
+        [&] { std::lock_guard<std::mutex> lock(mutex); return locked.allocate(); },
+        [&](int32_t index) { std::lock_guard<std::mutex> lock(mutex); locked.free(index); });
+
+    ConcurrentIndexAllocator<int32_t> concurrent(NUM_INDICES);
+    double concurrent_msec = run(
+        [&] { return concurrent.allocate(); },
+        [&](int32_t index) { concurrent.free(index); });
+    EXPECT_EQ(0, concurrent.getNumLive());
+
+    fmt::print("spawn_benchmark threads={} ops={} mutex={:.1f}msec concurrent={:.1f}msec\n",
+        pool.getNumThreads(), 2 * NUM_TASKS * NUM_PER_TASK, locked_msec, concurrent_msec);
+}
+
+int main(int32_t argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
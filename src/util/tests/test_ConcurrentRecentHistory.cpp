@@ -0,0 +1,160 @@
+//
+// test_ConcurrentRecentHistory.cpp
+//
+//  Distributed under the Apache License, Version 2.0.
+//  See the accompanying file LICENSE or
+//  http://www.apache.org/licenses/LICENSE-2.0.html
+//
+
+#include <atomic>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <util/ConcurrentRecentHistory.h>
+#include <util/ThreadPool.h>
+
+// Events carry their own version and a checksum so torn or out-of-order
+// reads are detectable.
+struct Event {
+    uint64_t version;
+    uint64_t payload[6];
+    uint64_t checksum;
+};
+
+using History = ConcurrentRecentHistory<Event>;
+
+Event makeEvent(uint64_t version) {
+    Event event;
+    event.version = version;
+    event.checksum = version;
+    for (uint64_t i = 0; i < 6; ++i) {
+        event.payload[i] = version * 31 + i;
+        event.checksum ^= event.payload[i];
+    }
+    return event;
+}
+
+// Checker is a Consumer which verifies that it sees every event intact and in order
+class Checker : public History::Consumer {
+public:
+    void consumeEvent(const Event& event) override {
+        uint64_t checksum = event.version;
+        for (uint64_t i = 0; i < 6; ++i) {
+            checksum ^= event.payload[i];
+        }
+        if (checksum != event.checksum || event.version != getVersion() + _numConsumed) {
+            ++_numErrors;
+        }
+        ++_numConsumed;
+    }
+
+    void resetCount() { _numConsumed = 0; }
+
+    uint64_t _numConsumed { 0 };
+    uint64_t _numErrors { 0 };
+};
+
+TEST(ConcurrentRecentHistory_test, single_thread) {
+    History history(5);
+    EXPECT_EQ(8u, history.getCapacity());
+
+    Checker checker;
+    EXPECT_TRUE(history.advanceConsumer(checker));
+    EXPECT_EQ(0u, checker.getVersion());
+
+    for (uint64_t i = 0; i < 6; ++i) {
+        history.push(makeEvent(i));
+    }
+    EXPECT_EQ(6u, history.getVersion());
+    EXPECT_TRUE(history.advanceConsumer(checker));
+    EXPECT_EQ(6u, checker.getVersion());
+    EXPECT_EQ(6u, checker._numConsumed);
+    EXPECT_EQ(0u, checker._numErrors);
+
+    // wants a future version
+    Checker future;
+    future.setVersion(100);
+    EXPECT_FALSE(history.advanceConsumer(future));
+    EXPECT_EQ(100u, future.getVersion());
+
+    // lap the slow consumer
+    Checker slow;
+    for (uint64_t i = 6; i < 20; ++i) {
+        history.push(makeEvent(i));
+    }
+    EXPECT_FALSE(history.advanceConsumer(slow));
+    EXPECT_EQ(0u, slow._numConsumed);
+
+    // but exactly one ring behind is fine
+    checker.resetCount();
+    checker.setVersion(20 - history.getCapacity());
+    EXPECT_TRUE(history.advanceConsumer(checker));
+    EXPECT_EQ(history.getCapacity(), checker._numConsumed);
+    EXPECT_EQ(0u, checker._numErrors);
+
+    // clear
+    history.clearAndSetVersion(1000);
+    Checker late;
+    late.setVersion(990);
+    EXPECT_FALSE(history.advanceConsumer(late));
+    history.push(makeEvent(1000));
+    checker.resetCount();
+    checker.setVersion(1000);
+    EXPECT_TRUE(history.advanceConsumer(checker));
+    EXPECT_EQ(1u, checker._numConsumed);
+    EXPECT_EQ(0u, checker._numErrors);
+}
+
+TEST(ConcurrentRecentHistory_test, parallel_consumers) {
+    // one producer pushes while consumers on pool workers catch up
+    // concurrently: they may fall behind and lose history (in which case
+    // they resync) but must never see a torn or out-of-order event
+    constexpr uint64_t NUM_EVENTS = 200000;
+    constexpr size_t NUM_CONSUMERS = 4;
+    History history(1024);
+    ThreadPool pool(NUM_CONSUMERS);
+    std::atomic<bool> done { false };
+
+    std::vector<std::future<void>> futures;
+    std::vector<Checker> checkers(NUM_CONSUMERS);
+    std::vector<uint64_t> num_resyncs(NUM_CONSUMERS, 0);
+    for (size_t i = 0; i < NUM_CONSUMERS; ++i) {
+        futures.push_back(pool.enqueue([&, i] {
+            Checker& checker = checkers[i];
+            bool finished = false;
+            while (!finished) {
+                finished = done.load(std::memory_order_acquire);
+                checker.resetCount();
+                if (!history.advanceConsumer(checker)) {
+                    ++num_resyncs[i];
+                    checker.setVersion(history.getVersion());
+                }
+                std::this_thread::yield();
+            }
+        }));
+    }
+
+    for (uint64_t i = 0; i < NUM_EVENTS; ++i) {
+        history.push(makeEvent(i));
+        if ((i & 0xff) == 0) {
+            std::this_thread::yield();
+        }
+    }
+    done.store(true, std::memory_order_release);
+    for (auto& f : futures) {
+        f.get();
+    }
+
+    for (size_t i = 0; i < NUM_CONSUMERS; ++i) {
+        EXPECT_EQ(0u, checkers[i]._numErrors);
+        EXPECT_EQ(NUM_EVENTS, checkers[i].getVersion());
+    }
+}
+
+int main(int32_t argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,265 @@
+//
+// test_CoroUtil.cpp
+//
+//  Distributed under the Apache License, Version 2.0.
+//  See the accompanying file LICENSE or
+//  http://www.apache.org/licenses/LICENSE-2.0.html
+//
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fmt/format.h>
+#include <grpcpp/generic/async_generic_service.h>
+#include <grpcpp/generic/generic_stub.h>
+#include <gtest/gtest.h>
+
+#include <util/CoroUtil.h>
+#include <util/GrpcUtil.h>
+
+CoroUtil::Task<int32_t> square(int32_t x) {
+    co_return x * x;
+}
+
+CoroUtil::Task<int32_t> sumOfSquares(int32_t n) {
+    int32_t sum = 0;
+    for (int32_t i = 1; i <= n; ++i) {
+        sum += co_await square(i);
+    }
+    co_return sum;
+}
+
+TEST(CoroUtil_test, task_chain) {
+    EXPECT_EQ(385, CoroUtil::syncWait(sumOfSquares(10)));
+
+    // lazy: nothing runs until awaited
+    bool ran = false;
+    auto lazy = [&ran]() -> CoroUtil::Task<> {
+        ran = true;
+        co_return;
+    };
+    CoroUtil::Task<> task = lazy();
+    EXPECT_FALSE(ran);
+    CoroUtil::syncWait(std::move(task));
+    EXPECT_TRUE(ran);
+}
+
+TEST(CoroUtil_test, resume_on_pool) {
+    ThreadPool pool(2);
+    auto on_worker = [&pool]() -> CoroUtil::Task<size_t> {
+        co_await CoroUtil::resumeOn(pool);
+        co_return pool.getWorkerIndex();
+    };
+    size_t index = CoroUtil::syncWait(on_worker());
+    EXPECT_NE(ThreadPool::NO_WORKER, index);
+    EXPECT_GT(pool.getNumThreads(), index);
+}
+
+TEST(CoroUtil_test, exception_propagates) {
+    ThreadPool pool(2);
+    auto bad = [&pool]() -> CoroUtil::Task<std::string> {
+        co_await CoroUtil::resumeOn(pool);
+        throw std::runtime_error("oops");
+        co_return "unreachable";
+    };
+    auto outer = [&bad]() -> CoroUtil::Task<bool> {
+        try {
+            co_await bad();
+        } catch (const std::runtime_error&) {
+            co_return true;
+        }
+        co_return false;
+    };
+    EXPECT_TRUE(CoroUtil::syncWait(outer()));
+    EXPECT_THROW(CoroUtil::syncWait(bad()), std::runtime_error);
+}
+
+TEST(CoroUtil_test, detach_fan_out) {
+    ThreadPool pool(4);
+    constexpr uint32_t NUM_TASKS = 1000;
+    std::atomic<uint32_t> count { 0 };
+    auto work = [&pool, &count]() -> CoroUtil::Task<> {
+        co_await CoroUtil::resumeOn(pool);
+        int32_t x = co_await square(3);
+        count.fetch_add(x == 9 ? 1 : 0);
+    };
+    for (uint32_t i = 0; i < NUM_TASKS; ++i) {
+        CoroUtil::detach(work());
+    }
+    while (count < NUM_TASKS) {
+        std::this_thread::yield();
+    }
+    EXPECT_EQ(NUM_TASKS, count);
+}
+
+// gRPC helpers: an in-process server which echoes unary requests (or fails
+// them when the method is "/test.Echo/Fail"), using the generic API so no
+// generated code is needed
+grpc::ByteBuffer to_buffer(const std::string& str) {
+    grpc::Slice slice(str);
+    return grpc::ByteBuffer(&slice, 1);
+}
+
+std::string to_string(const grpc::ByteBuffer& buffer) {
+    std::vector<grpc::Slice> slices;
+    std::string str;
+    if (buffer.Dump(&slices).ok()) {
+        for (const grpc::Slice& slice : slices) {
+            str.append((const char*)slice.begin(), slice.size());
+        }
+    }
+    return str;
+}
+
+class EchoReactor : public grpc::ServerGenericBidiReactor {
+public:
+    explicit EchoReactor(bool fail) : _fail(fail) {
+        StartRead(&_request);
+    }
+
+    void OnReadDone(bool ok) override {
+        if (!ok || _fail) {
+            Finish(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "fail"));
+            return;
+        }
+        StartWriteAndFinish(&_request, grpc::WriteOptions(), grpc::Status::OK);
+    }
+
+    void OnDone() override { delete this; } // yes: naked delete
+
+private:
+    grpc::ByteBuffer _request;
+    bool _fail;
+};
+
+class EchoService : public grpc::CallbackGenericService {
+public:
+    grpc::ServerGenericBidiReactor* CreateReactor(grpc::GenericCallbackServerContext* context) override {
+        return new EchoReactor(context->method() == "/test.Echo/Fail"); // yes: naked new
+    }
+};
+
+class EchoServer : public GrpcUtil::CallbackServer {
+public:
+    explicit EchoServer(uint32_t port) {
+        buildService(port);
+        _thread = std::thread([this] { start(); });
+    }
+
+    ~EchoServer() {
+        stop();
+        _thread.join();
+    }
+
+protected:
+    void registerService(grpc::ServerBuilder& builder) override {
+        builder.RegisterCallbackGenericService(&_service);
+    }
+
+private:
+    EchoService _service;
+    std::thread _thread;
+};
+
+class EchoCall : public GrpcUtil::AwaitableCall {
+public:
+    EchoCall(const std::string& method, const std::string& request)
+        : _rpcMethod(method), _request(to_buffer(request)) { }
+
+    void start(grpc::CompletionQueue* queue, void* stub) override {
+        grpc::GenericStub* generic_stub = static_cast<grpc::GenericStub*>(stub);
+        _reader = generic_stub->PrepareUnaryCall(&_context, _rpcMethod, _request, queue);
+        _reader->StartCall();
+        _reader->Finish(&_reply, &_rpcStatus, this);
+    }
+
+    std::string getReply() const { return to_string(_reply); }
+
+private:
+    std::string _rpcMethod;
+    grpc::ByteBuffer _request;
+    grpc::ByteBuffer _reply;
+    std::unique_ptr<grpc::GenericClientAsyncResponseReader> _reader;
+};
+
+class EchoClient : public GrpcUtil::Client {
+public:
+    explicit EchoClient(uint32_t port)
+        : Client(fmt::format("localhost:{}", port)), _stub(getChannel(0))
+    {
+        setStub(&_stub);
+        _thread = std::thread([this] { start(); });
+    }
+
+    ~EchoClient() {
+        stop();
+        _thread.join();
+    }
+
+    std::thread::id getThreadId() const { return _thread.get_id(); }
+
+private:
+    grpc::GenericStub _stub;
+    std::thread _thread;
+};
+
+TEST(CoroUtil_test, async_call_inline) {
+    constexpr uint32_t PORT = 50621;
+    EchoServer server(PORT);
+    EchoClient client(PORT);
+
+    // no pool: the coroutine resumes on the Client thread
+    auto echo = [&client](std::string request) -> CoroUtil::Task<std::string> {
+        auto call = std::make_unique<EchoCall>("/test.Echo/Echo", request);
+        bool ok = co_await GrpcUtil::asyncCall(client, *call);
+        EXPECT_EQ(client.getThreadId(), std::this_thread::get_id());
+        co_return (ok && call->getRpcStatus().ok()) ? call->getReply() : "error";
+    };
+    EXPECT_EQ("hello", CoroUtil::syncWait(echo("hello")));
+
+    // a failed RPC still resumes the coroutine, with its status
+    auto fail = [&client]() -> CoroUtil::Task<grpc::StatusCode> {
+        auto call = std::make_unique<EchoCall>("/test.Echo/Fail", "nope");
+        co_await GrpcUtil::asyncCall(client, *call);
+        co_return call->getRpcStatus().error_code();
+    };
+    EXPECT_EQ(grpc::StatusCode::INVALID_ARGUMENT, CoroUtil::syncWait(fail()));
+}
+
+TEST(CoroUtil_test, async_call_on_pool) {
+    constexpr uint32_t PORT = 50622;
+    constexpr uint32_t NUM_CALLS = 100;
+    EchoServer server(PORT);
+    EchoClient client(PORT);
+    ThreadPool pool(2);
+
+    // many calls in flight at once, each resuming on a pool worker
+    std::atomic<uint32_t> num_ok { 0 };
+    std::atomic<uint32_t> num_done { 0 };
+    auto echo = [&](uint32_t i) -> CoroUtil::Task<> {
+        auto call = std::make_unique<EchoCall>("/test.Echo/Echo", fmt::format("call{}", i));
+        bool ok = co_await GrpcUtil::asyncCall(client, *call, &pool);
+        if (ok && pool.getWorkerIndex() != ThreadPool::NO_WORKER
+                && call->getReply() == fmt::format("call{}", i)) {
+            ++num_ok;
+        }
+        ++num_done;
+    };
+    for (uint32_t i = 0; i < NUM_CALLS; ++i) {
+        CoroUtil::detach(echo(i));
+    }
+    for (uint32_t i = 0; i < 5000 && num_done < NUM_CALLS; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_EQ(NUM_CALLS, num_done);
+    EXPECT_EQ(NUM_CALLS, num_ok);
+}
+
+int main(int32_t argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
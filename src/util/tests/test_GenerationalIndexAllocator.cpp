@@ -0,0 +1,116 @@
+//
+// test_GenerationalIndexAllocator.cpp
+//
+//  Distributed under the Apache License, Version 2.0.
+//  See the accompanying file LICENSE or
+//  http://www.apache.org/licenses/LICENSE-2.0.html
+//
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <util/GenerationalIndexAllocator.h>
+
+TEST(GenerationalIndexAllocator_test, stale_handles_32) {
+    using Allocator = GenerationalIndexAllocator<int32_t>;
+    static_assert(sizeof(Allocator::Handle) == 8);
+    constexpr int32_t NUM_INDICES = 10;
+    Allocator allocator(NUM_INDICES);
+
+    std::vector<Allocator::Handle> handles;
+    for (int32_t i = 0; i < NUM_INDICES; ++i) {
+        Allocator::Handle handle = allocator.allocate();
+        EXPECT_EQ(i, Allocator::getIndex(handle));
+        EXPECT_TRUE(allocator.isValid(handle));
+        EXPECT_EQ(handle, allocator.getHandle(i));
+        handles.push_back(handle);
+    }
+    EXPECT_EQ(Allocator::INVALID_HANDLE, allocator.allocate());
+    EXPECT_FALSE(allocator.isValid(Allocator::INVALID_HANDLE));
+    EXPECT_EQ(NUM_INDICES, allocator.getNumLive());
+
+    // free and reuse an index: the old handle goes stale
+    Allocator::Handle old_handle = handles[3];
+    EXPECT_TRUE(allocator.free(old_handle));
+    EXPECT_FALSE(allocator.isValid(old_handle));
+    EXPECT_EQ(Allocator::INVALID_HANDLE, allocator.getHandle(3));
+    EXPECT_FALSE(allocator.free(old_handle)); // no double-free
+    EXPECT_EQ(1, allocator.getNumFree());
+
+    Allocator::Handle new_handle = allocator.allocate();
+    EXPECT_EQ(3, Allocator::getIndex(new_handle));
+    EXPECT_NE(old_handle, new_handle);
+    EXPECT_TRUE(allocator.isValid(new_handle));
+    EXPECT_FALSE(allocator.isValid(old_handle));
+    EXPECT_FALSE(allocator.free(old_handle));
+    EXPECT_TRUE(allocator.isValid(new_handle));
+
+    // forged handle for a live index with the wrong generation
+    Allocator::Handle forged = Allocator::makeHandle(5, Allocator::getGeneration(handles[5]) + 2);
+    EXPECT_FALSE(allocator.isValid(forged));
+    EXPECT_FALSE(allocator.isValid(Allocator::makeHandle(NUM_INDICES + 1, 1)));
+
+    // clear invalidates everything
+    allocator.clear();
+    EXPECT_EQ(0, allocator.getNumLive());
+    for (Allocator::Handle handle : handles) {
+        EXPECT_FALSE(allocator.isValid(handle));
+    }
+    EXPECT_FALSE(allocator.isValid(new_handle));
+    Allocator::Handle handle = allocator.allocate();
+    EXPECT_EQ(0, Allocator::getIndex(handle));
+    EXPECT_NE(handles[0], handle);
+    EXPECT_TRUE(allocator.isValid(handle));
+}
+
+TEST(GenerationalIndexAllocator_test, stale_handles_16) {
+    using Allocator = GenerationalIndexAllocator<int16_t>;
+    static_assert(sizeof(Allocator::Handle) == 4);
+    Allocator allocator(100);
+
+    Allocator::Handle handle = allocator.allocate();
+    for (uint32_t i = 0; i < 1000; ++i) {
+        Allocator::Handle next = (allocator.free(handle), allocator.allocate());
+        EXPECT_EQ(0, Allocator::getIndex(next));
+        EXPECT_FALSE(allocator.isValid(handle));
+        EXPECT_TRUE(allocator.isValid(next));
+        handle = next;
+    }
+    EXPECT_EQ(1, allocator.getNumLive());
+}
+
+TEST(GenerationalIndexAllocator_test, forged_free_handles) {
+    using Allocator = GenerationalIndexAllocator<int32_t>;
+    Allocator allocator(100);
+
+    Allocator::Handle a = allocator.allocate();
+    Allocator::Handle b = allocator.allocate();
+    EXPECT_TRUE(allocator.free(a));
+    EXPECT_EQ(1, allocator.getNumFree());
+
+    // a handle with the even generation of the free slot is not valid and
+    // freeing it must not free the slot a second time
+    Allocator::Handle forged = Allocator::makeHandle(Allocator::getIndex(a), Allocator::getGeneration(a) + 1);
+    EXPECT_FALSE(allocator.isValid(forged));
+    EXPECT_FALSE(allocator.free(forged));
+    EXPECT_EQ(1, allocator.getNumFree());
+    EXPECT_EQ(1, allocator.getNumLive());
+
+    // never allocated slots have generation zero
+    Allocator::Handle never = Allocator::makeHandle(50, 0);
+    EXPECT_FALSE(allocator.isValid(never));
+    EXPECT_FALSE(allocator.free(never));
+
+    // the slot is reused exactly once
+    Allocator::Handle c = allocator.allocate();
+    EXPECT_EQ(Allocator::getIndex(a), Allocator::getIndex(c));
+    EXPECT_TRUE(allocator.isValid(c));
+    EXPECT_TRUE(allocator.isValid(b));
+    EXPECT_EQ(2, Allocator::getIndex(allocator.allocate()));
+}
+
+int main(int32_t argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
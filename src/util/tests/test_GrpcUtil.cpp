@@ -0,0 +1,1221 @@
+//
+// test_GrpcUtil.cpp
+//
+//  Distributed under the Apache License, Version 2.0.
+//  See the accompanying file LICENSE or
+//  http://www.apache.org/licenses/LICENSE-2.0.html
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fmt/format.h>
+#include <grpcpp/generic/async_generic_service.h>
+#include <grpcpp/generic/generic_stub.h>
+#include <grpcpp/impl/codegen/server_callback_handlers.h>
+#include <grpcpp/impl/rpc_service_method.h>
+#include <grpcpp/support/method_handler.h>
+#include <gtest/gtest.h>
+
+#include <util/GrpcMetrics.h>
+#include <util/GrpcUtil.h>
+#include <util/TraceUtil.h>
+
+// These tests use the generic (untyped) gRPC API with raw ByteBuffers
+// so they don't need any generated code.
+
+// helpers
+grpc::ByteBuffer to_buffer(const std::string& str) {
+    grpc::Slice slice(str);
+    return grpc::ByteBuffer(&slice, 1);
+}
+
+std::string to_string(const grpc::ByteBuffer& buffer) {
+    std::vector<grpc::Slice> slices;
+    std::string str;
+    if (buffer.Dump(&slices).ok()) {
+        for (const grpc::Slice& slice : slices) {
+            str.append((const char*)slice.begin(), slice.size());
+        }
+    }
+    return str;
+}
+
+// EchoReactor echoes every message and hands its Writer to the test
+// so that it can write from other threads
+class EchoReactor : public GrpcUtil::BidiReactor<grpc::ByteBuffer, grpc::ByteBuffer> {
+public:
+    using Writer = GrpcUtil::BidiReactor<grpc::ByteBuffer, grpc::ByteBuffer>::Writer;
+
+    explicit EchoReactor(std::promise<std::shared_ptr<Writer>>* writer_promise)
+        : _writerPromise(writer_promise)
+    {
+        begin();
+    }
+
+protected:
+    void processRequest(const grpc::ByteBuffer& request) override {
+        write(request);
+        if (_writerPromise) {
+            _writerPromise->set_value(getWriter());
+            _writerPromise = nullptr;
+        }
+    }
+
+private:
+    std::promise<std::shared_ptr<Writer>>* _writerPromise;
+};
+
+class EchoService;
+
+// SlowReactor serves one unary request of the form "id/num_slow/delay_msec":
+// the first num_slow arrivals of each id are answered after delay_msec and
+// later ones (i.e. hedges) at once.  The reply is the request followed by
+// "#<arrival index>" so the test can tell which attempt won.
+class SlowReactor : public grpc::ServerGenericBidiReactor {
+public:
+    SlowReactor(EchoService* service, const std::string& peer) : _service(service), _peer(peer) {
+        StartRead(&_request);
+    }
+
+    void OnReadDone(bool ok) override;
+    void OnCancel() override;
+    void OnWriteDone(bool ok) override { }
+    void OnDone() override { delete this; } // yes: naked delete
+
+private:
+    EchoService* _service;
+    std::string _peer;
+    grpc::ByteBuffer _request;
+    grpc::ByteBuffer _reply;
+};
+
+class EchoService : public grpc::CallbackGenericService {
+public:
+    grpc::ServerGenericBidiReactor* CreateReactor(grpc::GenericCallbackServerContext* context) override {
+        // yes: naked new
+        if (context->method() == "/test.Echo/Unary") {
+            return new SlowReactor(this, context->peer());
+        }
+        return new EchoReactor(&writerPromise);
+    }
+
+    // returns arrival index of id and the delay (msec) for it
+    uint32_t arrive(const std::string& request, const std::string& peer, uint64_t& delay) {
+        std::string id = request.substr(0, request.find('/'));
+        uint32_t num_slow = 0;
+        sscanf(request.c_str() + id.size(), "/%u/%lu", &num_slow, &delay);
+        std::lock_guard<std::mutex> lock(_mutex);
+        _peers[id] = peer;
+        uint32_t index = _numArrivals[id]++;
+        if (index >= num_slow) {
+            delay = 0;
+        }
+        return index;
+    }
+
+    uint32_t getNumArrivals(const std::string& id) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _numArrivals[id];
+    }
+
+    // returns the peer (client address) id last arrived from
+    std::string getPeer(const std::string& id) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _peers[id];
+    }
+
+    std::promise<std::shared_ptr<EchoReactor::Writer>> writerPromise;
+    std::atomic<uint32_t> numCancelled { 0 };
+
+private:
+    std::mutex _mutex;
+    std::map<std::string, uint32_t> _numArrivals;
+    std::map<std::string, std::string> _peers;
+};
+
+void SlowReactor::OnReadDone(bool ok) {
+    if (!ok) {
+        Finish(grpc::Status(grpc::StatusCode::CANCELLED, "no request"));
+        return;
+    }
+    std::string request = to_string(_request);
+    uint64_t delay = 0;
+    uint32_t index = _service->arrive(request, _peer, delay);
+    _reply = to_buffer(fmt::format("{}#{}", request, index));
+    if (delay == 0) {
+        StartWriteAndFinish(&_reply, grpc::WriteOptions(), grpc::Status::OK);
+        return;
+    }
+    std::thread([this, delay] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+        StartWriteAndFinish(&_reply, grpc::WriteOptions(), grpc::Status::OK);
+    }).detach();
+}
+
+void SlowReactor::OnCancel() {
+    ++_service->numCancelled;
+}
+
+class EchoServer : public GrpcUtil::CallbackServer {
+public:
+    explicit EchoServer(uint32_t port, GrpcUtil::RpcMetrics* metrics = nullptr) {
+        setMetrics(metrics);
+        buildService(port);
+        _thread = std::thread([this] { start(); });
+    }
+
+    ~EchoServer() {
+        stop();
+        _thread.join();
+    }
+
+    EchoService service;
+
+protected:
+    void registerService(grpc::ServerBuilder& builder) override {
+        builder.RegisterCallbackGenericService(&service);
+    }
+
+private:
+    std::thread _thread;
+};
+
+// BidiClient sends one message, collects the replies and closes its side
+// of the stream on request
+class BidiClient : public grpc::ClientBidiReactor<grpc::ByteBuffer, grpc::ByteBuffer> {
+public:
+    BidiClient(grpc::GenericStub& stub, const std::string& message) : _message(to_buffer(message)) {
+        stub.PrepareBidiStreamingCall(&_context, "/test.Echo/Bidi", grpc::StubOptions(), this);
+        StartWrite(&_message);
+        StartRead(&_reply);
+        StartCall();
+    }
+
+    void OnReadDone(bool ok) override {
+        if (ok) {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _replies.push_back(to_string(_reply));
+            }
+            _condition.notify_all();
+            StartRead(&_reply);
+        }
+    }
+
+    void OnDone(const grpc::Status& status) override {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _done = true;
+        _status = status;
+        _condition.notify_all();
+    }
+
+    std::vector<std::string> waitForReplies(size_t num_replies) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _condition.wait_for(lock, std::chrono::seconds(5), [&] { return _replies.size() >= num_replies; });
+        return _replies;
+    }
+
+    bool waitForDone() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _condition.wait_for(lock, std::chrono::seconds(5), [&] { return _done; });
+        return _done && _status.ok();
+    }
+
+private:
+    grpc::ClientContext _context;
+    grpc::ByteBuffer _message;
+    grpc::ByteBuffer _reply;
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    std::vector<std::string> _replies;
+    grpc::Status _status;
+    bool _done { false };
+};
+
+TEST(GrpcUtil_test, bidi_write_after_stream_ends) {
+    constexpr uint32_t PORT = 50611;
+    EchoServer server(PORT);
+    auto channel = grpc::CreateChannel(fmt::format("localhost:{}", PORT), grpc::InsecureChannelCredentials());
+    grpc::GenericStub stub(channel);
+
+    BidiClient client(stub, "hello");
+    std::future<std::shared_ptr<EchoReactor::Writer>> writer_future = server.service.writerPromise.get_future();
+    ASSERT_EQ(std::future_status::ready, writer_future.wait_for(std::chrono::seconds(5)));
+    std::shared_ptr<EchoReactor::Writer> writer = writer_future.get();
+
+    // write from another thread while the stream is open
+    std::thread([writer] { EXPECT_TRUE(writer->write(to_buffer("world"))); }).join();
+    std::vector<std::string> replies = client.waitForReplies(2);
+    ASSERT_EQ(2, replies.size());
+    EXPECT_EQ("hello", replies[0]);
+    EXPECT_EQ("world", replies[1]);
+
+    // close the stream: the reactor finishes and deletes itself
+    client.StartWritesDone();
+    EXPECT_TRUE(client.waitForDone());
+
+    // writing from another thread afterwards is harmless
+    std::thread([writer] {
+        for (uint32_t i = 0; i < 100 && !writer->isFinished(); ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        EXPECT_TRUE(writer->isFinished());
+        EXPECT_FALSE(writer->write(to_buffer("too late")));
+    }).join();
+    EXPECT_EQ(2, client.waitForReplies(2).size());
+}
+
+// Replies collects what UnaryCalls deliver
+class Replies {
+public:
+    void add(const std::string& reply, grpc::StatusCode code) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _replies.push_back(reply);
+            _codes.push_back(code);
+        }
+        _condition.notify_all();
+    }
+
+    // waits for num_replies then returns all of them
+    std::vector<std::string> wait(size_t num_replies, uint64_t timeout_msec = 5000) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _condition.wait_for(lock, std::chrono::milliseconds(timeout_msec), [&] { return _replies.size() >= num_replies; });
+        return _replies;
+    }
+
+    size_t getNumErrors() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return std::count_if(_codes.begin(), _codes.end(), [](grpc::StatusCode code) { return code != grpc::StatusCode::OK; });
+    }
+
+    std::vector<grpc::StatusCode> getCodes() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _codes;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _replies.clear();
+        _codes.clear();
+    }
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    std::vector<std::string> _replies;
+    std::vector<grpc::StatusCode> _codes;
+};
+
+// UnaryCall is a hedgeable Call to SlowReactor
+class UnaryCall : public GrpcUtil::Call {
+public:
+    UnaryCall(const std::string& request, Replies* replies) : _request(request), _replies(replies) {
+        setMethod("Unary");
+    }
+
+    void start(grpc::CompletionQueue* queue, void* stub) override {
+        grpc::GenericStub* generic_stub = static_cast<grpc::GenericStub*>(stub);
+        _reader = generic_stub->PrepareUnaryCall(&_context, "/test.Echo/Unary", to_buffer(_request), queue);
+        _reader->StartCall();
+        _reader->Finish(&_reply, &_rpcStatus, this);
+    }
+
+    void processReply(bool reply_is_ok) override {
+        _replies->add(to_string(_reply), _rpcStatus.error_code());
+    }
+
+    Call* clone() const override {
+        return new UnaryCall(_request, _replies); // yes: naked new
+    }
+
+private:
+    std::string _request;
+    Replies* _replies;
+    std::unique_ptr<grpc::GenericClientAsyncResponseReader> _reader;
+    grpc::ByteBuffer _reply;
+};
+
+// UnaryClient runs on its own thread
+class UnaryClient : public GrpcUtil::Client {
+public:
+    explicit UnaryClient(uint32_t port, GrpcUtil::RpcMetrics* metrics = nullptr)
+        : Client(fmt::format("localhost:{}", port), 1, ROUND_ROBIN, metrics), _stub(getChannel(0))
+    {
+        setStub(&_stub);
+        _thread = std::thread([this] { start(); });
+    }
+
+    ~UnaryClient() {
+        stopAndJoin();
+    }
+
+    void stopAndJoin() {
+        if (_thread.joinable()) {
+            stop();
+            _thread.join();
+        }
+    }
+
+    // sends hedged Call and returns its delivered replies
+    std::vector<std::string> call(const std::string& request, Replies& replies) {
+        replies.clear();
+        UnaryCall* call = new UnaryCall(request, &replies); // yes: naked new
+        call->setHedged();
+        addCall(call);
+        return replies.wait(1);
+    }
+
+    // connects (Client::warmUp) then fills the latency history with fast
+    // calls so the hedge delay is short
+    void primeLatencies(Replies& replies) {
+        EXPECT_TRUE(warmUp(5000));
+        constexpr size_t NUM_CALLS = 100;
+        for (size_t i = 0; i < NUM_CALLS; ++i) {
+            addCall(new UnaryCall(fmt::format("warm{}/0/0", i), &replies)); // yes: naked new
+        }
+        EXPECT_EQ(NUM_CALLS, replies.wait(NUM_CALLS).size());
+        EXPECT_EQ(0, replies.getNumErrors());
+        EXPECT_GT(computeHedgeDelay("Unary"), 0);
+    }
+
+    Client::MethodStats getStats() {
+        return getMethodStats()["Unary"];
+    }
+
+    // stats are recorded after processReply() so they can trail the Replies
+    Client::MethodStats waitForStats(uint64_t num_calls) {
+        for (uint32_t i = 0; i < 1000 && getStats().numCalls < num_calls; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return getStats();
+    }
+
+private:
+    grpc::GenericStub _stub;
+    std::thread _thread;
+};
+
+uint64_t msec_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+TEST(GrpcUtil_test, hedge_cancels_losers) {
+    constexpr uint32_t PORT = 50612;
+    EchoServer server(PORT);
+    UnaryClient client(PORT);
+    client.setHedgePolicy(0.95f, 1);
+    client.setHedgeBudget(1.0f);
+    Replies replies;
+    client.primeLatencies(replies);
+
+    // the original is slow and the hedge is not: the hedge wins
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<std::string> delivered = client.call("a/1/1000", replies);
+    EXPECT_LT(msec_since(start), 500);
+    ASSERT_EQ(1, delivered.size());
+    EXPECT_EQ("a/1/1000#1", delivered[0]);
+    EXPECT_EQ(0, replies.getNumErrors());
+    EXPECT_EQ(1, client.getStats().numHedges);
+    EXPECT_EQ(1, client.getStats().numHedgeWins);
+    EXPECT_EQ(2, server.service.getNumArrivals("a"));
+
+    // the loser is cancelled on the server and never delivered
+    for (uint32_t i = 0; i < 1000 && server.service.numCancelled == 0; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_EQ(1, server.service.numCancelled);
+    EXPECT_EQ(1, replies.wait(2, 100).size());
+}
+
+TEST(GrpcUtil_test, hedge_first_reply_wins) {
+    constexpr uint32_t PORT = 50613;
+    EchoServer server(PORT);
+    UnaryClient client(PORT);
+    client.setHedgePolicy(0.95f, 1);
+    client.setHedgeBudget(1.0f);
+    Replies replies;
+    client.primeLatencies(replies);
+
+    // both attempts are slow but the original started first: it wins
+    std::vector<std::string> delivered = client.call("b/2/200", replies);
+    ASSERT_EQ(1, delivered.size());
+    EXPECT_EQ("b/2/200#0", delivered[0]);
+    EXPECT_EQ(1, client.getStats().numHedges);
+    EXPECT_EQ(0, client.getStats().numHedgeWins);
+    EXPECT_EQ(2, server.service.getNumArrivals("b"));
+
+    // and the hedge's reply is not delivered
+    EXPECT_EQ(1, replies.wait(2, 400).size());
+}
+
+TEST(GrpcUtil_test, hedge_timer_rearms) {
+    constexpr uint32_t PORT = 50614;
+    EchoServer server(PORT);
+    UnaryClient client(PORT);
+    client.setHedgePolicy(0.95f, 3);
+    client.setHedgeBudget(3.0f); // enough tokens for every hedge
+    Replies replies;
+    client.primeLatencies(replies);
+
+    // the timer must fire twice before a fast attempt gets through
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<std::string> delivered = client.call("c/2/1000", replies);
+    EXPECT_LT(msec_since(start), 500);
+    ASSERT_EQ(1, delivered.size());
+    EXPECT_EQ("c/2/1000#2", delivered[0]);
+    EXPECT_GE(client.getStats().numHedges, 2);
+    EXPECT_LE(client.getStats().numHedges, 3);
+    EXPECT_EQ(1, client.getStats().numHedgeWins);
+    EXPECT_GE(server.service.getNumArrivals("c"), 3);
+}
+
+TEST(GrpcUtil_test, hedge_token_budget) {
+    constexpr uint32_t PORT = 50615;
+    EchoServer server(PORT);
+    UnaryClient client(PORT);
+    client.setHedgePolicy(0.95f, 1);
+    Replies replies;
+    client.primeLatencies(replies);
+
+    // no budget: no hedges
+    client.setHedgeBudget(0.0f);
+    for (uint32_t i = 0; i < 2; ++i) {
+        std::string id = fmt::format("none{}", i);
+        std::vector<std::string> delivered = client.call(id + "/1/50", replies);
+        ASSERT_EQ(1, delivered.size());
+        EXPECT_EQ(id + "/1/50#0", delivered[0]);
+        EXPECT_EQ(1, server.service.getNumArrivals(id));
+    }
+    EXPECT_EQ(0, client.getStats().numHedges);
+
+    // half a token per Call: every other Call is hedged
+    client.setHedgeBudget(0.5f);
+    for (uint32_t i = 0; i < 4; ++i) {
+        std::string id = fmt::format("half{}", i);
+        std::vector<std::string> delivered = client.call(id + "/1/50", replies);
+        ASSERT_EQ(1, delivered.size());
+        uint32_t winner = (i % 2 == 1) ? 1 : 0;
+        EXPECT_EQ(fmt::format("{}/1/50#{}", id, winner), delivered[0]);
+    }
+    EXPECT_EQ(2, client.getStats().numHedges);
+    EXPECT_EQ(2, client.getStats().numHedgeWins);
+}
+
+TEST(GrpcUtil_test, stop_while_hedging) {
+    // stop() races with the hedge timer: it must neither re-arm nor
+    // send hedges on the shut down queue
+    constexpr uint32_t PORT = 50616;
+    EchoServer server(PORT);
+    for (uint32_t i = 0; i < 10; ++i) {
+        UnaryClient client(PORT);
+        client.setHedgePolicy(0.95f, 3);
+        client.setHedgeBudget(3.0f);
+        Replies replies;
+        client.primeLatencies(replies);
+
+        UnaryCall* call = new UnaryCall(fmt::format("d{}/10/50", i), &replies); // yes: naked new
+        call->setHedged();
+        replies.clear();
+        client.addCall(call);
+        std::this_thread::sleep_for(std::chrono::microseconds(500 * i));
+        client.stopAndJoin();
+        EXPECT_TRUE(client.isStopped());
+    }
+}
+
+// The typed services below register "/test.Echo/Unary" by hand with
+// ByteBuffer request and reply, the way generated code registers a raw
+// method, so the same UnaryCall can drive each server flavor.
+const char* const UNARY_METHOD = "/test.Echo/Unary";
+
+// EchoUnaryReactor echoes the request: at once, or from another thread
+// when the request starts with "defer"
+class EchoUnaryReactor : public GrpcUtil::UnaryReactor<grpc::ByteBuffer, grpc::ByteBuffer> {
+public:
+    EchoUnaryReactor(grpc::CallbackServerContext* context, const grpc::ByteBuffer* request, grpc::ByteBuffer* reply)
+        : UnaryReactor(context, request, reply)
+    {
+        std::string str = to_string(*request);
+        if (str.compare(0, 5, "defer") != 0) {
+            *reply = *request;
+            finish();
+            return;
+        }
+        std::thread([this, str] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            *getReply() = to_buffer(str + "#deferred");
+            finish();
+        }).detach();
+    }
+};
+
+class CallbackEchoService : public grpc::Service {
+public:
+    CallbackEchoService() {
+        // yes: naked new
+        AddMethod(new grpc::internal::RpcServiceMethod(UNARY_METHOD, grpc::internal::RpcMethod::NORMAL_RPC, nullptr));
+        MarkMethodCallback(0, new grpc::internal::CallbackUnaryHandler<grpc::ByteBuffer, grpc::ByteBuffer>(
+            [](grpc::CallbackServerContext* context, const grpc::ByteBuffer* request, grpc::ByteBuffer* reply) {
+                return new EchoUnaryReactor(context, request, reply); // yes: naked new
+            }));
+    }
+};
+
+class UnaryEchoServer : public GrpcUtil::CallbackServer {
+public:
+    explicit UnaryEchoServer(uint32_t port) {
+        buildService(port);
+        _thread = std::thread([this] { start(); });
+    }
+
+    ~UnaryEchoServer() {
+        stop();
+        _thread.join();
+    }
+
+protected:
+    void registerService(grpc::ServerBuilder& builder) override {
+        builder.RegisterService(&_service);
+    }
+
+private:
+    CallbackEchoService _service;
+    std::thread _thread;
+};
+
+class AsyncEchoService : public grpc::Service {
+public:
+    AsyncEchoService() {
+        // yes: naked new
+        AddMethod(new grpc::internal::RpcServiceMethod(UNARY_METHOD, grpc::internal::RpcMethod::NORMAL_RPC, nullptr));
+        MarkMethodAsync(0);
+    }
+
+    void requestEcho(grpc::ServerContext* context, grpc::ByteBuffer* request,
+            grpc::ServerAsyncResponseWriter<grpc::ByteBuffer>* responder,
+            grpc::ServerCompletionQueue* queue, void* tag) {
+        RequestAsyncUnary(0, context, request, responder, queue, queue, tag);
+    }
+};
+
+class EchoHandler : public GrpcUtil::Handler {
+public:
+    EchoHandler(AsyncEchoService* service, grpc::ServerCompletionQueue* queue)
+        : _service(service), _queue(queue), _responder(&_context)
+    {
+        proceed();
+    }
+
+protected:
+    void stageService() override {
+        _service->requestEcho(&_context, &_request, &_responder, _queue, this);
+    }
+
+    void respawn() override {
+        new EchoHandler(_service, _queue); // yes: naked new
+    }
+
+    void processRequest() override {
+        _reply = _request;
+    }
+
+    void finish() override {
+        _responder.Finish(_reply, grpc::Status::OK, this);
+    }
+
+private:
+    AsyncEchoService* _service;
+    grpc::ServerCompletionQueue* _queue;
+    grpc::ServerAsyncResponseWriter<grpc::ByteBuffer> _responder;
+    grpc::ByteBuffer _request;
+    grpc::ByteBuffer _reply;
+};
+
+class AsynchEchoServer : public GrpcUtil::AsynchServer {
+public:
+    explicit AsynchEchoServer(uint32_t port) {
+        buildService(port);
+        _thread = std::thread([this] { start(); });
+    }
+
+    ~AsynchEchoServer() {
+        stop();
+        _thread.join();
+    }
+
+protected:
+    void registerService(grpc::ServerBuilder& builder) override {
+        builder.RegisterService(&_service);
+    }
+
+    void spawnHandlers() override {
+        new EchoHandler(&_service, _queue.get()); // yes: naked new
+    }
+
+private:
+    AsyncEchoService _service;
+    std::thread _thread;
+};
+
+// SyncEchoServer is the synchronous flavor, built the way mondo::Service
+// builds itself: it registers itself and blocks in Wait() on its own thread
+class SyncEchoServer : public grpc::Service {
+public:
+    explicit SyncEchoServer(uint32_t port) {
+        // yes: naked new
+        AddMethod(new grpc::internal::RpcServiceMethod(UNARY_METHOD, grpc::internal::RpcMethod::NORMAL_RPC,
+            new grpc::internal::RpcMethodHandler<SyncEchoServer, grpc::ByteBuffer, grpc::ByteBuffer>(
+                [](SyncEchoServer* service, grpc::ServerContext* context, const grpc::ByteBuffer* request, grpc::ByteBuffer* reply) {
+                    *reply = *request;
+                    return grpc::Status::OK;
+                }, this)));
+        grpc::ServerBuilder builder;
+        builder.AddListeningPort(fmt::format("[::]:{}", port), grpc::InsecureServerCredentials());
+        builder.RegisterService(this);
+        _grpcServer = builder.BuildAndStart();
+        _thread = std::thread([this] { _grpcServer->Wait(); });
+    }
+
+    ~SyncEchoServer() {
+        _grpcServer->Shutdown();
+        _thread.join();
+    }
+
+private:
+    std::unique_ptr<grpc::Server> _grpcServer;
+    std::thread _thread;
+};
+
+TEST(GrpcUtil_test, callback_unary_round_trip) {
+    constexpr uint32_t PORT = 50617;
+    UnaryEchoServer server(PORT);
+    UnaryClient client(PORT);
+    EXPECT_TRUE(client.warmUp(5000));
+    Replies replies;
+
+    // replies filled in the reactor's constructor
+    client.addCall(new UnaryCall("hello", &replies)); // yes: naked new
+    std::vector<std::string> delivered = replies.wait(1);
+    ASSERT_EQ(1, delivered.size());
+    EXPECT_EQ("hello", delivered[0]);
+
+    // and from another thread after the reactor returned
+    client.addCall(new UnaryCall("deferred hello", &replies)); // yes: naked new
+    delivered = replies.wait(2);
+    ASSERT_EQ(2, delivered.size());
+    EXPECT_EQ("deferred hello#deferred", delivered[1]);
+    EXPECT_EQ(0, replies.getNumErrors());
+    EXPECT_EQ(2, client.waitForStats(2).numCalls);
+}
+
+// sends num_calls unary calls keeping at most max_in_flight of them
+// outstanding and returns the elapsed time in msec
+double time_unary_calls(uint32_t port, size_t num_calls, size_t max_in_flight) {
+    UnaryClient client(port);
+    EXPECT_TRUE(client.warmUp(5000));
+    Replies replies;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < num_calls; ++i) {
+        if (i >= max_in_flight) {
+            replies.wait(i + 1 - max_in_flight);
+        }
+        client.addCall(new UnaryCall(fmt::format("call{}", i), &replies)); // yes: naked new
+    }
+    EXPECT_EQ(num_calls, replies.wait(num_calls, 30000).size());
+    auto end = std::chrono::steady_clock::now();
+    EXPECT_EQ(0, replies.getNumErrors());
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+TEST(GrpcUtil_test, server_benchmark) {
+    constexpr size_t NUM_CALLS = 2000;
+    constexpr size_t MAX_IN_FLIGHT = 32;
+    constexpr uint32_t SYNC_PORT = 50618;
+    constexpr uint32_t ASYNCH_PORT = 50619;
+    constexpr uint32_t CALLBACK_PORT = 50620;
+
+    double sync_msec = 0.0;
+    {
+        SyncEchoServer server(SYNC_PORT);
+        sync_msec = time_unary_calls(SYNC_PORT, NUM_CALLS, MAX_IN_FLIGHT);
+    }
+    double asynch_msec = 0.0;
+    {
+        AsynchEchoServer server(ASYNCH_PORT);
+        asynch_msec = time_unary_calls(ASYNCH_PORT, NUM_CALLS, MAX_IN_FLIGHT);
+    }
+    double callback_msec = 0.0;
+    {
+        UnaryEchoServer server(CALLBACK_PORT);
+        callback_msec = time_unary_calls(CALLBACK_PORT, NUM_CALLS, MAX_IN_FLIGHT);
+    }
+
+    fmt::print("unary server benchmark calls={} in_flight={} sync={:.2f}msec asynch={:.2f}msec callback={:.2f}msec\n",
+        NUM_CALLS, MAX_IN_FLIGHT, sync_msec, asynch_msec, callback_msec);
+}
+
+TEST(GrpcUtil_test, call_past_deadline_expires) {
+    constexpr uint32_t PORT = 50623;
+    EchoServer server(PORT);
+    UnaryClient client(PORT);
+    EXPECT_TRUE(client.warmUp(5000));
+    Replies replies;
+
+    // the server sits on the request well past the deadline
+    UnaryCall* call = new UnaryCall("e/1/1000", &replies); // yes: naked new
+    call->setTimeout(100);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    client.addCall(call);
+    ASSERT_EQ(1, replies.wait(1).size());
+    EXPECT_LT(msec_since(start), 500);
+    ASSERT_EQ(1, replies.getCodes().size());
+    EXPECT_EQ(grpc::StatusCode::DEADLINE_EXCEEDED, replies.getCodes()[0]);
+    GrpcUtil::Client::MethodStats stats = client.waitForStats(1);
+    EXPECT_EQ(1, stats.numCalls);
+    EXPECT_EQ(1, stats.numExpired);
+}
+
+TEST(GrpcUtil_test, adaptive_timeout_tracks_p99) {
+    constexpr uint32_t PORT = 50624;
+    constexpr uint64_t MIN_TIMEOUT = 10;
+    constexpr uint64_t MAX_TIMEOUT = 2000;
+    constexpr uint64_t DELAY = 20; // msec
+    EchoServer server(PORT);
+    UnaryClient client(PORT);
+    EXPECT_TRUE(client.warmUp(5000));
+    client.setAdaptiveTimeoutLimits(MIN_TIMEOUT, MAX_TIMEOUT);
+    client.setAdaptiveTimeoutFactor(4.0f);
+    Replies replies;
+
+    // one short of MIN_ADAPTIVE_SAMPLES: the timeout stays at max
+    const size_t num_calls = GrpcUtil::Client::MIN_ADAPTIVE_SAMPLES - 1;
+    for (size_t i = 0; i < num_calls; ++i) {
+        UnaryCall* call = new UnaryCall(fmt::format("f{}/1/{}", i, DELAY), &replies); // yes: naked new
+        call->setAdaptiveTimeout();
+        client.addCall(call);
+    }
+    ASSERT_EQ(num_calls, replies.wait(num_calls).size());
+    EXPECT_EQ(0, replies.getNumErrors());
+    EXPECT_EQ(num_calls, client.waitForStats(num_calls).numCalls);
+    EXPECT_EQ(MAX_TIMEOUT, client.getStats().adaptiveTimeout);
+    EXPECT_EQ(MAX_TIMEOUT, client.computeAdaptiveTimeout("Unary"));
+
+    // one more sample and it follows factor * p99
+    UnaryCall* call = new UnaryCall(fmt::format("f{}/1/{}", num_calls, DELAY), &replies); // yes: naked new
+    call->setAdaptiveTimeout();
+    client.addCall(call);
+    ASSERT_EQ(num_calls + 1, replies.wait(num_calls + 1).size());
+    EXPECT_EQ(0, replies.getNumErrors());
+    GrpcUtil::Client::MethodStats stats = client.waitForStats(num_calls + 1);
+    ASSERT_EQ(GrpcUtil::Client::MIN_ADAPTIVE_SAMPLES, stats.latency.getCount());
+    uint64_t p99 = stats.latency.getPercentile(0.99f); // usec
+    EXPECT_GE(p99, DELAY * 1000);
+    uint64_t expected = (uint64_t)(4.0f * (float)p99) / 1000;
+    ASSERT_GT(expected, MIN_TIMEOUT);
+    ASSERT_LT(expected, MAX_TIMEOUT);
+    EXPECT_EQ(expected, client.computeAdaptiveTimeout("Unary"));
+    EXPECT_EQ(expected, client.getStats().adaptiveTimeout);
+
+    client.setAdaptiveTimeoutFactor(2.0f);
+    EXPECT_EQ((uint64_t)(2.0f * (float)p99) / 1000, client.computeAdaptiveTimeout("Unary"));
+
+    // and stays within the clamp
+    client.setAdaptiveTimeoutLimits(MIN_TIMEOUT, DELAY);
+    EXPECT_EQ(DELAY, client.computeAdaptiveTimeout("Unary"));
+    client.setAdaptiveTimeoutLimits(10 * DELAY, MAX_TIMEOUT);
+    EXPECT_EQ(10 * DELAY, client.computeAdaptiveTimeout("Unary"));
+}
+
+// PooledClient has one stub per pooled channel
+class PooledClient : public GrpcUtil::Client {
+public:
+    PooledClient(uint32_t port, size_t num_channels, ChannelPolicy policy)
+        : Client(fmt::format("localhost:{}", port), num_channels, policy)
+    {
+        for (size_t i = 0; i < num_channels; ++i) {
+            _genericStubs.push_back(std::make_unique<grpc::GenericStub>(getChannel(i)));
+            setStub(i, _genericStubs[i].get());
+        }
+        _thread = std::thread([this] { start(); });
+    }
+
+    ~PooledClient() {
+        stop();
+        _thread.join();
+    }
+
+    using Client::pickChannel;
+
+    void* getStub(size_t i) const { return _genericStubs[i].get(); }
+
+private:
+    std::vector<std::unique_ptr<grpc::GenericStub>> _genericStubs;
+    std::thread _thread;
+};
+
+// StubCall remembers which stub the Client started it with
+class StubCall : public UnaryCall {
+public:
+    StubCall(const std::string& request, Replies* replies, std::vector<void*>* stubs)
+        : UnaryCall(request, replies), _stubs(stubs)
+    {
+    }
+
+    void start(grpc::CompletionQueue* queue, void* stub) override {
+        _stubs->push_back(stub);
+        UnaryCall::start(queue, stub);
+    }
+
+private:
+    std::vector<void*>* _stubs;
+};
+
+TEST(GrpcUtil_test, channel_pool_round_robin) {
+    constexpr uint32_t PORT = 50625;
+    constexpr size_t NUM_CHANNELS = 4;
+    EchoServer server(PORT);
+    PooledClient client(PORT, NUM_CHANNELS, GrpcUtil::Client::ROUND_ROBIN);
+    ASSERT_EQ(NUM_CHANNELS, client.getNumChannels());
+    EXPECT_TRUE(client.warmUp(5000));
+
+    // two rounds through the pool
+    Replies replies;
+    std::vector<void*> stubs;
+    for (size_t i = 0; i < 2 * NUM_CHANNELS; ++i) {
+        client.addCall(new StubCall(fmt::format("p{}/0/0", i), &replies, &stubs)); // yes: naked new
+    }
+    ASSERT_EQ(2 * NUM_CHANNELS, replies.wait(2 * NUM_CHANNELS).size());
+    EXPECT_EQ(0, replies.getNumErrors());
+
+    // calls cycle through the channels, each started with its channel's stub
+    ASSERT_EQ(2 * NUM_CHANNELS, stubs.size());
+    for (size_t i = 0; i < stubs.size(); ++i) {
+        EXPECT_EQ(client.getStub(i % NUM_CHANNELS), stubs[i]);
+    }
+
+    // and every channel has its own connection: one peer per channel
+    std::vector<std::string> peers;
+    for (size_t i = 0; i < NUM_CHANNELS; ++i) {
+        std::string peer = server.service.getPeer(fmt::format("p{}", i));
+        EXPECT_FALSE(peer.empty());
+        EXPECT_EQ(peer, server.service.getPeer(fmt::format("p{}", i + NUM_CHANNELS)));
+        peers.push_back(peer);
+    }
+    std::sort(peers.begin(), peers.end());
+    EXPECT_EQ(peers.end(), std::unique(peers.begin(), peers.end()));
+
+    // pickChannel() keeps going round
+    size_t first = client.pickChannel();
+    for (size_t i = 1; i <= 2 * NUM_CHANNELS; ++i) {
+        EXPECT_EQ((first + i) % NUM_CHANNELS, client.pickChannel());
+    }
+}
+
+TEST(GrpcUtil_test, channel_pool_least_loaded) {
+    constexpr uint32_t PORT = 50626;
+    constexpr size_t NUM_CHANNELS = 3;
+    constexpr size_t NUM_SLOW_CALLS = 5;
+    EchoServer server(PORT);
+    PooledClient client(PORT, NUM_CHANNELS, GrpcUtil::Client::LEAST_LOADED);
+    EXPECT_TRUE(client.warmUp(5000));
+
+    // slow calls pile up evenly: every call lands on a least loaded channel
+    Replies replies;
+    std::vector<void*> stubs;
+    for (size_t i = 0; i < NUM_SLOW_CALLS; ++i) {
+        uint32_t min_load = client.getNumCallsInFlight(0);
+        for (size_t j = 1; j < NUM_CHANNELS; ++j) {
+            min_load = std::min(min_load, client.getNumCallsInFlight(j));
+        }
+        client.addCall(new StubCall(fmt::format("q{}/1/500", i), &replies, &stubs)); // yes: naked new
+        ASSERT_EQ(i + 1, stubs.size());
+        size_t channel = NUM_CHANNELS;
+        for (size_t j = 0; j < NUM_CHANNELS; ++j) {
+            if (client.getStub(j) == stubs.back()) {
+                channel = j;
+            }
+        }
+        ASSERT_LT(channel, NUM_CHANNELS);
+        EXPECT_EQ(min_load + 1, client.getNumCallsInFlight(channel));
+    }
+
+    // the loads are now 2, 2 and 1: pickChannel() finds the 1 whatever
+    // channel its scan starts from
+    size_t least_loaded = 0;
+    for (size_t j = 1; j < NUM_CHANNELS; ++j) {
+        if (client.getNumCallsInFlight(j) < client.getNumCallsInFlight(least_loaded)) {
+            least_loaded = j;
+        }
+    }
+    EXPECT_EQ(1, client.getNumCallsInFlight(least_loaded));
+    for (size_t i = 0; i < NUM_CHANNELS; ++i) {
+        EXPECT_EQ(least_loaded, client.pickChannel());
+    }
+
+    // and drain once the replies are in
+    ASSERT_EQ(NUM_SLOW_CALLS, replies.wait(NUM_SLOW_CALLS).size());
+    EXPECT_EQ(0, replies.getNumErrors());
+    // Note: the counts drop just after processReply()
+    auto total_load = [&client] {
+        uint32_t load = 0;
+        for (size_t j = 0; j < NUM_CHANNELS; ++j) {
+            load += client.getNumCallsInFlight(j);
+        }
+        return load;
+    };
+    for (uint32_t i = 0; i < 1000 && total_load() > 0; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    for (size_t j = 0; j < NUM_CHANNELS; ++j) {
+        EXPECT_EQ(0, client.getNumCallsInFlight(j));
+    }
+}
+
+// TraceEvents collects the trace events as JSON strings
+class TraceEvents : public TraceUtil::Tracer::Consumer {
+public:
+    TraceEvents() : Consumer(10 * TimeUtil::MSEC_PER_SECOND) { }
+
+    void consumeEvents(const std::vector<std::string>& events) override {
+        _events.insert(_events.end(), events.begin(), events.end());
+    }
+
+    size_t count(const std::string& name, const std::string& cat) const {
+        std::string pattern = fmt::format("\"name\":\"{}\",\"cat\":\"{}\"", name, cat);
+        return std::count_if(_events.begin(), _events.end(),
+            [&pattern](const std::string& event) { return event.find(pattern) != std::string::npos; });
+    }
+
+private:
+    std::vector<std::string> _events;
+};
+
+TEST(GrpcUtil_test, rpc_metrics) {
+    constexpr uint32_t PORT = 50627;
+    constexpr uint64_t DELAY = 20; // msec
+    const std::string method = "/test.Echo/Unary";
+
+    // both ends of a generic call see ByteBuffers: the method must be raw
+    GrpcUtil::RpcMetrics client_metrics("rpc_client");
+    GrpcUtil::RpcMetrics server_metrics("rpc_server");
+    client_metrics.addRawMethod(method);
+    server_metrics.addRawMethod(method);
+    EXPECT_TRUE(client_metrics.isRawMethod(method));
+    EXPECT_FALSE(client_metrics.isRawMethod("/test.Echo/Bidi"));
+
+    TraceUtil::Tracer& tracer = TraceUtil::Tracer::instance();
+    TraceEvents events;
+    tracer.addConsumer(&events);
+    EXPECT_TRUE(tracer.isEnabled());
+
+    EchoServer server(PORT, &server_metrics);
+    UnaryClient client(PORT, &client_metrics);
+    EXPECT_TRUE(client.warmUp(5000));
+
+    // two fast calls and a slow one
+    std::vector<std::string> requests = { "m0/0/0", "m1/0/0", fmt::format("m2/1/{}", DELAY) };
+    Replies replies;
+    uint64_t request_bytes = 0;
+    uint64_t reply_bytes = 0;
+    for (const std::string& request : requests) {
+        client.addCall(new UnaryCall(request, &replies)); // yes: naked new
+        request_bytes += request.size();
+        reply_bytes += request.size() + 2; // "#0"
+    }
+    ASSERT_EQ(requests.size(), replies.wait(requests.size()).size());
+    EXPECT_EQ(0, replies.getNumErrors());
+
+    GrpcUtil::RpcMetrics::MethodMetrics client_stats = client_metrics.getMethodMetrics()[method];
+    EXPECT_EQ(requests.size(), client_stats.numCalls);
+    EXPECT_EQ(0, client_stats.numErrors);
+    EXPECT_EQ(request_bytes, client_stats.bytesOut);
+    EXPECT_EQ(reply_bytes, client_stats.bytesIn);
+    EXPECT_EQ(requests.size(), client_stats.latency.getCount());
+    EXPECT_GE(client_stats.latency.getPercentile(1.0f), DELAY * 1000);
+
+    // the server sends its status before the client sees it
+    GrpcUtil::RpcMetrics::MethodMetrics server_stats = server_metrics.getMethodMetrics()[method];
+    EXPECT_EQ(requests.size(), server_stats.numCalls);
+    EXPECT_EQ(0, server_stats.numErrors);
+    EXPECT_EQ(request_bytes, server_stats.bytesIn);
+    EXPECT_EQ(reply_bytes, server_stats.bytesOut);
+    EXPECT_EQ(requests.size(), server_stats.latency.getCount());
+    EXPECT_GE(server_stats.latency.getPercentile(1.0f), DELAY * 1000);
+    EXPECT_EQ(requests.size(), server_stats.recvMessage.getCount());
+    EXPECT_LT(server_stats.recvMessage.getPercentile(1.0f), DELAY * 1000);
+
+    // and every sample went out as a trace counter
+    tracer.advanceConsumers();
+    tracer.removeConsumer(&events);
+    EXPECT_FALSE(tracer.isEnabled());
+    for (const char* stat : { "latency_usec", "bytes_in", "bytes_out", "recv_message_usec" }) {
+        std::string name = fmt::format("{}:{}", method, stat);
+        EXPECT_EQ(requests.size(), events.count(name, "rpc_client")) << name;
+        EXPECT_EQ(requests.size(), events.count(name, "rpc_server")) << name;
+    }
+
+    client_metrics.clear();
+    EXPECT_TRUE(client_metrics.getMethodMetrics().empty());
+}
+
+// WatchedClient is a channel pool whose connectivity callback
+// collects every state change (set it up BEFORE run())
+class WatchedClient : public GrpcUtil::Client {
+public:
+    WatchedClient(uint32_t port, size_t num_channels)
+        : Client(fmt::format("localhost:{}", port), num_channels)
+    {
+        setConnectivityCallback([this](size_t channel_index, grpc_connectivity_state state) {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _states.push_back({ channel_index, state });
+            }
+            _condition.notify_all();
+        });
+    }
+
+    ~WatchedClient() {
+        stopAndJoin();
+    }
+
+    void run() {
+        _thread = std::thread([this] { start(); });
+    }
+
+    void stopAndJoin() {
+        if (_thread.joinable()) {
+            stop();
+            _thread.join();
+        }
+    }
+
+    // waits until every channel has reported a state that satisfies predicate
+    bool waitForStates(std::function<bool(grpc_connectivity_state)> predicate, uint64_t timeout_msec) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _condition.wait_for(lock, std::chrono::milliseconds(timeout_msec), [&] {
+            for (size_t i = 0; i < getNumChannels(); ++i) {
+                bool found = false;
+                for (size_t j = _mark; j < _states.size() && !found; ++j) {
+                    found = _states[j].first == i && predicate(_states[j].second);
+                }
+                if (!found) {
+                    return false;
+                }
+            }
+            return true;
+        });
+    }
+
+    // later waitForStates() only look at changes after this
+    void mark() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _mark = _states.size();
+    }
+
+    size_t getNumStates() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _states.size();
+    }
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    std::vector<std::pair<size_t, grpc_connectivity_state>> _states;
+    size_t _mark { 0 };
+    std::thread _thread;
+};
+
+TEST(GrpcUtil_test, warm_up_pooled_channels) {
+    constexpr uint32_t PORT = 50628;
+    constexpr uint32_t UNUSED_PORT = 50629;
+    constexpr size_t NUM_CHANNELS = 3;
+    EchoServer server(PORT);
+    PooledClient client(PORT, NUM_CHANNELS, GrpcUtil::Client::ROUND_ROBIN);
+
+    // fresh channels are idle until something connects them
+    EXPECT_FALSE(client.isReady());
+    EXPECT_TRUE(client.warmUp(5000));
+    EXPECT_TRUE(client.isReady());
+    for (size_t i = 0; i < NUM_CHANNELS; ++i) {
+        EXPECT_EQ(GRPC_CHANNEL_READY, client.getChannel(i)->GetState(false));
+    }
+
+    // nobody listening: warmUp() gives up at the timeout
+    PooledClient lonely_client(UNUSED_PORT, NUM_CHANNELS, GrpcUtil::Client::ROUND_ROBIN);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    EXPECT_FALSE(lonely_client.warmUp(200));
+    EXPECT_LT(msec_since(start), 1000);
+    EXPECT_FALSE(lonely_client.isReady());
+}
+
+TEST(GrpcUtil_test, connectivity_callback) {
+    constexpr uint32_t PORT = 50630;
+    constexpr size_t NUM_CHANNELS = 2;
+    auto server = std::make_unique<EchoServer>(PORT);
+    WatchedClient client(PORT, NUM_CHANNELS);
+    client.setKeepWarm(true);
+    client.run();
+
+    // keep-warm connects every channel and the callback sees it
+    auto is_ready = [](grpc_connectivity_state state) { return state == GRPC_CHANNEL_READY; };
+    EXPECT_TRUE(client.waitForStates(is_ready, 5000));
+    EXPECT_TRUE(client.isReady());
+
+    // the server goes away: every channel drops
+    client.mark();
+    server.reset();
+    auto is_not_ready = [](grpc_connectivity_state state) { return state != GRPC_CHANNEL_READY; };
+    EXPECT_TRUE(client.waitForStates(is_not_ready, 5000));
+    EXPECT_FALSE(client.isReady());
+
+    // and comes back: keep-warm reconnects without any Calls
+    client.mark();
+    server = std::make_unique<EchoServer>(PORT);
+    EXPECT_TRUE(client.waitForStates(is_ready, 10000));
+
+    // stop() waits out the pending watches (at most one period)
+    // without re-arming them
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    client.stopAndJoin();
+    EXPECT_LT(msec_since(start), 2 * GrpcUtil::Client::CHANNEL_WATCH_PERIOD);
+    EXPECT_TRUE(client.isStopped());
+    size_t num_states = client.getNumStates();
+    server.reset();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_EQ(num_states, client.getNumStates());
+}
+
+TEST(GrpcUtil_test, stop_while_watching) {
+    // stop() races with watchers that keep re-arming while keep-warm
+    // retries a server that isn't there
+    constexpr uint32_t UNUSED_PORT = 50631;
+    for (uint32_t i = 0; i < 5; ++i) {
+        WatchedClient client(UNUSED_PORT, 2);
+        client.setKeepWarm(true);
+        client.run();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10 * i));
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        client.stopAndJoin();
+        EXPECT_LT(msec_since(start), 2 * GrpcUtil::Client::CHANNEL_WATCH_PERIOD);
+        EXPECT_TRUE(client.isStopped());
+        EXPECT_FALSE(client.isReady());
+    }
+}
+
+int main(int32_t argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -6,9 +6,14 @@
 //  http://www.apache.org/licenses/LICENSE-2.0.html
 //
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
 #include <random>
+#include <set>
 #include <vector>
 
+#include <fmt/format.h>
 #include <gtest/gtest.h>
 
 #include <util/IndexAllocator.h>
@@ -151,6 +156,371 @@ TEST(IndexAllocator_test, allocate_free_clear_16) {
     EXPECT_EQ(0, allocator.getNumAllocated());
 }
 
+TEST(IndexAllocator_test, lowest_free_first) {
+    using Index_t = int32_t;
+    constexpr Index_t NUM_INDICES = 100000;
+    IndexAllocator<Index_t> allocator(NUM_INDICES);
+    std::set<Index_t> live;
+    std::set<Index_t> free;
+    std::mt19937 generator(123);
+
+    // random churn against a reference
+    for (uint32_t i = 0; i < 200000; ++i) {
+        if (live.empty() || generator() % 3 != 0) {
+            Index_t index = allocator.allocate();
+            if (free.empty()) {
+                EXPECT_EQ((Index_t)live.size(), index);
+            } else {
+                EXPECT_EQ(*free.begin(), index);
+                free.erase(free.begin());
+            }
+            live.insert(index);
+        } else {
+            auto itr = live.lower_bound((Index_t)(generator() % NUM_INDICES));
+            if (itr == live.end()) {
+                itr = live.begin();
+            }
+            allocator.free(*itr);
+            free.insert(*itr);
+            live.erase(itr);
+        }
+        ASSERT_EQ((Index_t)free.size(), allocator.getNumFree());
+        ASSERT_EQ((Index_t)live.size(), allocator.getNumLive());
+    }
+
+    // double-free is ignored
+    Index_t index = *live.begin();
+    allocator.free(index);
+    allocator.free(index);
+    EXPECT_EQ((Index_t)free.size() + 1, allocator.getNumFree());
+    EXPECT_EQ(std::min(index, free.empty() ? index : *free.begin()), allocator.allocate());
+
+    // preallocated indices are live
+    IndexAllocator<Index_t> preallocated(10, 4);
+    EXPECT_EQ(4, preallocated.getNumLive());
+    preallocated.free(2);
+    EXPECT_EQ(2, preallocated.allocate());
+    EXPECT_EQ(4, preallocated.allocate());
+}
+
+TEST(IndexAllocator_test, bulk_and_compact) {
+    using Index_t = int32_t;
+    constexpr Index_t NUM_INDICES = 1000;
+    IndexAllocator<Index_t> allocator(NUM_INDICES);
+
+    std::vector<Index_t> indices;
+    EXPECT_EQ(600, allocator.allocateN(600, indices));
+    ASSERT_EQ(600, indices.size());
+    for (Index_t i = 0; i < 600; ++i) {
+        EXPECT_EQ(i, indices[i]);
+    }
+
+    // despawn every third one, plus a run spanning several words
+    std::vector<Index_t> dead;
+    for (Index_t i = 0; i < 600; ++i) {
+        if (i % 3 == 0 || (i >= 100 && i < 300)) {
+            dead.push_back(i);
+        }
+    }
+    allocator.freeN(dead);
+    EXPECT_EQ((Index_t)dead.size(), allocator.getNumFree());
+
+    // bulk allocate recycles lowest first, then bumps
+    std::vector<Index_t> recycled;
+    EXPECT_EQ(10, allocator.allocateN(10, recycled));
+    EXPECT_EQ(std::vector<Index_t>(dead.begin(), dead.begin() + 10), recycled);
+    EXPECT_EQ((Index_t)dead.size() - 10, allocator.getNumFree());
+    allocator.freeN(recycled);
+
+    std::vector<Index_t> more;
+    Index_t num_free = allocator.getNumFree();
+    EXPECT_EQ(num_free + 50, allocator.allocateN(num_free + 50, more));
+    EXPECT_EQ(dead, std::vector<Index_t>(more.begin(), more.begin() + num_free));
+    EXPECT_EQ(600, more[num_free]);
+    EXPECT_EQ(0, allocator.getNumFree());
+    EXPECT_EQ(650, allocator.getNumLive());
+
+    // can't exceed the max
+    std::vector<Index_t> rest;
+    EXPECT_EQ(NUM_INDICES - 650, allocator.allocateN(1000, rest));
+    EXPECT_EQ(IndexAllocator<Index_t>::INVALID_INDEX, allocator.allocate());
+    allocator.freeN(rest);
+    allocator.freeN(dead);
+
+    // compact: live indices renumbered in order
+    std::vector<Index_t> data(allocator.getNumAllocated());
+    for (Index_t i = 0; i < (Index_t)data.size(); ++i) {
+        data[i] = 10 * i;
+    }
+    Index_t num_live = allocator.getNumLive();
+    std::vector<Index_t> remap = allocator.compact();
+    ASSERT_EQ(data.size(), remap.size());
+    EXPECT_EQ(num_live, allocator.getNumLive());
+    EXPECT_EQ(num_live, allocator.getNumAllocated());
+    EXPECT_EQ(0, allocator.getNumFree());
+    for (size_t i = 0; i < remap.size(); ++i) {
+        if (remap[i] != IndexAllocator<Index_t>::INVALID_INDEX) {
+            data[remap[i]] = data[i];
+        }
+    }
+    data.resize(num_live);
+    Index_t expected = 0;
+    for (Index_t i = 0; i < 650; ++i) {
+        bool was_freed = (i < 600) && (i % 3 == 0 || (i >= 100 && i < 300));
+        if (!was_freed) {
+            EXPECT_EQ(10 * i, data[expected]);
+            EXPECT_EQ(expected, remap[i]);
+            ++expected;
+        } else {
+            EXPECT_EQ(IndexAllocator<Index_t>::INVALID_INDEX, remap[i]);
+        }
+    }
+    EXPECT_EQ(num_live, expected);
+    EXPECT_EQ(num_live, allocator.allocate());
+}
+
+TEST(IndexAllocator_test, unsigned_and_64_bit) {
+    {
+        using Index_t = uint32_t;
+        IndexAllocator<Index_t> allocator(3);
+        EXPECT_EQ(UINT32_MAX, IndexAllocator<Index_t>::INVALID_INDEX);
+        EXPECT_EQ(0u, allocator.allocate());
+        EXPECT_EQ(1u, allocator.allocate());
+        EXPECT_EQ(2u, allocator.allocate());
+        EXPECT_EQ(UINT32_MAX, allocator.allocate());
+        allocator.free(1);
+        EXPECT_EQ(1u, allocator.allocate());
+    }
+    {
+        using Index_t = uint64_t;
+        // preallocate past 2^32 to check that nothing is truncated
+        constexpr Index_t BASE = (Index_t(1) << 32) + 7;
+        IndexAllocator<Index_t> allocator(UINT64_MAX, BASE + 2);
+        EXPECT_EQ(UINT64_MAX, IndexAllocator<Index_t>::INVALID_INDEX);
+        EXPECT_EQ(BASE + 2, allocator.allocate());
+        allocator.free(BASE);
+        EXPECT_EQ(1u, allocator.getNumFree());
+        EXPECT_EQ(BASE, allocator.allocate());
+    }
+    {
+        // custom sentinel: max_num_elements is clamped to it
+        using Allocator = IndexAllocator<uint16_t, 1000>;
+        Allocator allocator(5000); // clamped to 1000
+        std::vector<uint16_t> indices;
+        EXPECT_EQ(1000, allocator.allocateN(2000, indices));
+        EXPECT_EQ(999, indices.back());
+        EXPECT_EQ(1000, allocator.allocate());
+        EXPECT_EQ(Allocator::INVALID_INDEX, allocator.allocate());
+    }
+}
+
+TEST(IndexAllocator_test, serialize) {
+    using Index_t = int32_t;
+    IndexAllocator<Index_t> allocator(100000);
+    std::vector<Index_t> indices;
+    allocator.allocateN(70000, indices);
+    std::mt19937 generator(42);
+    for (uint32_t i = 0; i < 20000; ++i) {
+        allocator.free(indices[generator() % indices.size()]);
+    }
+
+    std::vector<uint8_t> buffer;
+    allocator.serialize(buffer);
+    EXPECT_EQ(allocator.getSerializedSize(), buffer.size());
+    // about one bit per index
+    EXPECT_GT(70000 / 8 + 100, buffer.size());
+
+    IndexAllocator<Index_t> restored(10);
+    EXPECT_TRUE(restored.deserialize(buffer));
+    EXPECT_EQ(allocator.getNumLive(), restored.getNumLive());
+    EXPECT_EQ(allocator.getNumFree(), restored.getNumFree());
+    EXPECT_EQ(allocator.getNumAllocated(), restored.getNumAllocated());
+    for (uint32_t i = 0; i < 40000; ++i) {
+        ASSERT_EQ(allocator.allocate(), restored.allocate());
+    }
+
+    // rejects garbage, truncation and mismatched types
+    IndexAllocator<Index_t> empty(10);
+    EXPECT_FALSE(empty.deserialize(buffer.data(), 10));
+    EXPECT_FALSE(empty.deserialize(buffer.data(), buffer.size() - 1));
+    std::vector<uint8_t> garbage(buffer.size(), 0xab);
+    EXPECT_FALSE(empty.deserialize(garbage));
+    IndexAllocator<int16_t> other_type(10);
+    EXPECT_FALSE(other_type.deserialize(buffer));
+    EXPECT_EQ(0, empty.getNumAllocated());
+
+    // empty allocator round trip
+    std::vector<uint8_t> empty_buffer;
+    empty.serialize(empty_buffer);
+    EXPECT_TRUE(restored.deserialize(empty_buffer));
+    EXPECT_EQ(0, restored.getNumAllocated());
+    EXPECT_EQ(0, restored.allocate());
+}
+
+TEST(IndexAllocator_test, deserialize_corrupt_payload) {
+    using Index_t = int32_t;
+    IndexAllocator<Index_t> allocator(100000);
+    std::vector<Index_t> indices;
+    allocator.allocateN(70000, indices); // 70000 % 64 != 0: last leaf word is partial
+    for (Index_t i = 0; i < 70000; i += 3) {
+        allocator.free(i);
+    }
+    std::vector<uint8_t> buffer;
+    allocator.serialize(buffer);
+    size_t header_size = buffer.size() - ((70000 + 63) / 64) * sizeof(uint64_t);
+
+    auto word_at = [&](std::vector<uint8_t>& bytes, size_t i) {
+        return reinterpret_cast<uint64_t*>(bytes.data() + header_size) + i;
+    };
+    auto rejects = [&](const std::vector<uint8_t>& bytes) {
+        IndexAllocator<Index_t> restored(10);
+        Index_t first = restored.allocate();
+        bool accepted = restored.deserialize(bytes);
+        // a rejected payload leaves the allocator untouched
+        return !accepted && restored.getNumAllocated() == first + 1;
+    };
+    EXPECT_FALSE(rejects(buffer));
+
+    // free bit cleared: fewer free bits than numFree
+    std::vector<uint8_t> corrupt = buffer;
+    *word_at(corrupt, 0) &= ~uint64_t(1);
+    EXPECT_TRUE(rejects(corrupt));
+
+    // extra free bit: more free bits than numFree
+    corrupt = buffer;
+    *word_at(corrupt, 0) |= uint64_t(2);
+    EXPECT_TRUE(rejects(corrupt));
+
+    // same popcount but one bit moved beyond nextNewIndex
+    corrupt = buffer;
+    *word_at(corrupt, 0) &= ~uint64_t(1);
+    *word_at(corrupt, 70000 / 64) |= uint64_t(1) << 63;
+    EXPECT_TRUE(rejects(corrupt));
+
+    // header fields at their serialized offsets
+    auto field_at = [&](std::vector<uint8_t>& bytes, size_t offset) {
+        return reinterpret_cast<uint64_t*>(bytes.data() + offset);
+    };
+    constexpr size_t MAX_NUM_ELEMENTS_OFFSET = 24;
+
+    // nextNewIndex beyond maxNumElements
+    corrupt = buffer;
+    *field_at(corrupt, MAX_NUM_ELEMENTS_OFFSET) = 60000;
+    EXPECT_TRUE(rejects(corrupt));
+
+    // maxNumElements does not fit in Index_t
+    corrupt = buffer;
+    *field_at(corrupt, MAX_NUM_ELEMENTS_OFFSET) = uint64_t(1) << 40;
+    EXPECT_TRUE(rejects(corrupt));
+
+    // maxNumElements would make the sentinel a valid index
+    using Small_t = uint16_t;
+    IndexAllocator<Small_t, 1000> small(1000);
+    std::vector<Small_t> small_indices;
+    small.allocateN(100, small_indices);
+    std::vector<uint8_t> small_buffer;
+    small.serialize(small_buffer);
+    IndexAllocator<Small_t, 1000> restored_small(10);
+    EXPECT_TRUE(restored_small.deserialize(small_buffer));
+    *field_at(small_buffer, MAX_NUM_ELEMENTS_OFFSET) = 1001;
+    EXPECT_FALSE(restored_small.deserialize(small_buffer));
+
+    // nextNewIndex near UINT64_MAX: rounding it up to whole words must not
+    // wrap to numWords == 0 (which would leave no leaves for the tail check)
+    constexpr size_t NEXT_NEW_INDEX_OFFSET = 32;
+    constexpr size_t NUM_FREE_OFFSET = 40;
+    constexpr size_t NUM_WORDS_OFFSET = 48;
+    using Big_t = uint64_t;
+    IndexAllocator<Big_t> big(1000);
+    std::vector<uint8_t> big_buffer;
+    big.serialize(big_buffer);
+    ASSERT_EQ(header_size, big_buffer.size());
+    for (uint64_t next = UINT64_MAX - 62; next != 0; ++next) {
+        corrupt = big_buffer;
+        *field_at(corrupt, MAX_NUM_ELEMENTS_OFFSET) = UINT64_MAX;
+        *field_at(corrupt, NEXT_NEW_INDEX_OFFSET) = next;
+        *field_at(corrupt, NUM_FREE_OFFSET) = 0;
+        *field_at(corrupt, NUM_WORDS_OFFSET) = 0;
+        IndexAllocator<Big_t> restored_big(10);
+        EXPECT_FALSE(restored_big.deserialize(corrupt)) << next;
+        EXPECT_EQ(0, restored_big.getNumAllocated());
+    }
+}
+
+// the previous implementation: a free list re-sorted whenever it got out of order
+class SortingIndexAllocator {
+public:
+    int32_t allocate() {
+        if (_freeIndices.empty()) {
+            return _nextNewIndex++;
+        }
+        if (!_sorted) {
+            std::sort(_freeIndices.begin(), _freeIndices.end(), std::greater<int32_t>());
+            _sorted = true;
+        }
+        int32_t index = _freeIndices.back();
+        _freeIndices.pop_back();
+        return index;
+    }
+    void free(int32_t index) {
+        if (_sorted && !_freeIndices.empty() && index < _freeIndices.back()) {
+            _sorted = false;
+        }
+        _freeIndices.push_back(index);
+    }
+private:
+    std::vector<int32_t> _freeIndices;
+    int32_t _nextNewIndex { 0 };
+    bool _sorted { true };
+};
+
+TEST(IndexAllocator_test, churn_benchmark) {
+    // 1M live indices, then free a random 10% and churn:
+    // each step frees a random live index and allocates one
+    constexpr int32_t NUM_LIVE = 1000000;
+    constexpr int32_t NUM_HOLES = NUM_LIVE / 10;
+    constexpr uint32_t NUM_STEPS = 1000000;
+    constexpr uint32_t NUM_SORTING_STEPS = 200; // it's *that* slow
+
+    auto run = [&](auto& allocator, uint32_t num_steps) {
+        std::mt19937 generator(456);
+        std::vector<int32_t> live;
+        live.reserve(NUM_LIVE);
+        auto start = std::chrono::steady_clock::now();
+        for (int32_t i = 0; i < NUM_LIVE; ++i) {
+            live.push_back(allocator.allocate());
+        }
+        for (int32_t i = 0; i < NUM_HOLES; ++i) {
+            size_t j = generator() % live.size();
+            allocator.free(live[j]);
+            live[j] = live.back();
+            live.pop_back();
+        }
+        auto middle = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < num_steps; ++i) {
+            size_t j = generator() % live.size();
+            allocator.free(live[j]);
+            live[j] = allocator.allocate();
+        }
+        auto end = std::chrono::steady_clock::now();
+        return std::make_pair(
+            std::chrono::duration<double, std::milli>(middle - start).count(),
+            std::chrono::duration<double, std::nano>(end - middle).count() / num_steps);
+    };
+
+    IndexAllocator<int32_t> allocator(2 * NUM_LIVE);
+    auto bitset = run(allocator, NUM_STEPS);
+    EXPECT_EQ(NUM_LIVE - NUM_HOLES, allocator.getNumLive());
+    EXPECT_EQ(NUM_HOLES, allocator.getNumFree());
+
+    SortingIndexAllocator sorting;
+    auto sorted = run(sorting, NUM_SORTING_STEPS);
+
+    fmt::print("churn_benchmark live={} holes={} fill: bitset={:.1f}msec sorting={:.1f}msec"
+        " free+allocate: bitset={:.0f}nsec sorting={:.0f}nsec\n",
+        NUM_LIVE, NUM_HOLES, bitset.first, sorted.first, bitset.second, sorted.second);
+}
+
 int main(int32_t argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -0,0 +1,91 @@
+//
+// test_LatencyHistogram.cpp
+//
+//  Distributed under the Apache License, Version 2.0.
+//  See the accompanying file LICENSE or
+//  http://www.apache.org/licenses/LICENSE-2.0.html
+//
+
+#include <gtest/gtest.h>
+
+#include <util/LatencyHistogram.h>
+
+TEST(LatencyHistogram_test, buckets) {
+    // every value must land in a bucket whose [floor, ceiling) contains it
+    for (uint64_t value = 0; value < 100000; value += 7) {
+        uint32_t bucket = LatencyHistogram::computeBucket(value);
+        EXPECT_LE(LatencyHistogram::getBucketFloor(bucket), value);
+        EXPECT_GT(LatencyHistogram::getBucketCeiling(bucket), value);
+    }
+
+    // buckets are contiguous
+    for (uint32_t i = 0; i + 1 < LatencyHistogram::NUM_BUCKETS; ++i) {
+        EXPECT_EQ(LatencyHistogram::getBucketCeiling(i), LatencyHistogram::getBucketFloor(i + 1));
+    }
+
+    // huge values are clamped to the last bucket
+    EXPECT_EQ(LatencyHistogram::NUM_BUCKETS - 1, LatencyHistogram::computeBucket(uint64_t(-1)));
+}
+
+TEST(LatencyHistogram_test, percentile) {
+    LatencyHistogram histogram;
+    EXPECT_EQ(0, histogram.getCount());
+    EXPECT_EQ(0, histogram.getPercentile(0.99f));
+
+    // 1000 samples: 1..1000
+    constexpr uint64_t NUM_SAMPLES = 1000;
+    for (uint64_t i = 1; i <= NUM_SAMPLES; ++i) {
+        histogram.add(i);
+    }
+    EXPECT_EQ(NUM_SAMPLES, histogram.getCount());
+    EXPECT_EQ(NUM_SAMPLES, histogram.getMax());
+
+    // percentiles are accurate to within one bucket (25%)
+    uint64_t p50 = histogram.getPercentile(0.50f);
+    EXPECT_GE(p50, 500);
+    EXPECT_LE(p50, 500 * 5 / 4);
+    uint64_t p99 = histogram.getPercentile(0.99f);
+    EXPECT_GE(p99, 990);
+    EXPECT_LE(p99, 990 * 5 / 4);
+
+    histogram.clear();
+    EXPECT_EQ(0, histogram.getCount());
+    EXPECT_EQ(0, histogram.getMax());
+}
+
+TEST(LatencyHistogram_test, decay) {
+    constexpr uint32_t DECAY_PERIOD = 100;
+    LatencyHistogram histogram(DECAY_PERIOD);
+
+    // old history is slow
+    for (uint32_t i = 0; i < 10 * DECAY_PERIOD; ++i) {
+        histogram.add(10000);
+    }
+    EXPECT_GE(histogram.getPercentile(0.5f), 10000);
+
+    // recent history is fast and soon dominates the percentiles
+    for (uint32_t i = 0; i < 10 * DECAY_PERIOD; ++i) {
+        histogram.add(10);
+    }
+    EXPECT_LT(histogram.getCount(), 2 * DECAY_PERIOD);
+    EXPECT_LE(histogram.getPercentile(0.99f), 16);
+}
+
+TEST(LatencyHistogram_test, merge) {
+    LatencyHistogram a;
+    LatencyHistogram b;
+    for (uint64_t i = 0; i < 100; ++i) {
+        a.add(10);
+        b.add(1000);
+    }
+    a.merge(b);
+    EXPECT_EQ(200, a.getCount());
+    EXPECT_EQ(1000, a.getMax());
+    EXPECT_LE(a.getPercentile(0.25f), 16);
+    EXPECT_GE(a.getPercentile(0.75f), 1000);
+}
+
+int main(int32_t argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
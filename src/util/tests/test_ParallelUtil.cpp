@@ -0,0 +1,174 @@
+//
+// test_ParallelUtil.cpp
+//
+//  Distributed under the Apache License, Version 2.0.
+//  See the accompanying file LICENSE or
+//  http://www.apache.org/licenses/LICENSE-2.0.html
+//
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fmt/format.h>
+#include <gtest/gtest.h>
+
+#include <util/ParallelUtil.h>
+
+TEST(ParallelUtil_test, compute_grain) {
+    ThreadPool pool(4);
+    EXPECT_EQ(1, ParallelUtil::compute_grain(pool, 0));
+    EXPECT_EQ(1, ParallelUtil::compute_grain(pool, 10));
+    EXPECT_EQ(1000, ParallelUtil::compute_grain(pool, 32000));
+}
+
+TEST(ParallelUtil_test, parallel_for_visits_each_index_once) {
+    ThreadPool pool(4);
+    constexpr size_t NUM_INDICES = 10007;
+    for (size_t grain : { 0, 1, 7, 100, 20000 }) {
+        std::vector<std::atomic<uint32_t>> visits(NUM_INDICES);
+        ParallelUtil::parallel_for(pool, 0, NUM_INDICES, grain, [&visits](size_t i) {
+            ++visits[i];
+        });
+        for (size_t i = 0; i < NUM_INDICES; ++i) {
+            EXPECT_EQ(1, visits[i]) << "grain=" << grain << " i=" << i;
+        }
+    }
+
+    // empty range
+    bool called = false;
+    ParallelUtil::parallel_for(pool, 5, 5, 0, [&called](size_t i) { called = true; });
+    EXPECT_FALSE(called);
+}
+
+TEST(ParallelUtil_test, parallel_for_chunks) {
+    ThreadPool pool(4);
+    std::atomic<size_t> sum { 0 };
+    std::atomic<uint32_t> num_chunks { 0 };
+    ParallelUtil::parallel_for(pool, 10, 1010, 100, [&](size_t chunk_begin, size_t chunk_end) {
+        EXPECT_EQ(0, (chunk_begin - 10) % 100);
+        EXPECT_LE(chunk_end - chunk_begin, 100);
+        for (size_t i = chunk_begin; i < chunk_end; ++i) {
+            sum += i;
+        }
+        ++num_chunks;
+    });
+    EXPECT_EQ(10, num_chunks);
+    EXPECT_EQ((10 + 1009) * 1000 / 2, sum);
+}
+
+TEST(ParallelUtil_test, parallel_reduce_is_ordered) {
+    ThreadPool pool(4);
+    // string concatenation is associative but not commutative
+    std::string result = ParallelUtil::parallel_reduce(pool, 0, 26, 3, std::string(),
+        [](size_t i) { return std::string(1, char('a' + i)); },
+        [](const std::string& a, const std::string& b) { return a + b; });
+    EXPECT_EQ("abcdefghijklmnopqrstuvwxyz", result);
+
+    uint64_t sum = ParallelUtil::parallel_reduce(pool, 0, 100000, 0, uint64_t(0),
+        [](size_t i) { return uint64_t(i); },
+        [](uint64_t a, uint64_t b) { return a + b; });
+    EXPECT_EQ(uint64_t(99999) * 100000 / 2, sum);
+
+    bool all_even = ParallelUtil::parallel_reduce(pool, 0, 1000, 10, true,
+        [](size_t i) { return i % 2 == 0 || i == 999; },
+        [](bool a, bool b) { return a && b; });
+    EXPECT_FALSE(all_even);
+}
+
+TEST(ParallelUtil_test, nested_parallel_for) {
+    // the outer loop runs on workers, which must help (not block)
+    // while they wait on the inner loops
+    ThreadPool pool(2);
+    constexpr size_t NUM_OUTER = 64;
+    constexpr size_t NUM_INNER = 1000;
+    std::atomic<size_t> count { 0 };
+    ParallelUtil::parallel_for(pool, 0, NUM_OUTER, 1, [&](size_t i) {
+        ParallelUtil::parallel_for(pool, 0, NUM_INNER, 0, [&count](size_t j) {
+            count.fetch_add(1, std::memory_order_relaxed);
+        });
+    });
+    EXPECT_EQ(NUM_OUTER * NUM_INNER, count);
+}
+
+TEST(ParallelUtil_test, exception_propagates) {
+    ThreadPool pool(4);
+    std::atomic<size_t> count { 0 };
+    EXPECT_THROW(
+        ParallelUtil::parallel_for(pool, 0, 1000, 10, [&count](size_t i) {
+            ++count;
+            if (i == 555) {
+                throw std::runtime_error("bad index");
+            }
+        }),
+        std::runtime_error);
+
+    // the pool is still healthy afterwards
+    count = 0;
+    ParallelUtil::parallel_for(pool, 0, 1000, 10, [&count](size_t i) { ++count; });
+    EXPECT_EQ(1000, count);
+}
+
+TEST(ParallelUtil_test, no_workers) {
+    // the calling thread does all the work
+    ThreadPool pool(0);
+    std::atomic<size_t> count { 0 };
+    ParallelUtil::parallel_for(pool, 0, 1000, 0, [&count](size_t i) { ++count; });
+    EXPECT_EQ(1000, count);
+}
+
+TEST(ParallelUtil_test, pool_shutting_down) {
+    // parallel_for() from a task that outlives the start of the pool's
+    // destructor: posts fail so the caller does all the work
+    auto pool = std::make_unique<ThreadPool>(2);
+    std::atomic<bool> started { false };
+    std::atomic<size_t> count { 0 };
+    ThreadPool* pool_ptr = pool.get();
+    pool->post([pool_ptr, &started, &count] {
+        started = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        ParallelUtil::parallel_for(*pool_ptr, 0, 1000, 10, [&count](size_t i) { ++count; });
+    });
+    while (!started) {
+        std::this_thread::yield();
+    }
+    pool.reset();
+    EXPECT_EQ(1000, count);
+}
+
+TEST(ParallelUtil_test, benchmark) {
+    constexpr size_t NUM_POSITIONS = 50000;
+    constexpr uint32_t NUM_STEPS = 20;
+    std::vector<float> positions(NUM_POSITIONS, 1.0f);
+    auto update = [&positions](size_t i) {
+        positions[i] = std::sqrt(positions[i] * positions[i] + 0.001f * float(i));
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t step = 0; step < NUM_STEPS; ++step) {
+        for (size_t i = 0; i < NUM_POSITIONS; ++i) {
+            update(i);
+        }
+    }
+    auto middle = std::chrono::steady_clock::now();
+    ThreadPool pool(std::max(2u, std::thread::hardware_concurrency()));
+    for (uint32_t step = 0; step < NUM_STEPS; ++step) {
+        ParallelUtil::parallel_for(pool, 0, NUM_POSITIONS, 0, update);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    fmt::print("parallel_for benchmark threads={} positions={} serial={:.2f}msec parallel={:.2f}msec\n",
+        pool.getNumThreads(), NUM_POSITIONS,
+        std::chrono::duration<double, std::milli>(middle - start).count(),
+        std::chrono::duration<double, std::milli>(end - middle).count());
+}
+
+int main(int32_t argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
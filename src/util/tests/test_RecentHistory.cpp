@@ -244,6 +244,60 @@ TEST(RecentHistory_test, lost_history) {
     EXPECT_TRUE(!success);
 }
 
+// Counter is a Consumer which sums integer events
+class Counter : public RecentHistory<uint64_t>::Consumer {
+public:
+    void consumeEvent(const uint64_t& event) override {
+        _sum += event;
+        ++_count;
+    }
+    uint64_t _sum { 0 };
+    uint64_t _count { 0 };
+};
+
+TEST(RecentHistory_test, large_capacity) {
+    // capacity is rounded up to a power of two and is not capped at 512
+    EXPECT_EQ(8u, RecentHistory<uint64_t>(5).getCapacity());
+    EXPECT_EQ(1u, RecentHistory<uint64_t>(0).getCapacity());
+
+    constexpr uint32_t NUM_EVENTS = 1000000;
+    RecentHistory<uint64_t> history(NUM_EVENTS);
+    EXPECT_EQ(1u << 20, history.getCapacity());
+
+    // start past 2^32 to check that versions don't wrap
+    const uint64_t START_VERSION = (uint64_t(1) << 32) - 10;
+    history.clearAndSetVersion(START_VERSION);
+    Counter counter;
+    counter.setVersion(START_VERSION);
+
+    uint64_t expected_sum = 0;
+    for (uint64_t i = 0; i < NUM_EVENTS; ++i) {
+        history.copy(i);
+        expected_sum += i;
+    }
+    EXPECT_EQ(NUM_EVENTS, history.getSize());
+    EXPECT_EQ(START_VERSION + NUM_EVENTS, history.getVersion());
+    EXPECT_TRUE(history.advanceConsumer(counter));
+    EXPECT_EQ(NUM_EVENTS, counter._count);
+    EXPECT_EQ(expected_sum, counter._sum);
+    EXPECT_EQ(history.getVersion(), counter.getVersion());
+
+    // overflow the ring: a consumer which fell a whole ring behind fails
+    // but one exactly a ring behind does not
+    Counter slow;
+    slow.setVersion(history.getVersion());
+    Counter just_in_time;
+    just_in_time.setVersion(history.getVersion());
+    for (uint64_t i = 0; i < history.getCapacity(); ++i) {
+        history.copy(1);
+    }
+    EXPECT_EQ(history.getCapacity(), history.getSize());
+    EXPECT_TRUE(history.advanceConsumer(just_in_time));
+    EXPECT_EQ(history.getCapacity(), just_in_time._sum);
+    history.copy(1);
+    EXPECT_FALSE(history.advanceConsumer(slow));
+}
+
 
 int main(int32_t argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
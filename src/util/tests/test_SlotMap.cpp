@@ -0,0 +1,145 @@
+//
+// test_SlotMap.cpp
+//
+//  Distributed under the Apache License, Version 2.0.
+//  See the accompanying file LICENSE or
+//  http://www.apache.org/licenses/LICENSE-2.0.html
+//
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+#include <gtest/gtest.h>
+
+#include <util/SlotMap.h>
+
+TEST(SlotMap_test, insert_get_erase) {
+    SlotMap<std::string> names(10);
+    auto alice = names.insert("alice");
+    auto bob = names.insert("bob");
+    auto carol = names.emplace(5, 'c');
+    EXPECT_EQ(3, names.size());
+    EXPECT_EQ("alice", *names.get(alice));
+    EXPECT_EQ("bob", *names.get(bob));
+    EXPECT_EQ("ccccc", *names.get(carol));
+
+    // erase from the middle: the last element moves into the hole
+    EXPECT_TRUE(names.erase(alice));
+    EXPECT_FALSE(names.erase(alice));
+    EXPECT_EQ(nullptr, names.get(alice));
+    EXPECT_FALSE(names.contains(alice));
+    EXPECT_EQ(2, names.size());
+    EXPECT_EQ("ccccc", names.data()[0]);
+    EXPECT_EQ(carol, names.getHandle(0));
+    EXPECT_EQ("bob", *names.get(bob));
+    EXPECT_EQ("ccccc", *names.get(carol));
+
+    // the reused index gets a new handle
+    auto dave = names.insert("dave");
+    EXPECT_NE(alice, dave);
+    EXPECT_EQ(nullptr, names.get(alice));
+    EXPECT_EQ("dave", *names.get(dave));
+
+    // move-only values
+    SlotMap<std::unique_ptr<int32_t>> pointers(4);
+    auto p = pointers.insert(std::make_unique<int32_t>(7));
+    auto q = pointers.insert(std::make_unique<int32_t>(8));
+    EXPECT_TRUE(pointers.erase(p));
+    EXPECT_EQ(8, **pointers.get(q));
+
+    names.clear();
+    EXPECT_TRUE(names.empty());
+    EXPECT_FALSE(names.contains(bob));
+}
+
+TEST(SlotMap_test, random_churn) {
+    SlotMap<int32_t> values(1000);
+    std::map<SlotMap<int32_t>::Handle, int32_t> reference;
+    std::vector<SlotMap<int32_t>::Handle> dead;
+    std::mt19937 generator(789);
+    for (int32_t i = 0; i < 20000; ++i) {
+        if (reference.empty() || generator() % 2 == 0) {
+            auto handle = values.insert(i);
+            if (handle != SlotMap<int32_t>::INVALID_HANDLE) {
+                reference[handle] = i;
+            }
+        } else {
+            auto itr = reference.begin();
+            std::advance(itr, generator() % reference.size());
+            EXPECT_TRUE(values.erase(itr->first));
+            dead.push_back(itr->first);
+            reference.erase(itr);
+        }
+    }
+    ASSERT_EQ(reference.size(), values.size());
+    for (const auto& entry : reference) {
+        ASSERT_NE(nullptr, values.get(entry.first));
+        EXPECT_EQ(entry.second, *values.get(entry.first));
+    }
+    for (auto handle : dead) {
+        EXPECT_EQ(nullptr, values.get(handle));
+    }
+    // the dense array holds exactly the live values
+    int64_t sum = 0;
+    for (int32_t value : values) {
+        sum += value;
+    }
+    int64_t expected_sum = 0;
+    for (size_t i = 0; i < values.size(); ++i) {
+        expected_sum += reference[values.getHandle(i)];
+    }
+    EXPECT_EQ(expected_sum, sum);
+}
+
+TEST(SlotMap_test, iteration_benchmark) {
+    // half the entities despawned at random: sparse vector with a live flag
+    // vs the dense SlotMap
+    constexpr int32_t NUM_ENTITIES = 1000000;
+    constexpr uint32_t NUM_PASSES = 20;
+    struct Sparse { float value; bool live; };
+    std::vector<Sparse> sparse(NUM_ENTITIES, { 1.0f, true });
+    SlotMap<float> dense(NUM_ENTITIES);
+    std::vector<SlotMap<float>::Handle> handles;
+    for (int32_t i = 0; i < NUM_ENTITIES; ++i) {
+        handles.push_back(dense.insert(1.0f));
+    }
+    std::mt19937 generator(1);
+    for (int32_t i = 0; i < NUM_ENTITIES; ++i) {
+        if (generator() % 2 == 0) {
+            sparse[i].live = false;
+            dense.erase(handles[i]);
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t pass = 0; pass < NUM_PASSES; ++pass) {
+        for (Sparse& s : sparse) {
+            if (s.live) {
+                s.value = s.value * 0.99f + 0.01f;
+            }
+        }
+    }
+    auto middle = std::chrono::steady_clock::now();
+    for (uint32_t pass = 0; pass < NUM_PASSES; ++pass) {
+        for (float& value : dense) {
+            value = value * 0.99f + 0.01f;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    EXPECT_FLOAT_EQ(1.0f, dense.data()[0]);
+
+    fmt::print("iteration_benchmark live={} sparse={:.2f}msec dense={:.2f}msec\n",
+        dense.size(),
+        std::chrono::duration<double, std::milli>(middle - start).count() / NUM_PASSES,
+        std::chrono::duration<double, std::milli>(end - middle).count() / NUM_PASSES);
+}
+
+int main(int32_t argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,164 @@
+//
+// test_TaskGraph.cpp
+//
+//  Distributed under the Apache License, Version 2.0.
+//  See the accompanying file LICENSE or
+//  http://www.apache.org/licenses/LICENSE-2.0.html
+//
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <util/TaskGraph.h>
+
+TEST(TaskGraph_test, respects_dependencies) {
+    // input -> physics -> { interest, serialize } -> send
+    ThreadPool pool(4);
+    TaskGraph tick("tick");
+    std::mutex mutex;
+    std::vector<TaskGraph::NodeId> order;
+    auto record = [&](TaskGraph::NodeId id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        order.push_back(id);
+    };
+
+    TaskGraph::NodeId input = 0;
+    TaskGraph::NodeId physics = 1;
+    TaskGraph::NodeId interest = 2;
+    TaskGraph::NodeId serialize = 3;
+    TaskGraph::NodeId send = 4;
+    EXPECT_EQ(input, tick.addNode("input", [&]{ record(input); }));
+    EXPECT_EQ(physics, tick.addNode("physics", [&]{ record(physics); }));
+    EXPECT_EQ(interest, tick.addNode("interest", [&]{ record(interest); }));
+    EXPECT_EQ(serialize, tick.addNode("serialize", [&]{ record(serialize); }));
+    EXPECT_EQ(send, tick.addNode("send", [&]{ record(send); }));
+    tick.addEdge(input, physics);
+    tick.addEdge(physics, interest);
+    tick.addEdge(physics, serialize);
+    tick.addEdge(interest, send);
+    tick.addEdge(serialize, send);
+    EXPECT_EQ(5, tick.getNumNodes());
+
+    for (uint32_t i = 0; i < 100; ++i) {
+        order.clear();
+        tick.run(pool);
+        ASSERT_EQ(5, order.size());
+        EXPECT_EQ(input, order[0]);
+        EXPECT_EQ(physics, order[1]);
+        EXPECT_EQ(send, order[4]);
+    }
+}
+
+TEST(TaskGraph_test, wide_graph) {
+    // many roots and a fan-in: exercises post() of released successors
+    ThreadPool pool(4);
+    TaskGraph graph;
+    static constexpr uint32_t NUM_ROOTS = 64;
+    std::atomic<uint32_t> count { 0 };
+    TaskGraph::NodeId sink = graph.addNode("sink", [&count] {
+        EXPECT_EQ(NUM_ROOTS, count);
+    });
+    for (uint32_t i = 0; i < NUM_ROOTS; ++i) {
+        TaskGraph::NodeId root = graph.addNode("root", [&count] { ++count; });
+        graph.addEdge(root, sink);
+    }
+    for (uint32_t i = 0; i < 10; ++i) {
+        count = 0;
+        graph.run(pool);
+        EXPECT_EQ(NUM_ROOTS, count);
+    }
+}
+
+TEST(TaskGraph_test, run_from_worker) {
+    // a graph run from inside a pool task must not deadlock
+    ThreadPool pool(1);
+    TaskGraph graph;
+    std::atomic<uint32_t> count { 0 };
+    TaskGraph::NodeId a = graph.addNode("a", [&count] { ++count; });
+    TaskGraph::NodeId b = graph.addNode("b", [&count] { ++count; });
+    TaskGraph::NodeId c = graph.addNode("c", [&count] { ++count; });
+    graph.addEdge(a, c);
+    graph.addEdge(b, c);
+    pool.enqueue([&graph, &pool] { graph.run(pool); }).get();
+    EXPECT_EQ(3, count);
+}
+
+TEST(TaskGraph_test, pool_shutting_down) {
+    // a graph run from a task that outlives the start of the pool's
+    // destructor: posts fail so roots and successors run in place
+    auto pool = std::make_unique<ThreadPool>(2);
+    TaskGraph graph;
+    std::atomic<uint32_t> count { 0 };
+    std::vector<TaskGraph::NodeId> roots;
+    for (uint32_t i = 0; i < 4; ++i) {
+        roots.push_back(graph.addNode("root", [&count] { ++count; }));
+    }
+    TaskGraph::NodeId fan_out = graph.addNode("fan_out", [&count] { ++count; });
+    graph.addEdge(roots[0], fan_out);
+    for (uint32_t i = 0; i < 8; ++i) {
+        graph.addEdge(fan_out, graph.addNode("leaf", [&count] { ++count; }));
+    }
+
+    std::atomic<bool> started { false };
+    ThreadPool* pool_ptr = pool.get();
+    pool->post([pool_ptr, &graph, &started] {
+        started = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        graph.run(*pool_ptr);
+    });
+    while (!started) {
+        std::this_thread::yield();
+    }
+    pool.reset();
+    EXPECT_EQ(13, count);
+}
+
+TEST(TaskGraph_test, cycle_is_rejected) {
+    TaskGraph graph;
+    TaskGraph::NodeId a = graph.addNode("a", []{});
+    TaskGraph::NodeId b = graph.addNode("b", []{});
+    TaskGraph::NodeId c = graph.addNode("c", []{});
+    graph.addEdge(a, b);
+    graph.addEdge(b, c);
+    graph.addEdge(c, b);
+    EXPECT_THROW(graph.finalize(), std::logic_error);
+    EXPECT_THROW(graph.addEdge(a, a), std::invalid_argument);
+    EXPECT_THROW(graph.addEdge(a, 7), std::invalid_argument);
+}
+
+TEST(TaskGraph_test, exception_skips_remaining_nodes) {
+    ThreadPool pool(2);
+    TaskGraph graph;
+    bool after_ran = false;
+    TaskGraph::NodeId bad = graph.addNode("bad", [] { throw std::runtime_error("oops"); });
+    TaskGraph::NodeId after = graph.addNode("after", [&after_ran] { after_ran = true; });
+    graph.addEdge(bad, after);
+    EXPECT_THROW(graph.run(pool), std::runtime_error);
+    EXPECT_FALSE(after_ran);
+}
+
+TEST(TaskGraph_test, node_timing) {
+    ThreadPool pool(2);
+    TaskGraph graph;
+    TaskGraph::NodeId slow = graph.addNode("slow", [] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    });
+    TaskGraph::NodeId fast = graph.addNode("fast", []{});
+    graph.addEdge(slow, fast);
+    graph.run(pool);
+    EXPECT_GE(graph.getNodeUsec(slow), 5000);
+    EXPECT_LT(graph.getNodeUsec(fast), graph.getNodeUsec(slow));
+    EXPECT_EQ("slow", graph.getNodeName(slow));
+}
+
+int main(int32_t argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
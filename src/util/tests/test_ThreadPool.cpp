@@ -0,0 +1,679 @@
+//
+// test_ThreadPool.cpp
+//
+//  Distributed under the Apache License, Version 2.0.
+//  See the accompanying file LICENSE or
+//  http://www.apache.org/licenses/LICENSE-2.0.html
+//
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fmt/format.h>
+#include <gtest/gtest.h>
+
+#include <util/ThreadPool.h>
+
+// count heap allocations so we can verify the allocation-free paths
+#if defined(__GNUC__) && !defined(__clang__)
+// gcc can't see that our operator new/delete are a matched pair
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+static std::atomic<uint64_t> g_numAllocations { 0 };
+
+void* operator new(size_t size) {
+    g_numAllocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = std::malloc(size);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+// ClassicThreadPool is the original single-queue pool
+// kept here as a baseline for the contention benchmark
+class ClassicThreadPool {
+public:
+    ClassicThreadPool(size_t threads) {
+        for (size_t i = 0; i < threads; ++i) {
+            _workers.emplace_back([this] {
+                for (;;) {
+                    std::function<void()> task;
+                    {
+                        std::unique_lock<std::mutex> lock(_mutex);
+                        _condition.wait(lock, [this]{ return _stop || !_tasks.empty(); });
+                        if (_stop && _tasks.empty()) {
+                            return;
+                        }
+                        task = std::move(_tasks.front());
+                        _tasks.pop();
+                    }
+                    task();
+                }
+            });
+        }
+    }
+
+    template<class F>
+    std::future<void> enqueue(F&& f) {
+        auto task = std::make_shared< std::packaged_task<void()> >(std::forward<F>(f));
+        std::future<void> res = task->get_future();
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _tasks.emplace([task](){ (*task)(); });
+        }
+        _condition.notify_one();
+        return res;
+    }
+
+    ~ClassicThreadPool() {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _condition.notify_all();
+        for (std::thread& worker : _workers) {
+            worker.join();
+        }
+    }
+
+private:
+    std::vector<std::thread> _workers;
+    std::queue< std::function<void()> > _tasks;
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    bool _stop { false };
+};
+
+TEST(ThreadPool_test, enqueue_returns_future) {
+    ThreadPool pool(4);
+    EXPECT_EQ(4, pool.getNumThreads());
+    EXPECT_EQ(ThreadPool::NO_WORKER, pool.getWorkerIndex());
+
+    std::vector<std::future<int32_t>> results;
+    for (int32_t i = 0; i < 100; ++i) {
+        results.push_back(pool.enqueue([](int32_t x) { return x * x; }, i));
+    }
+    for (int32_t i = 0; i < 100; ++i) {
+        EXPECT_EQ(i * i, results[i].get());
+    }
+}
+
+TEST(ThreadPool_test, nested_enqueue) {
+    // tasks which spawn tasks push onto their worker's own deque
+    // and idle workers must steal them
+    constexpr uint32_t NUM_OUTER = 16;
+    constexpr uint32_t NUM_INNER = 1000;
+    std::atomic<uint32_t> count { 0 };
+    {
+        ThreadPool pool(4);
+        std::vector<std::future<void>> outer;
+        for (uint32_t i = 0; i < NUM_OUTER; ++i) {
+            outer.push_back(pool.enqueue([&pool, &count] {
+                EXPECT_NE(ThreadPool::NO_WORKER, pool.getWorkerIndex());
+                for (uint32_t j = 0; j < NUM_INNER; ++j) {
+                    pool.enqueue([&count] { ++count; });
+                }
+            }));
+        }
+        for (auto& f : outer) {
+            f.get();
+        }
+        // destructor drains remaining tasks
+    }
+    EXPECT_EQ(NUM_OUTER * NUM_INNER, count);
+}
+
+TEST(ThreadPool_test, destructor_finishes_tasks) {
+    std::atomic<uint32_t> count { 0 };
+    {
+        ThreadPool pool(2);
+        for (uint32_t i = 0; i < 1000; ++i) {
+            pool.enqueue([&count] { ++count; });
+        }
+    }
+    EXPECT_EQ(1000, count);
+}
+
+TEST(ThreadPool_test, post_during_destruction) {
+    // tasks keep posting to every lane while the pool is destroyed: each post
+    // either throws or its task runs before the destructor returns
+    for (uint32_t i = 0; i < 20; ++i) {
+        std::atomic<uint32_t> num_posted { 0 };
+        std::atomic<uint32_t> num_ran { 0 };
+        {
+            ThreadPool pool(2);
+            for (uint32_t j = 0; j < 2; ++j) {
+                pool.post([&pool, &num_posted, &num_ran] {
+                    const ThreadPool::Priority priorities[] = {
+                        ThreadPool::Priority::NORMAL, ThreadPool::Priority::HIGH, ThreadPool::Priority::LOW };
+                    for (uint32_t k = 0; ; ++k) {
+                        try {
+                            if (k % 4 == 3) {
+                                pool.postWithDeadline(ThreadPool::Clock::now(), ThreadPool::DeadlinePolicy::EXPEDITE,
+                                        [&num_ran] { ++num_ran; });
+                            } else {
+                                pool.post(priorities[k % 4], [&num_ran] { ++num_ran; });
+                            }
+                        } catch (const std::runtime_error&) {
+                            return;
+                        }
+                        ++num_posted;
+                    }
+                });
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        EXPECT_EQ(num_posted, num_ran);
+    }
+}
+
+TEST(ThreadPool_test, task_small_buffer) {
+    int32_t value = 0;
+    uint64_t num_allocations = g_numAllocations;
+    ThreadPool::Task task([&value] { value += 1; });
+    EXPECT_TRUE(task.isInline());
+    ThreadPool::Task other(std::move(task));
+    EXPECT_FALSE(task);
+    EXPECT_TRUE(other);
+    other();
+    other.reset();
+    EXPECT_EQ(num_allocations, g_numAllocations);
+    EXPECT_EQ(1, value);
+
+    // move-only callables are allowed
+    std::unique_ptr<int32_t> p(new int32_t(7));
+    ThreadPool::Task owner([p = std::move(p), &value] { value = *p; });
+    owner();
+    EXPECT_EQ(7, value);
+
+    // big callables fall back to the heap
+    struct Big { char data[2 * ThreadPool::Task::INLINE_SIZE]; };
+    Big big;
+    big.data[0] = 42;
+    ThreadPool::Task heavy([big, &value] { value = big.data[0]; });
+    EXPECT_FALSE(heavy.isInline());
+    heavy();
+    EXPECT_EQ(42, value);
+}
+
+TEST(ThreadPool_test, enqueue_move_only_args) {
+    ThreadPool pool(2);
+    std::unique_ptr<int32_t> p(new int32_t(5));
+    auto result = pool.enqueue([](std::unique_ptr<int32_t> q) { return *q * 2; }, std::move(p));
+    EXPECT_EQ(10, result.get());
+}
+
+TEST(ThreadPool_test, post_does_not_allocate) {
+    constexpr uint32_t NUM_TASKS = 10000;
+    std::atomic<uint32_t> count { 0 };
+    ThreadPool pool(2);
+
+    auto wait_for = [&count](uint32_t n) {
+        while (count.load() < n) {
+            std::this_thread::yield();
+        }
+    };
+
+    // warm up: grows the injection queue to size
+    for (uint32_t i = 0; i < NUM_TASKS; ++i) {
+        pool.post([&count] { ++count; });
+    }
+    wait_for(NUM_TASKS);
+
+    uint64_t num_allocations = g_numAllocations;
+    for (uint32_t i = 0; i < NUM_TASKS; ++i) {
+        pool.post([&count] { ++count; });
+    }
+    wait_for(2 * NUM_TASKS);
+    uint64_t post_allocations = g_numAllocations - num_allocations;
+
+    num_allocations = g_numAllocations;
+    std::vector<std::future<void>> futures;
+    futures.reserve(NUM_TASKS);
+    for (uint32_t i = 0; i < NUM_TASKS; ++i) {
+        futures.push_back(pool.enqueue([&count] { ++count; }));
+    }
+    wait_for(3 * NUM_TASKS);
+    uint64_t enqueue_allocations = g_numAllocations - num_allocations;
+
+    // enqueue() needs a shared state per future, post() needs nothing
+    EXPECT_LT(post_allocations, NUM_TASKS / 100);
+    EXPECT_GE(enqueue_allocations, NUM_TASKS);
+}
+
+// helper: blocks the pool's only worker until open() is called
+class Gate {
+public:
+    void close(ThreadPool& pool) {
+        std::promise<void> started;
+        std::future<void> is_started = started.get_future();
+        pool.post([this, &started] {
+            started.set_value();
+            _opened.get_future().wait();
+        });
+        is_started.wait();
+    }
+    void open() { _opened.set_value(); }
+private:
+    std::promise<void> _opened;
+};
+
+TEST(ThreadPool_test, priority_lanes) {
+    ThreadPool pool(1);
+    Gate gate;
+    gate.close(pool);
+
+    std::mutex mutex;
+    std::vector<std::string> order;
+    auto record = [&](const char* name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        order.push_back(name);
+    };
+    pool.post(ThreadPool::Priority::LOW, [&] { record("low"); });
+    pool.post([&] { record("normal"); });
+    auto high = pool.enqueue(ThreadPool::Priority::HIGH, [&] { record("high"); return 1; });
+    gate.open();
+    EXPECT_EQ(1, high.get());
+    pool.enqueue(ThreadPool::Priority::LOW, []{}).get();
+
+    std::vector<std::string> expected = { "high", "normal", "low" };
+    EXPECT_EQ(expected, order);
+}
+
+TEST(ThreadPool_test, deadlines) {
+    using Clock = ThreadPool::Clock;
+    ThreadPool pool(1);
+    Gate gate;
+    gate.close(pool);
+
+    std::mutex mutex;
+    std::vector<std::string> order;
+    auto record = [&](const char* name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        order.push_back(name);
+    };
+    Clock::time_point soon = Clock::now() + std::chrono::milliseconds(1);
+    Clock::time_point later = Clock::now() + std::chrono::seconds(60);
+    pool.post(ThreadPool::Priority::HIGH, [&] { record("high"); });
+    pool.postWithDeadline(later, ThreadPool::DeadlinePolicy::DROP, [&] { record("later"); });
+    pool.postWithDeadline(soon, ThreadPool::DeadlinePolicy::EXPEDITE, [&] { record("expedite"); });
+    pool.postWithDeadline(soon, ThreadPool::DeadlinePolicy::DROP, [&] { record("drop"); });
+    auto dropped = pool.enqueueWithDeadline(soon, ThreadPool::DeadlinePolicy::DROP, [] { return 1; });
+    pool.post([&] { record("normal"); });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    gate.open();
+    EXPECT_THROW(dropped.get(), std::future_error);
+    pool.enqueue(ThreadPool::Priority::LOW, []{}).get();
+
+    // expired EXPEDITE first, then HIGH, then unexpired deadline tasks
+    std::vector<std::string> expected = { "expedite", "high", "later", "normal" };
+    EXPECT_EQ(expected, order);
+}
+
+TEST(ThreadPool_test, low_priority_starvation) {
+    // a worker which always has NORMAL work on its own deque
+    // must still get to a LOW task eventually
+    ThreadPool pool(1);
+    pool.setLowPriorityMaxWait(1000);
+    EXPECT_EQ(1000, pool.getLowPriorityMaxWait());
+
+    std::atomic<bool> low_ran { false };
+    std::atomic<bool> spin_done { false };
+    auto start = std::chrono::steady_clock::now();
+    std::function<void()> spin = [&] {
+        bool timed_out = std::chrono::steady_clock::now() - start > std::chrono::seconds(2);
+        if (!low_ran && !timed_out) {
+            pool.post([&spin] { spin(); });
+        } else {
+            spin_done = true;
+        }
+    };
+    pool.post([&] {
+        pool.post(ThreadPool::Priority::LOW, [&low_ran] { low_ran = true; });
+        spin();
+    });
+    while (!low_ran && std::chrono::steady_clock::now() - start < std::chrono::seconds(3)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_TRUE(low_ran);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+    while (!spin_done) {
+        std::this_thread::yield();
+    }
+}
+
+TEST(ThreadPool_test, parse_cpu_list) {
+    std::vector<int32_t> expected = { 0, 1, 2, 3, 8, 10, 11 };
+    EXPECT_EQ(expected, ThreadPool::parseCpuList("0-3,8,10-11\n"));
+    EXPECT_TRUE(ThreadPool::parseCpuList("").empty());
+}
+
+TEST(ThreadPool_test, options) {
+    ThreadPool::Options options;
+    options.numThreads = 2;
+    options.name = "test";
+    options.cpus = { 0 };
+    options.numaAware = true;
+    ThreadPool pool(options);
+    EXPECT_EQ(2, pool.getNumThreads());
+    EXPECT_LE(1, pool.getNumNodes());
+    EXPECT_EQ(ThreadPool::readNumaNodes().empty() ? 1 : ThreadPool::readNumaNodes().size(), pool.getNumNodes());
+
+#ifdef __linux__
+    auto name = pool.enqueue([] {
+        char buffer[16];
+        pthread_getname_np(pthread_self(), buffer, sizeof(buffer));
+        return std::string(buffer);
+    });
+    std::string n = name.get();
+    EXPECT_TRUE(n == "test:0" || n == "test:1") << n;
+
+    // both workers are pinned to cpu 0 (if we're allowed to use it)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    if (CPU_ISSET(0, &allowed)) {
+        auto cpu = pool.enqueue([] { return sched_getcpu(); });
+        EXPECT_EQ(0, cpu.get());
+    }
+#endif
+
+    // node-local queues still see all the work
+    std::atomic<uint32_t> count { 0 };
+    std::vector<std::future<void>> futures;
+    for (uint32_t i = 0; i < 1000; ++i) {
+        futures.push_back(pool.enqueue([&count] { ++count; }));
+    }
+    for (auto& f : futures) {
+        f.get();
+    }
+    EXPECT_EQ(1000, count);
+}
+
+TEST(ThreadPool_test, stats) {
+    constexpr uint32_t NUM_TASKS = 64 * ThreadPool::STATS_SAMPLE_PERIOD;
+    ThreadPool pool(2);
+    ThreadPool::Stats before = pool.getStats();
+    EXPECT_EQ(0, before.numTasks);
+    EXPECT_EQ(2, before.busyUsec.size());
+
+    std::atomic<uint32_t> count { 0 };
+    for (uint32_t i = 0; i < NUM_TASKS; ++i) {
+        pool.post([&count] { ++count; });
+    }
+    while (count < NUM_TASKS) {
+        std::this_thread::yield();
+    }
+    // let the workers park
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    ThreadPool::Stats after = pool.getStats();
+    EXPECT_EQ(NUM_TASKS, after.numTasks);
+    EXPECT_EQ(0, after.queueDepth);
+    EXPECT_GT(after.uptimeUsec, before.uptimeUsec);
+    // only a sample of tasks is timed
+    // (the sample counter is per thread, so may be mid-period)
+    EXPECT_NEAR(NUM_TASKS / ThreadPool::STATS_SAMPLE_PERIOD, after.waitUsec.getCount(), 1);
+    EXPECT_EQ(after.waitUsec.getCount(), after.runUsec.getCount());
+    float busy = ThreadPool::computeBusyRatio(before, after);
+    EXPECT_GE(busy, 0.0f);
+    EXPECT_LT(busy, 1.0f);
+
+    // a busy worker shows up as busy
+    ThreadPool::Stats start = pool.getStats();
+    pool.enqueue([] { std::this_thread::sleep_for(std::chrono::milliseconds(50)); }).get();
+    ThreadPool::Stats end = pool.getStats();
+    EXPECT_GT(ThreadPool::computeBusyRatio(start, end), 0.3f);
+
+    // expired DROP tasks are counted
+    pool.postWithDeadline(ThreadPool::Clock::now(), ThreadPool::DeadlinePolicy::DROP, []{});
+    pool.enqueue([]{}).get();
+    EXPECT_EQ(1, pool.getStats().numDropped);
+}
+
+TEST(ThreadPool_test, timers) {
+    using namespace std::chrono;
+    std::atomic<bool> cancelled_ran { false };
+    std::atomic<uint32_t> count { 0 };
+    ThreadPool pool(2);
+
+    std::promise<steady_clock::time_point> fired;
+    auto start = steady_clock::now();
+    ThreadPool::TimerHandle once = pool.enqueueAfter(milliseconds(20), [&fired] {
+        fired.set_value(steady_clock::now());
+    });
+    EXPECT_TRUE(once.isActive());
+    auto when = fired.get_future().get();
+    EXPECT_GE(when - start, milliseconds(20));
+    // done is set just after the task returns
+    while (once.isActive()) {
+        std::this_thread::yield();
+    }
+
+    // cancelled timers never run
+    ThreadPool::TimerHandle cancelled = pool.enqueueAt(steady_clock::now() + milliseconds(10),
+        [&cancelled_ran] { cancelled_ran = true; });
+    cancelled.cancel();
+    EXPECT_FALSE(cancelled.isActive());
+
+    // periodic
+    ThreadPool::TimerHandle every = pool.enqueueEvery(milliseconds(5), [&count] { ++count; });
+    while (count < 5) {
+        std::this_thread::sleep_for(milliseconds(1));
+    }
+    every.cancel();
+    std::this_thread::sleep_for(milliseconds(20));
+    uint32_t final_count = count;
+    std::this_thread::sleep_for(milliseconds(20));
+    EXPECT_EQ(final_count, count);
+    EXPECT_FALSE(cancelled_ran);
+
+    EXPECT_THROW(pool.enqueueEvery(milliseconds(0), []{}), std::invalid_argument);
+
+    // pending timers are dropped on destruction
+    pool.enqueueAfter(seconds(60), [&cancelled_ran] { cancelled_ran = true; });
+}
+
+TEST(ThreadPool_test, slow_periodic_task_is_not_reentered) {
+    using namespace std::chrono;
+    // declared before the pool, which may still be running the last tick
+    std::atomic<int32_t> num_running { 0 };
+    std::atomic<int32_t> max_running { 0 };
+    std::atomic<uint32_t> count { 0 };
+    ThreadPool pool(4);
+    ThreadPool::TimerHandle every = pool.enqueueEvery(milliseconds(1), [&] {
+        int32_t n = ++num_running;
+        if (n > max_running) {
+            max_running = n;
+        }
+        std::this_thread::sleep_for(milliseconds(5));
+        --num_running;
+        ++count;
+    });
+    while (count < 5) {
+        std::this_thread::sleep_for(milliseconds(1));
+    }
+    every.cancel();
+    EXPECT_EQ(1, max_running);
+}
+
+// helper
+template <typename Pool>
+double run_contention_benchmark(uint32_t num_threads, uint32_t num_producers, uint32_t num_tasks) {
+    std::atomic<uint64_t> sum { 0 };
+    uint64_t expected_sum = (num_tasks / num_producers / 2) * num_producers * 2;
+    Pool pool(num_threads);
+    auto start = std::chrono::steady_clock::now();
+
+    // half of the work comes from external producers
+    // and half is spawned from inside the pool
+    std::vector<std::thread> producers;
+    for (uint32_t p = 0; p < num_producers; ++p) {
+        producers.emplace_back([&pool, &sum, num_tasks, num_producers] {
+            uint32_t n = num_tasks / num_producers / 2;
+            for (uint32_t i = 0; i < n; ++i) {
+                pool.enqueue([&sum, &pool] {
+                    sum.fetch_add(1, std::memory_order_relaxed);
+                    pool.enqueue([&sum] { sum.fetch_add(1, std::memory_order_relaxed); });
+                });
+            }
+        });
+    }
+    for (auto& producer : producers) {
+        producer.join();
+    }
+    while (sum.load() < expected_sum) {
+        std::this_thread::yield();
+    }
+    auto end = std::chrono::steady_clock::now();
+    EXPECT_EQ(expected_sum, sum);
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+TEST(ThreadPool_test, contention_benchmark) {
+    constexpr uint32_t NUM_TASKS = 200000;
+    uint32_t num_threads = std::max(2u, std::thread::hardware_concurrency());
+    uint32_t num_producers = 4;
+
+    double classic = run_contention_benchmark<ClassicThreadPool>(num_threads, num_producers, NUM_TASKS);
+    double stealing = run_contention_benchmark<ThreadPool>(num_threads, num_producers, NUM_TASKS);
+    fmt::print("contention_benchmark threads={} tasks={} classic={:.1f}msec work_stealing={:.1f}msec\n",
+            num_threads, NUM_TASKS, classic, stealing);
+}
+
+TEST(ThreadPool_test, adaptive_size) {
+    ThreadPool::Options options;
+    options.numThreads = 1;
+    options.minThreads = 1;
+    options.maxThreads = 4;
+    options.idleTimeoutMsec = 20;
+    ThreadPool pool(options);
+    EXPECT_EQ(1, pool.getNumThreads());
+    EXPECT_EQ(4, pool.getThreadCapacity());
+
+    // a backlog of slow tasks grows the pool
+    std::atomic<size_t> max_threads { 0 };
+    std::vector<std::future<void>> futures;
+    for (uint32_t i = 0; i < 40; ++i) {
+        futures.push_back(pool.enqueue([&pool, &max_threads] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            size_t n = pool.getNumThreads();
+            size_t m = max_threads.load();
+            while (n > m && !max_threads.compare_exchange_weak(m, n)) { }
+        }));
+        std::this_thread::sleep_for(std::chrono::microseconds(600));
+    }
+    for (auto& f : futures) {
+        f.get();
+    }
+    EXPECT_LT(1, max_threads);
+    EXPECT_GE(4, max_threads);
+
+    // and idle workers retire down to the min
+    auto wait_for_threads = [&pool](size_t n) {
+        for (uint32_t i = 0; i < 200 && pool.getNumThreads() != n; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return pool.getNumThreads();
+    };
+    EXPECT_EQ(1, wait_for_threads(1));
+
+    // runtime limits
+    pool.setThreadLimits(3, 10);
+    EXPECT_EQ(3, pool.getNumThreads());
+    EXPECT_EQ(4, pool.getMaxThreads());
+    pool.setThreadLimits(0, 2);
+    EXPECT_EQ(1, pool.getMinThreads());
+    EXPECT_EQ(1, wait_for_threads(1));
+    EXPECT_EQ(42, pool.enqueue([] { return 42; }).get());
+
+    // busyUsec still covers every slot
+    EXPECT_EQ(4, pool.getStats().busyUsec.size());
+}
+
+TEST(ThreadPool_test, spinning_workers) {
+    ThreadPool::Options options;
+    options.numThreads = 2;
+    ThreadPool pool(options);
+    // force spinning on, even on a single cpu
+    pool.setSpinUsec(200);
+    EXPECT_EQ(200, pool.getSpinUsec());
+
+    // ping-pong: each task arrives while the workers are idle
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < 2000; ++i) {
+        sum += pool.enqueue([i] { return i % 3; }).get();
+    }
+    EXPECT_EQ(1999, sum);
+
+    // fan-out from a worker
+    std::atomic<uint32_t> count { 0 };
+    pool.enqueue([&pool, &count] {
+        for (uint32_t i = 0; i < 1000; ++i) {
+            pool.post([&count] { ++count; });
+        }
+    }).get();
+    while (count < 1000) {
+        std::this_thread::yield();
+    }
+    EXPECT_EQ(1000, count);
+}
+
+TEST(ThreadPool_test, destroy_while_growing) {
+    // tasks keep posting work (which may try to grow the pool)
+    // while the pool is destroyed: this must not deadlock
+    ThreadPool::Options options;
+    options.numThreads = 1;
+    options.minThreads = 1;
+    options.maxThreads = 8;
+    for (uint32_t i = 0; i < 50; ++i) {
+        std::atomic<uint32_t> count { 0 };
+        ThreadPool* pool = nullptr;
+        // Note: spawn must outlive the pool
+        std::function<void()> spawn = [&pool, &count, &spawn] {
+            if (count.fetch_add(1) < 100000) {
+                try {
+                    pool->post(spawn);
+                    pool->post(spawn);
+                } catch (const std::runtime_error&) {
+                    // the pool is stopping
+                }
+            }
+        };
+        {
+            ThreadPool local_pool(options);
+            pool = &local_pool;
+            for (uint32_t j = 0; j < 8; ++j) {
+                pool->post(spawn);
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(100 * (i % 10)));
+        }
+        EXPECT_LT(0, count);
+    }
+}
+
+int main(int32_t argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,74 @@
+//
+// test_ThreadPoolConfig.cpp
+//
+//  Distributed under the Apache License, Version 2.0.
+//  See the accompanying file LICENSE or
+//  http://www.apache.org/licenses/LICENSE-2.0.html
+//
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include <util/ThreadPoolConfig.h>
+
+TEST(ThreadPoolConfig_test, json) {
+    ThreadPoolConfig config;
+    config.updateJsonString("{\"min_threads\":2,\"max_threads\":8,\"spin_usec\":0,\"idle_timeout_msec\":500}");
+    EXPECT_EQ(2, config.getMinThreads());
+    EXPECT_EQ(8, config.getMaxThreads());
+    EXPECT_EQ(0, config.getSpinUsec());
+    EXPECT_EQ(500, config.getIdleTimeout());
+    uint32_t version = config.getVersion();
+
+    // missing or bad keys are ignored
+    config.updateJsonString("{\"max_threads\":-3,\"greeting\":\"hello\"}");
+    EXPECT_EQ(8, config.getMaxThreads());
+    EXPECT_EQ(version, config.getVersion());
+
+    ThreadPoolConfig other;
+    other.updateJson(config.getJson());
+    EXPECT_EQ(config.getJsonString(), other.getJsonString());
+}
+
+TEST(ThreadPoolConfig_test, apply) {
+    ThreadPool::Options options;
+    options.numThreads = 1;
+    options.maxThreads = 4;
+    ThreadPool pool(options);
+
+    ThreadPoolConfig config(pool);
+    EXPECT_EQ(1, config.getMinThreads());
+    EXPECT_EQ(4, config.getMaxThreads());
+    EXPECT_FALSE(config.applyIfChanged(pool));
+
+    config.setThreadLimits(3, 4);
+    config.setIdleTimeout(20);
+    EXPECT_TRUE(config.applyIfChanged(pool));
+    EXPECT_FALSE(config.applyIfChanged(pool));
+    EXPECT_EQ(3, pool.getNumThreads());
+    EXPECT_EQ(20, pool.getIdleTimeout());
+
+    // watched changes reach the pool
+    ThreadPool::TimerHandle handle = config.watch(pool, std::chrono::milliseconds(5));
+    config.updateJsonString("{\"min_threads\":1}");
+    for (uint32_t i = 0; i < 200 && pool.getMinThreads() != 1; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_EQ(1, pool.getMinThreads());
+
+    // surplus workers retire once idle: stop the watcher, which wakes one
+    // every period and would keep resetting their idle timeouts
+    handle.cancel();
+    for (uint32_t i = 0; i < 200 && pool.getNumThreads() != 1; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_EQ(1, pool.getNumThreads());
+}
+
+int main(int32_t argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}